@@ -0,0 +1,248 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks every Thumbnailer::Method on deterministic synthetic frames,
+// across frame counts, resolutions, content types and byte budgets. Besides
+// the wall and CPU times, each benchmark reports the number of frame encodes,
+// the animation size and its mean PSNR.
+//
+// With --max_peak_heap_mb=N, the heap allocations are tracked and reported,
+// and the benchmarks whose heap high-water mark exceeds N MB fail.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../src/alloc_tracker.h"
+#include "../src/thumbnailer.h"
+#include "../src/thumbnailer_job.h"
+#include "../src/utils/synthetic_frames.h"
+#include "../src/utils/thumbnailer_utils.h"
+#include "benchmark/benchmark.h"
+
+namespace {
+
+enum Content { kNoise = 0, kGradient, kSolid, kSynthetic };
+const char* const kContentNames[] = {"noise", "gradient", "solid",
+                                     "synthetic"};
+
+const int kFrameDurationMs = 100;
+
+// Ceiling on the heap high-water mark of an animation generation, 0 if none.
+int64_t max_peak_heap_bytes = 0;
+bool ceiling_exceeded = false;
+
+// Parameters of a benchmark.
+struct Setup {
+  libwebp::Thumbnailer::Method method;
+  int num_frames;
+  int width;
+  int height;
+  Content content;
+  uint32_t budget;
+
+  bool operator<(const Setup& other) const {
+    return std::tie(method, num_frames, width, height, content, budget) <
+           std::tie(other.method, other.num_frames, other.width, other.height,
+                    other.content, other.budget);
+  }
+};
+
+// Returns the RGBA samples of the 'index'-th frame. Only fixed-seed mt19937
+// is used, so that the frames are the same on all platforms.
+std::vector<uint8_t> GenerateRGBA(Content content, int width, int height,
+                                  int index) {
+  std::vector<uint8_t> rgba(size_t(width) * height * 4, 0xff);
+  std::mt19937 rng(index);
+  const uint8_t solid[3] = {uint8_t(rng() & 0xff), uint8_t(rng() & 0xff),
+                            uint8_t(rng() & 0xff)};
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t* const pixel = &rgba[(size_t(y) * width + x) * 4];
+      if (content == kNoise) {
+        for (int c = 0; c < 3; ++c) pixel[c] = rng() & 0xff;
+      } else if (content == kSolid) {
+        for (int c = 0; c < 3; ++c) pixel[c] = solid[c];
+      } else {
+        // Diagonal gradient scrolling by a few pixels per frame.
+        const int shift = 4 * index;
+        pixel[0] = ((x + shift) * 255 / width) & 0xff;
+        pixel[1] = (y * 255 / height) & 0xff;
+        pixel[2] = ((x + y + shift) * 255 / (width + height)) & 0xff;
+      }
+    }
+  }
+  return rgba;
+}
+
+std::vector<libwebp::Frame> GenerateFrames(const Setup& setup) {
+  std::vector<libwebp::Frame> frames;
+  if (setup.content == kSynthetic) {
+    // Realistic content: textured background, sprites, text and scene cuts.
+    libwebp::SyntheticOptions options;
+    options.width = setup.width;
+    options.height = setup.height;
+    options.num_frames = setup.num_frames;
+    options.frame_duration_ms = kFrameDurationMs;
+    options.scene_length = 50;
+    if (libwebp::GenerateSyntheticFrames(options, &frames) != libwebp::kOk) {
+      return {};
+    }
+    return frames;
+  }
+  for (int i = 0; i < setup.num_frames; ++i) {
+    EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pic.get());
+    pic->use_argb = 1;
+    pic->width = setup.width;
+    pic->height = setup.height;
+    const std::vector<uint8_t> rgba =
+        GenerateRGBA(setup.content, setup.width, setup.height, i);
+    if (!WebPPictureImportRGBA(pic.get(), rgba.data(), setup.width * 4)) {
+      return {};
+    }
+    frames.push_back({std::move(pic), (i + 1) * kFrameDurationMs});
+  }
+  return frames;
+}
+
+void BM_GenerateAnimation(benchmark::State& state, const Setup& setup) {
+  const std::vector<libwebp::Frame> frames = GenerateFrames(setup);
+  if (frames.empty()) {
+    state.SkipWithError("Could not generate the frames.");
+    return;
+  }
+  thumbnailer::ThumbnailerOption option;
+  option.set_soft_max_size(setup.budget);
+  option.set_hard_max_size(setup.budget);
+
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  int num_encodes = 0;
+  int64_t num_allocations = 0;
+  int64_t peak_heap_bytes = 0;
+  for (auto _ : state) {
+    libwebp::Thumbnailer thumbnailer(option);
+    for (const libwebp::Frame& frame : frames) {
+      if (thumbnailer.AddFrame(*frame.pic, frame.timestamp) !=
+          libwebp::Thumbnailer::kOk) {
+        state.SkipWithError("Could not add the frames.");
+        WebPDataClear(&webp_data);
+        return;
+      }
+    }
+    WebPDataClear(&webp_data);
+    if (thumbnailer.GenerateAnimation(&webp_data, setup.method) !=
+        libwebp::Thumbnailer::kOk) {
+      state.SkipWithError("Could not generate the animation.");
+      WebPDataClear(&webp_data);
+      return;
+    }
+    num_encodes = thumbnailer.stats().num_encodes();
+    num_allocations = thumbnailer.stats().num_allocations();
+    peak_heap_bytes =
+        std::max(peak_heap_bytes, thumbnailer.stats().peak_heap_bytes());
+  }
+  if (max_peak_heap_bytes > 0) {
+    state.counters["allocs"] = num_allocations;
+    state.counters["peak_heap"] = peak_heap_bytes;
+    if (peak_heap_bytes > max_peak_heap_bytes) {
+      state.SkipWithError("The heap high-water mark exceeds the ceiling.");
+      ceiling_exceeded = true;
+    }
+  }
+
+  // The quality is measured once, outside of the timed loop.
+  libwebp::ThumbnailStatsPSNR stats;
+  if (webp_data.size > 0 &&
+      libwebp::AnimData2PSNR(frames, &webp_data, &stats) == libwebp::kOk) {
+    state.counters["psnr"] = stats.mean_psnr;
+  }
+  state.counters["encodes"] = num_encodes;
+  state.counters["size"] = webp_data.size;
+  WebPDataClear(&webp_data);
+}
+
+// Returns the benchmarked setups: a sweep over each of the frame counts,
+// resolutions and budgets, for each method and content type.
+std::set<Setup> GetSetups() {
+  const int kFrameCounts[] = {10, 100, 500};
+  const int kResolutions[][2] = {
+      {160, 90}, {320, 180}, {640, 360}, {1280, 720}, {1920, 1080}};
+  const uint32_t kBudgets[] = {50000, 153600, 500000};
+  const uint32_t kDefaultBudget = 153600;
+
+  std::set<Setup> setups;
+  for (libwebp::Thumbnailer::Method method :
+       libwebp::Thumbnailer::kMethodList) {
+    for (Content content : {kNoise, kGradient, kSolid, kSynthetic}) {
+      for (int num_frames : kFrameCounts) {
+        setups.insert({method, num_frames, 160, 90, content, kDefaultBudget});
+      }
+      for (const auto& resolution : kResolutions) {
+        setups.insert({method, 10, resolution[0], resolution[1], content,
+                       kDefaultBudget});
+      }
+      for (uint32_t budget : kBudgets) {
+        setups.insert({method, 100, 160, 90, content, budget});
+      }
+    }
+  }
+  return setups;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // Extracts the flags of this binary, the others are for the library.
+  const std::string kMaxPeakHeapFlag = "--max_peak_heap_mb=";
+  int num_args = 1;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, kMaxPeakHeapFlag.size(), kMaxPeakHeapFlag) == 0) {
+      max_peak_heap_bytes =
+          std::stoll(arg.substr(kMaxPeakHeapFlag.size())) << 20;
+    } else {
+      argv[num_args++] = argv[i];
+    }
+  }
+  argc = num_args;
+  if (max_peak_heap_bytes > 0 && !libwebp::AllocTracker::Enable()) {
+    std::cerr << "Allocation tracking is not supported." << std::endl;
+    return 1;
+  }
+
+  for (const Setup& setup : GetSetups()) {
+    const std::string name =
+        std::string("GenerateAnimation/") + libwebp::MethodName(setup.method) +
+        "/frames:" + std::to_string(setup.num_frames) + "/" +
+        std::to_string(setup.width) + "x" + std::to_string(setup.height) +
+        "/" + kContentNames[setup.content] +
+        "/budget:" + std::to_string(setup.budget);
+    benchmark::RegisterBenchmark(name.c_str(), BM_GenerateAnimation, setup)
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime()
+        ->MeasureProcessCPUTime();
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  return ceiling_exceeded ? 1 : 0;
+}
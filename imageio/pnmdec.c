@@ -13,9 +13,16 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#include <io.h>      // for _read()
+#define read _read
+#else
+#include <unistd.h>  // for read()
+#endif
 
 #include "webp/encode.h"
 #include "./imageio_util.h"
@@ -137,10 +144,33 @@ static size_t ReadPAMFields(PNMInfo* const info, size_t off) {
   return off;
 }
 
+// Reads the next decimal number of a P5/P6 header into 'value', skipping the
+// whitespace and comments before it. The number must be followed by a single
+// whitespace character, which is consumed. Returns the offset after it, or 0
+// on error.
+static size_t ReadNumber(const uint8_t* const data, size_t off,
+                         size_t data_size, int* const value) {
+  while (off < data_size) {
+    if (data[off] == '#') {  // skip comment
+      while (off < data_size && data[off] != '\n') ++off;
+    } else if (isspace((int)data[off])) {
+      ++off;
+    } else {
+      break;
+    }
+  }
+  if (off == data_size || !isdigit((int)data[off])) return 0;
+  *value = 0;
+  while (off < data_size && isdigit((int)data[off])) {
+    if (*value > 65535) return 0;  // too large for any valid field
+    *value = *value * 10 + (data[off++] - '0');
+  }
+  if (off == data_size || !isspace((int)data[off])) return 0;
+  return off + 1;
+}
+
 static size_t ReadHeader(PNMInfo* const info) {
   size_t off = 0;
-  char out[MAX_LINE_SIZE + 1];
-  size_t out_size;
   if (info == NULL) return 0;
   if (info->data == NULL || info->data_size < kMinPNMHeaderSize) return 0;
 
@@ -151,17 +181,26 @@ static size_t ReadHeader(PNMInfo* const info) {
   info->depth = 0;
   info->max_value = 0;
 
-  off = ReadLine(info->data, off, info->data_size, out, &out_size);
-  if (off == 0 || sscanf(out, "P%d", &info->type) != 1) return 0;
+  // The header is a sequence of whitespace-separated tokens, e.g.
+  // "P6 320 240 255\n" on a single line, except for P7 which has one field
+  // per line.
+  if (info->data[0] != 'P' || !isdigit((int)info->data[1]) ||
+      !isspace((int)info->data[2])) {
+    return 0;
+  }
+  info->type = info->data[1] - '0';
+  off = 2;
   if (info->type == 7) {
     off = ReadPAMFields(info, off);
   } else {
-    off = ReadLine(info->data, off, info->data_size, out, &out_size);
-    if (off == 0 || sscanf(out, "%d %d", &info->width, &info->height) != 2) {
-      return 0;
+    off = ReadNumber(info->data, off, info->data_size, &info->width);
+    if (off != 0) {
+      off = ReadNumber(info->data, off, info->data_size, &info->height);
     }
-    off = ReadLine(info->data, off, info->data_size, out, &out_size);
-    if (off == 0 || sscanf(out, "%d", &info->max_value) != 1) return 0;
+    if (off != 0) {
+      off = ReadNumber(info->data, off, info->data_size, &info->max_value);
+    }
+    if (off == 0) return 0;
 
     // finish initializing missing fields
     info->depth = (info->type == 5) ? 1 : 3;
@@ -177,12 +216,81 @@ static size_t ReadHeader(PNMInfo* const info) {
   return off;
 }
 
+// Returns true if the format and dimensions parsed in 'info' are supported.
+static int IsSupported(const PNMInfo* const info) {
+  if (info->type < 5 || info->type > 7) {
+    fprintf(stderr, "Unsupported P%d PNM format.\n", info->type);
+    return 0;
+  }
+  if (info->width > WEBP_MAX_DIMENSION || info->height > WEBP_MAX_DIMENSION) {
+    fprintf(stderr, "Invalid %dx%d dimension for PNM\n",
+                    info->width, info->height);
+    return 0;
+  }
+  return 1;
+}
+
+// Returns the number of channels of the converted RGB(A) output.
+static int GetOutputDepth(const PNMInfo* const info, int keep_alpha) {
+  return (info->depth == 1 || info->depth == 3 || !keep_alpha) ? 3 : 4;
+}
+
+// Converts one row of PNM samples to RGB(A), depending on GetOutputDepth().
+static void ConvertRow(const PNMInfo* const info, const uint8_t* const in,
+                       int keep_alpha, uint8_t* const tmp_rgb) {
+  int i;
+  const int sample_size = (info->max_value > 255) ? 2 : 1;
+  // We only optimize for the sample_size=1, max_value=255, depth=1 case.
+  if (info->max_value == 255 && info->depth >= 3) {
+    // RGB or RGBA
+    if (info->depth == 3 || keep_alpha) {
+      memcpy(tmp_rgb, in, info->depth * info->width * sizeof(*in));
+    } else {
+      assert(info->depth == 4 && !keep_alpha);
+      for (i = 0; i < info->width; ++i) {
+        tmp_rgb[3 * i + 0] = in[4 * i + 0];
+        tmp_rgb[3 * i + 1] = in[4 * i + 1];
+        tmp_rgb[3 * i + 2] = in[4 * i + 2];
+      }
+    }
+  } else {
+    // Unoptimized case, we need to handle non-trivial operations:
+    //   * convert 16b to 8b (if max_value > 255)
+    //   * rescale to [0..255] range (if max_value != 255)
+    //   * drop the alpha channel (if keep_alpha is false)
+    const uint32_t round = info->max_value / 2;
+    int k = 0;
+    for (i = 0; i < info->width * info->depth; ++i) {
+      uint32_t v = (sample_size == 2) ? 256u * in[2 * i + 0] + in[2 * i + 1]
+                 : in[i];
+      if (info->max_value != 255) v = (v * 255u + round) / info->max_value;
+      if (v > 255u) v = 255u;
+      if (info->depth > 2) {
+        if (!keep_alpha && info->depth == 4 && (i % 4) == 3) {
+          // skip alpha
+        } else {
+          tmp_rgb[k] = v;
+          k += 1;
+        }
+      } else if (info->depth == 1 || (i % 2) == 0) {
+        tmp_rgb[k + 0] = tmp_rgb[k + 1] = tmp_rgb[k + 2] = v;
+        k += 3;
+      } else if (keep_alpha && info->depth == 2) {
+        tmp_rgb[k] = v;
+        k += 1;
+      } else {
+        // skip alpha
+      }
+    }
+  }
+}
+
 int ReadPNM(const uint8_t* const data, size_t data_size,
             WebPPicture* const pic, int keep_alpha,
             struct Metadata* const metadata) {
   int ok = 0;
-  int i, j;
-  uint64_t stride, pixel_bytes, sample_size, depth;
+  int j;
+  uint64_t stride, pixel_bytes, depth;
   uint8_t* rgb = NULL, *tmp_rgb;
   size_t offset;
   PNMInfo info;
@@ -195,27 +303,17 @@ int ReadPNM(const uint8_t* const data, size_t data_size,
     goto End;
   }
 
-  if (info.type < 5 || info.type > 7) {
-    fprintf(stderr, "Unsupported P%d PNM format.\n", info.type);
-    goto End;
-  }
-
   // Some basic validations.
+  if (!IsSupported(&info)) goto End;
   if (pic == NULL) goto End;
-  if (info.width > WEBP_MAX_DIMENSION || info.height > WEBP_MAX_DIMENSION) {
-    fprintf(stderr, "Invalid %dx%d dimension for PNM\n",
-                    info.width, info.height);
-    goto End;
-  }
 
   pixel_bytes = (uint64_t)info.width * info.height * info.bytes_per_px;
   if (data_size < offset + pixel_bytes) {
     fprintf(stderr, "Truncated PNM file (P%d).\n", info.type);
     goto End;
   }
-  sample_size = (info.max_value > 255) ? 2 : 1;
   // final depth
-  depth = (info.depth == 1 || info.depth == 3 || !keep_alpha) ? 3 : 4;
+  depth = GetOutputDepth(&info, keep_alpha);
   stride = depth * info.width;
   if (stride != (size_t)stride ||
       !ImgIoUtilCheckSizeArgumentsOverflow(stride, info.height)) {
@@ -226,54 +324,12 @@ int ReadPNM(const uint8_t* const data, size_t data_size,
   if (rgb == NULL) goto End;
 
   // Convert input.
-  // We only optimize for the sample_size=1, max_value=255, depth=1 case.
   tmp_rgb = rgb;
   for (j = 0; j < info.height; ++j) {
     const uint8_t* in = data + offset;
     offset += info.bytes_per_px * info.width;
     assert(offset <= data_size);
-    if (info.max_value == 255 && info.depth >= 3) {
-      // RGB or RGBA
-      if (info.depth == 3 || keep_alpha) {
-        memcpy(tmp_rgb, in, info.depth * info.width * sizeof(*in));
-      } else {
-        assert(info.depth == 4 && !keep_alpha);
-        for (i = 0; i < info.width; ++i) {
-          tmp_rgb[3 * i + 0] = in[4 * i + 0];
-          tmp_rgb[3 * i + 1] = in[4 * i + 1];
-          tmp_rgb[3 * i + 2] = in[4 * i + 2];
-        }
-      }
-    } else {
-      // Unoptimized case, we need to handle non-trivial operations:
-      //   * convert 16b to 8b (if max_value > 255)
-      //   * rescale to [0..255] range (if max_value != 255)
-      //   * drop the alpha channel (if keep_alpha is false)
-      const uint32_t round = info.max_value / 2;
-      int k = 0;
-      for (i = 0; i < info.width * info.depth; ++i) {
-        uint32_t v = (sample_size == 2) ? 256u * in[2 * i + 0] + in[2 * i + 1]
-                   : in[i];
-        if (info.max_value != 255) v = (v * 255u + round) / info.max_value;
-        if (v > 255u) v = 255u;
-        if (info.depth > 2) {
-          if (!keep_alpha && info.depth == 4 && (i % 4) == 3) {
-            // skip alpha
-          } else {
-            tmp_rgb[k] = v;
-            k += 1;
-          }
-        } else if (info.depth == 1 || (i % 2) == 0) {
-          tmp_rgb[k + 0] = tmp_rgb[k + 1] = tmp_rgb[k + 2] = v;
-          k += 3;
-        } else if (keep_alpha && info.depth == 2) {
-          tmp_rgb[k] = v;
-          k += 1;
-        } else {
-          // skip alpha
-        }
-      }
-    }
+    ConvertRow(&info, in, keep_alpha, tmp_rgb);
     tmp_rgb += stride;
   }
 
@@ -294,3 +350,185 @@ int ReadPNM(const uint8_t* const data, size_t data_size,
 }
 
 // -----------------------------------------------------------------------------
+// PNM stream decoding
+
+static const size_t kMinPNMStreamBufferSize = 4096;
+
+struct PNMStream {
+  int fd;
+  uint8_t* buffer;     // Fixed-size buffer, reused for all the images.
+  size_t buffer_size;
+  size_t start, end;   // Unconsumed bytes are in [start, end).
+  int eof;
+  uint8_t* rgb;        // Conversion buffer, reused across images.
+  size_t rgb_size;
+};
+
+PNMStream* PNMStreamNew(int fd, size_t buffer_size) {
+  PNMStream* const stream = (PNMStream*)calloc(1, sizeof(*stream));
+  if (stream == NULL) return NULL;
+  if (buffer_size < kMinPNMStreamBufferSize) {
+    buffer_size = kMinPNMStreamBufferSize;
+  }
+  stream->buffer = (uint8_t*)malloc(buffer_size);
+  if (stream->buffer == NULL) {
+    free(stream);
+    return NULL;
+  }
+  stream->fd = fd;
+  stream->buffer_size = buffer_size;
+  return stream;
+}
+
+void PNMStreamDelete(PNMStream* const stream) {
+  if (stream == NULL) return;
+  free(stream->buffer);
+  free(stream->rgb);
+  free(stream);
+}
+
+// Moves the unconsumed bytes to the front of the buffer, then reads from the
+// file descriptor until at least 'min_size' bytes are buffered or the end of
+// the stream is reached. Returns false on read error.
+static int FillBuffer(PNMStream* const stream, size_t min_size) {
+  assert(min_size <= stream->buffer_size);
+  if (stream->start > 0) {
+    memmove(stream->buffer, stream->buffer + stream->start,
+            stream->end - stream->start);
+    stream->end -= stream->start;
+    stream->start = 0;
+  }
+  while (!stream->eof && stream->end < min_size) {
+    const int size = (int)read(stream->fd, stream->buffer + stream->end,
+                               (unsigned int)(stream->buffer_size -
+                                              stream->end));
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Error reading PNM stream: %s\n", strerror(errno));
+      return 0;
+    }
+    if (size == 0) {
+      stream->eof = 1;
+    } else {
+      stream->end += size;
+    }
+  }
+  return 1;
+}
+
+// Returns true if 'data' starts with a complete header, tokenized like
+// ReadHeader() does: the magic number, then the 'ENDHDR' line for P7 or the
+// width, height and maximum value tokens and their trailing whitespace
+// character for P5/P6. Also returns true if 'data' cannot start a valid
+// header, so that ReadHeader() reports the error.
+static int HasCompleteHeader(const uint8_t* const data, size_t data_size) {
+  int num_tokens = 0;
+  size_t off = 2;
+  if (data_size < 2) return 0;
+  if (data[0] != 'P' || !isdigit((int)data[1])) return 1;
+  if (data[1] == '7') {
+    while (off < data_size) {
+      const uint8_t* const eol =
+          (const uint8_t*)memchr(data + off, '\n', data_size - off);
+      size_t line_size;
+      if (eol == NULL) return 0;
+      line_size = eol - (data + off);
+      if (line_size >= 6 && !memcmp(data + off, "ENDHDR", 6)) return 1;
+      off += line_size + 1;
+    }
+    return 0;
+  }
+  while (off < data_size) {
+    if (data[off] == '#') {  // comment, up to the end of the line
+      while (off < data_size && data[off] != '\n') ++off;
+    } else if (isspace((int)data[off])) {
+      ++off;
+    } else {
+      while (off < data_size && !isspace((int)data[off])) ++off;
+      if (off == data_size) return 0;  // the token may go on
+      if (++num_tokens == 3) return 1;
+    }
+  }
+  return 0;
+}
+
+int PNMStreamReadNext(PNMStream* const stream, WebPPicture* const pic,
+                      int keep_alpha) {
+  PNMInfo info;
+  size_t offset, row_size;
+  uint64_t stride, depth;
+  int y;
+
+  if (stream == NULL || pic == NULL) return -1;
+
+  // Buffer a complete header.
+  while (!HasCompleteHeader(stream->buffer + stream->start,
+                            stream->end - stream->start)) {
+    const size_t buffered = stream->end - stream->start;
+    if (stream->eof) {
+      if (buffered == 0) return 0;  // Clean end of stream.
+      fprintf(stderr, "Truncated PNM header in stream.\n");
+      return -1;
+    }
+    if (buffered == stream->buffer_size) {
+      fprintf(stderr, "PNM header does not fit the stream buffer.\n");
+      return -1;
+    }
+    if (!FillBuffer(stream, buffered + 1)) return -1;
+  }
+
+  info.data = stream->buffer + stream->start;
+  info.data_size = stream->end - stream->start;
+  offset = ReadHeader(&info);
+  if (offset == 0) {
+    fprintf(stderr, "Error parsing PNM header.\n");
+    return -1;
+  }
+  if (!IsSupported(&info)) return -1;
+  stream->start += offset;
+
+  row_size = (size_t)info.bytes_per_px * info.width;
+  if (row_size > stream->buffer_size) {
+    fprintf(stderr, "PNM row of %d bytes does not fit the stream buffer.\n",
+            (int)row_size);
+    return -1;
+  }
+  depth = GetOutputDepth(&info, keep_alpha);
+  stride = depth * info.width;
+  if (stride != (size_t)stride ||
+      !ImgIoUtilCheckSizeArgumentsOverflow(stride, info.height)) {
+    return -1;
+  }
+  if (stride * info.height > stream->rgb_size) {
+    uint8_t* const rgb =
+        (uint8_t*)realloc(stream->rgb, (size_t)stride * info.height);
+    if (rgb == NULL) return -1;
+    stream->rgb = rgb;
+    stream->rgb_size = (size_t)stride * info.height;
+  }
+
+  // Convert the rows as they arrive, so that only the fixed-size buffer is
+  // needed on top of the converted image.
+  for (y = 0; y < info.height; ++y) {
+    if (stream->end - stream->start < row_size) {
+      if (!FillBuffer(stream, row_size)) return -1;
+      if (stream->end - stream->start < row_size) {
+        fprintf(stderr, "Truncated PNM image in stream (P%d).\n", info.type);
+        return -1;
+      }
+    }
+    ConvertRow(&info, stream->buffer + stream->start, keep_alpha,
+               stream->rgb + (size_t)stride * y);
+    stream->start += row_size;
+  }
+
+  pic->width = info.width;
+  pic->height = info.height;
+  if (!((depth == 4) ? WebPPictureImportRGBA(pic, stream->rgb, (int)stride)
+                     : WebPPictureImportRGB(pic, stream->rgb, (int)stride))) {
+    return -1;
+  }
+  return 1;
+}
+
+// -----------------------------------------------------------------------------
@@ -30,6 +30,23 @@ int ReadPNM(const uint8_t* const data, size_t data_size,
             struct WebPPicture* const pic, int keep_alpha,
             struct Metadata* const metadata);
 
+// Streaming reader for concatenated PNM images (P5, P6 or P7), e.g. the
+// 'image2pipe' output of ffmpeg. Images are read from a file descriptor
+// through a fixed-size buffer, so the stream is never fully buffered.
+typedef struct PNMStream PNMStream;
+
+// Creates a stream reading from 'fd'. 'buffer_size' must be large enough to
+// hold a header or a row of pixels. Returns NULL on memory error.
+PNMStream* PNMStreamNew(int fd, size_t buffer_size);
+
+// Reads the next image of the stream into 'pic'. Returns 1 on success, 0 at
+// the end of the stream and -1 on error.
+int PNMStreamReadNext(PNMStream* const stream, struct WebPPicture* const pic,
+                      int keep_alpha);
+
+// Deletes the stream. Does not close the file descriptor.
+void PNMStreamDelete(PNMStream* const stream);
+
 #ifdef __cplusplus
 }    // extern "C"
 #endif
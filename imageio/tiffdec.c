@@ -151,11 +151,9 @@ static void MultARGBRow(uint8_t* ptr, int width) {
   }
 }
 
-int ReadTIFF(const uint8_t* const data, size_t data_size,
-             WebPPicture* const pic, int keep_alpha,
-             Metadata* const metadata) {
-  MyData my_data = { data, (toff_t)data_size, 0 };
-  TIFF* tif;
+// Decodes the current directory of 'tif' into 'pic'. Returns true on success.
+static int ReadTIFFDirectory(TIFF* const tif, WebPPicture* const pic,
+                             int keep_alpha) {
   uint32_t image_width, image_height, tile_width, tile_height;
   uint16_t samples_per_px = 0;
   uint16_t extra_samples = 0;
@@ -163,40 +161,21 @@ int ReadTIFF(const uint8_t* const data, size_t data_size,
   uint32_t* raster;
   int64_t alloc_size;
   int ok = 0;
-  tdir_t dircount;
 
-  if (data == NULL || data_size == 0 || data_size > INT_MAX || pic == NULL) {
-    return 0;
-  }
-
-  tif = TIFFClientOpen("Memory", "r", &my_data,
-                       MyRead, MyRead, MySeek, MyClose,
-                       MySize, MyMapFile, MyUnmapFile);
-  if (tif == NULL) {
-    fprintf(stderr, "Error! Cannot parse TIFF file\n");
-    return 0;
-  }
-
-  dircount = TIFFNumberOfDirectories(tif);
-  if (dircount > 1) {
-    fprintf(stderr, "Warning: multi-directory TIFF files are not supported.\n"
-                    "Only the first will be used, %d will be ignored.\n",
-                    dircount - 1);
-  }
   if (!TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples_per_px)) {
     fprintf(stderr, "Error! Cannot retrieve TIFF samples-per-pixel info.\n");
-    goto End;
+    return 0;
   }
-  if (samples_per_px < 3 || samples_per_px > 4) goto End;  // not supported
+  if (samples_per_px < 3 || samples_per_px > 4) return 0;  // not supported
 
   if (!(TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &image_width) &&
         TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &image_height))) {
     fprintf(stderr, "Error! Cannot retrieve TIFF image dimensions.\n");
-    goto End;
+    return 0;
   }
   if (!ImgIoUtilCheckSizeArgumentsOverflow((uint64_t)image_width * image_height,
                                            sizeof(*raster))) {
-    goto End;
+    return 0;
   }
   // According to spec, a tile can be bigger than the image. However it should
   // be a multiple of 16 and not way too large, so check that it's not more than
@@ -206,18 +185,18 @@ int ReadTIFF(const uint8_t* const data, size_t data_size,
       (TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_height) &&
        tile_height > 32 && tile_height / 2 > image_height)) {
     fprintf(stderr, "Error! TIFF tile dimensions are too big.\n");
-    goto End;
+    return 0;
   }
   if (samples_per_px > 3 && !TIFFGetField(tif, TIFFTAG_EXTRASAMPLES,
                                           &extra_samples, &extra_samples_ptr)) {
     fprintf(stderr, "Error! Cannot retrieve TIFF ExtraSamples info.\n");
-    goto End;
+    return 0;
   }
 
   // _Tiffmalloc uses a signed type for size.
   alloc_size =
       (int64_t)((uint64_t)image_width * image_height * sizeof(*raster));
-  if (alloc_size < 0 || alloc_size != (tsize_t)alloc_size) goto End;
+  if (alloc_size < 0 || alloc_size != (tsize_t)alloc_size) return 0;
 
   raster = (uint32*)_TIFFmalloc((tsize_t)alloc_size);
   if (raster != NULL) {
@@ -248,6 +227,36 @@ int ReadTIFF(const uint8_t* const data, size_t data_size,
   } else {
     fprintf(stderr, "Error allocating TIFF RGBA memory!\n");
   }
+  return ok;
+}
+
+int ReadTIFF(const uint8_t* const data, size_t data_size,
+             WebPPicture* const pic, int keep_alpha,
+             Metadata* const metadata) {
+  MyData my_data = { data, (toff_t)data_size, 0 };
+  TIFF* tif;
+  int ok = 0;
+  tdir_t dircount;
+
+  if (data == NULL || data_size == 0 || data_size > INT_MAX || pic == NULL) {
+    return 0;
+  }
+
+  tif = TIFFClientOpen("Memory", "r", &my_data,
+                       MyRead, MyRead, MySeek, MyClose,
+                       MySize, MyMapFile, MyUnmapFile);
+  if (tif == NULL) {
+    fprintf(stderr, "Error! Cannot parse TIFF file\n");
+    return 0;
+  }
+
+  dircount = TIFFNumberOfDirectories(tif);
+  if (dircount > 1) {
+    fprintf(stderr, "Warning: multi-directory TIFF files are not supported.\n"
+                    "Only the first will be used, %d will be ignored.\n",
+                    dircount - 1);
+  }
+  ok = ReadTIFFDirectory(tif, pic, keep_alpha);
 
   if (ok) {
     if (metadata != NULL) {
@@ -259,10 +268,50 @@ int ReadTIFF(const uint8_t* const data, size_t data_size,
       }
     }
   }
- End:
   TIFFClose(tif);
   return ok;
 }
+
+int ReadTIFFPages(const uint8_t* const data, size_t data_size, int keep_alpha,
+                  TIFFPageHook hook, void* const user_data) {
+  MyData my_data = { data, (toff_t)data_size, 0 };
+  TIFF* tif;
+  int num_pages = 0;
+
+  if (data == NULL || data_size == 0 || data_size > INT_MAX || hook == NULL) {
+    return -1;
+  }
+
+  tif = TIFFClientOpen("Memory", "r", &my_data,
+                       MyRead, MyRead, MySeek, MyClose,
+                       MySize, MyMapFile, MyUnmapFile);
+  if (tif == NULL) {
+    fprintf(stderr, "Error! Cannot parse TIFF file\n");
+    return -1;
+  }
+
+  // The same TIFF handle (and thus the same parsed header and decoder state)
+  // is reused for all the directories.
+  do {
+    WebPPicture pic;
+    if (!WebPPictureInit(&pic)) {
+      num_pages = -1;
+      break;
+    }
+    pic.use_argb = 1;
+    if (!ReadTIFFDirectory(tif, &pic, keep_alpha)) {
+      fprintf(stderr, "Error! Cannot decode TIFF page %d\n", num_pages);
+      WebPPictureFree(&pic);
+      num_pages = -1;
+      break;
+    }
+    // Ownership of 'pic' is transferred to the hook.
+    if (!hook(&pic, num_pages++, user_data)) break;
+  } while (TIFFReadDirectory(tif));
+
+  TIFFClose(tif);
+  return num_pages;
+}
 #else  // !WEBP_HAVE_TIFF
 int ReadTIFF(const uint8_t* const data, size_t data_size,
              struct WebPPicture* const pic, int keep_alpha,
@@ -276,6 +325,18 @@ int ReadTIFF(const uint8_t* const data, size_t data_size,
           "development package before building.\n");
   return 0;
 }
+
+int ReadTIFFPages(const uint8_t* const data, size_t data_size, int keep_alpha,
+                  TIFFPageHook hook, void* const user_data) {
+  (void)data;
+  (void)data_size;
+  (void)keep_alpha;
+  (void)hook;
+  (void)user_data;
+  fprintf(stderr, "TIFF support not compiled. Please install the libtiff "
+          "development package before building.\n");
+  return -1;
+}
 #endif  // WEBP_HAVE_TIFF
 
 // -----------------------------------------------------------------------------
@@ -30,6 +30,20 @@ int ReadTIFF(const uint8_t* const data, size_t data_size,
              struct WebPPicture* const pic, int keep_alpha,
              struct Metadata* const metadata);
 
+// Called by ReadTIFFPages() for each decoded page, in file order. Ownership of
+// 'pic' is transferred to the hook, which must eventually call
+// WebPPictureFree() on it. Returns false to stop decoding further pages.
+typedef int (*TIFFPageHook)(struct WebPPicture* const pic, int page,
+                            void* const user_data);
+
+// Reads all the directories (pages) of a multi-page TIFF from 'data', passing
+// each one as an ARGB picture to 'hook'. The TIFF is parsed only once.
+// Returns the number of pages passed to 'hook', including the one that stopped
+// the decoding if any, or -1 on error. The pages decoded before an error were
+// already passed to 'hook'.
+int ReadTIFFPages(const uint8_t* const data, size_t data_size, int keep_alpha,
+                  TIFFPageHook hook, void* const user_data);
+
 #ifdef __cplusplus
 }    // extern "C"
 #endif
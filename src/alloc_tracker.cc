@@ -0,0 +1,95 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "alloc_tracker.h"
+
+namespace libwebp {
+
+namespace {
+
+// The scope is read by the allocation functions, which must not allocate:
+// the initial-exec model does not allocate the thread-local storage lazily.
+__attribute__((tls_model("initial-exec"))) thread_local AllocScope*
+    current_scope = nullptr;
+
+void UpdateMax(std::atomic<int64_t>* const max, int64_t value) {
+  int64_t old_max = max->load(std::memory_order_relaxed);
+  while (value > old_max &&
+         !max->compare_exchange_weak(old_max, value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace
+
+std::atomic<bool> AllocTracker::enabled_(false);
+std::atomic<bool> AllocTracker::has_hooks_(false);
+std::atomic<bool> AllocTracker::tracks_malloc_(false);
+
+bool AllocTracker::Enable() {
+  if (!has_hooks_) return false;
+  enabled_ = true;
+  return true;
+}
+
+bool AllocTracker::TracksMalloc() { return tracks_malloc_; }
+
+bool AllocTracker::RegisterHooks(bool tracks_malloc) {
+  tracks_malloc_ = tracks_malloc;
+  has_hooks_ = true;
+  return true;
+}
+
+void AllocScope::Start() {
+  parent_ = current_scope;
+  num_allocations_ = 0;
+  allocated_bytes_ = 0;
+  current_bytes_ = 0;
+  peak_bytes_ = 0;
+}
+
+AllocScope::Counters AllocScope::counters() const {
+  return {num_allocations_, allocated_bytes_, current_bytes_, peak_bytes_};
+}
+
+void AllocScope::ResetPeak() { peak_bytes_ = current_bytes_.load(); }
+
+AllocScope* AllocScope::Current() { return current_scope; }
+
+void AllocScope::RecordAllocation(size_t size) {
+  for (AllocScope* scope = current_scope; scope != nullptr;
+       scope = scope->parent_) {
+    scope->num_allocations_.fetch_add(1, std::memory_order_relaxed);
+    scope->allocated_bytes_.fetch_add(size, std::memory_order_relaxed);
+    UpdateMax(&scope->peak_bytes_,
+              scope->current_bytes_.fetch_add(size, std::memory_order_relaxed) +
+                  size);
+  }
+}
+
+void AllocScope::RecordFree(size_t size) {
+  for (AllocScope* scope = current_scope; scope != nullptr;
+       scope = scope->parent_) {
+    scope->current_bytes_.fetch_sub(size, std::memory_order_relaxed);
+  }
+}
+
+ScopedAllocScope::ScopedAllocScope(AllocScope* const scope)
+    : previous_(current_scope) {
+  current_scope = scope;
+}
+
+ScopedAllocScope::~ScopedAllocScope() { current_scope = previous_; }
+
+}  // namespace libwebp
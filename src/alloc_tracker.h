@@ -0,0 +1,106 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_ALLOC_TRACKER_H_
+#define THUMBNAILER_SRC_ALLOC_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace libwebp {
+
+// Opt-in accounting of heap allocations. Allocations are only counted in
+// binaries linking //src:alloc_tracker_hooks, which replaces the global
+// operator new and delete. Those of libwebp and other C code (malloc) are
+// only counted in builds defining THUMBNAILER_TRACK_MALLOC, where the hooks
+// interpose malloc() instead. Requires glibc.
+class AllocTracker {
+ public:
+  // Starts counting the allocations of the AllocScopes. Returns false if
+  // tracking is not supported by this binary.
+  static bool Enable();
+
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Returns true if the allocations of libwebp are counted.
+  static bool TracksMalloc();
+
+  // Called by the hooks before main(). 'tracks_malloc' tells whether they
+  // interpose malloc(). Returns true.
+  static bool RegisterHooks(bool tracks_malloc);
+
+ private:
+  static std::atomic<bool> enabled_;
+  static std::atomic<bool> has_hooks_;
+  static std::atomic<bool> tracks_malloc_;
+};
+
+// Counts the heap allocations of a piece of work, e.g. a thumbnailer call and
+// the thread pool tasks it runs (see ScopedAllocScope). Thread-safe.
+class AllocScope {
+ public:
+  // Byte counts are relative to the start of the scope. Blocks allocated
+  // before it and freed within it make them negative.
+  struct Counters {
+    int64_t num_allocations;
+    int64_t allocated_bytes;
+    int64_t current_bytes;  // Allocated minus freed bytes.
+
+    // Highest 'current_bytes' since the start or the last ResetPeak().
+    int64_t peak_bytes;
+  };
+
+  // Zeroes the counters and nests this scope in the current scope of the
+  // calling thread, which then also counts its allocations.
+  void Start();
+
+  Counters counters() const;
+
+  // Restarts the high-water mark from the current usage.
+  void ResetPeak();
+
+  // Returns the current scope of the calling thread, null if none.
+  static AllocScope* Current();
+
+  // Called by the allocation functions with the usable size of the block.
+  static void RecordAllocation(size_t size);
+  static void RecordFree(size_t size);
+
+ private:
+  AllocScope* parent_ = nullptr;
+  std::atomic<int64_t> num_allocations_{0};
+  std::atomic<int64_t> allocated_bytes_{0};
+  std::atomic<int64_t> current_bytes_{0};
+  std::atomic<int64_t> peak_bytes_{0};
+};
+
+// Makes 'scope' (possibly null) the current scope of the calling thread
+// during its lifetime.
+class ScopedAllocScope {
+ public:
+  explicit ScopedAllocScope(AllocScope* const scope);
+  ~ScopedAllocScope();
+
+  ScopedAllocScope(const ScopedAllocScope&) = delete;
+  ScopedAllocScope& operator=(const ScopedAllocScope&) = delete;
+
+ private:
+  AllocScope* const previous_;
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_ALLOC_TRACKER_H_
@@ -0,0 +1,159 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Allocation functions feeding the AllocScopes. They replace the global
+// allocator of the whole binary, so they live in their own library, linked
+// only by the binaries that report allocations.
+
+#include "alloc_tracker.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <new>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define THUMBNAILER_HAVE_ALLOC_TRACKER 1
+#endif
+
+#if defined(THUMBNAILER_HAVE_ALLOC_TRACKER)
+
+namespace {
+
+void* TrackAllocation(void* const ptr) {
+  if (ptr != nullptr && libwebp::AllocScope::Current() != nullptr) {
+    libwebp::AllocScope::RecordAllocation(malloc_usable_size(ptr));
+  }
+  return ptr;
+}
+
+void TrackFree(void* const ptr) {
+  if (ptr != nullptr && libwebp::AllocScope::Current() != nullptr) {
+    libwebp::AllocScope::RecordFree(malloc_usable_size(ptr));
+  }
+}
+
+#if defined(THUMBNAILER_TRACK_MALLOC)
+const bool kTracksMalloc = true;
+#else
+const bool kTracksMalloc = false;
+#endif
+
+// Tells AllocTracker that the hooks are linked in, before main() runs.
+[[maybe_unused]] const bool kRegistered =
+    libwebp::AllocTracker::RegisterHooks(kTracksMalloc);
+
+}  // namespace
+
+#if defined(THUMBNAILER_TRACK_MALLOC)
+
+// Interposes the glibc allocator for the whole process, including libwebp.
+// operator new is left to the C++ runtime, which calls malloc().
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) { return TrackAllocation(__libc_malloc(size)); }
+
+void* calloc(size_t count, size_t size) {
+  return TrackAllocation(__libc_calloc(count, size));
+}
+
+void* realloc(void* ptr, size_t size) {
+  const size_t old_size = (ptr != nullptr) ? malloc_usable_size(ptr) : 0;
+  void* const result = __libc_realloc(ptr, size);
+  // The block is freed unless the reallocation failed.
+  if (old_size > 0 && (result != nullptr || size == 0) &&
+      libwebp::AllocScope::Current() != nullptr) {
+    libwebp::AllocScope::RecordFree(old_size);
+  }
+  return TrackAllocation(result);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  return TrackAllocation(__libc_memalign(alignment, size));
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return TrackAllocation(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+  void* const result = TrackAllocation(__libc_memalign(alignment, size));
+  if (result == nullptr) return ENOMEM;
+  *ptr = result;
+  return 0;
+}
+
+void free(void* ptr) {
+  TrackFree(ptr);
+  __libc_free(ptr);
+}
+}  // extern "C"
+
+#else  // !defined(THUMBNAILER_TRACK_MALLOC)
+
+// Replaces the global operator new and delete. While no scope is current,
+// they only cost a thread-local read on top of malloc() and free().
+void* operator new(size_t size) {
+  if (size == 0) size = 1;
+  void* ptr;
+  while ((ptr = malloc(size)) == nullptr) {
+    const std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) throw std::bad_alloc();
+    handler();
+  }
+  return TrackAllocation(ptr);
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return operator new(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void* ptr) noexcept {
+  TrackFree(ptr);
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept { operator delete(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { operator delete(ptr); }
+
+void operator delete[](void* ptr, size_t) noexcept { operator delete(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  operator delete(ptr);
+}
+
+#endif  // defined(THUMBNAILER_TRACK_MALLOC)
+
+#endif  // defined(THUMBNAILER_HAVE_ALLOC_TRACKER)
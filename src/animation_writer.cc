@@ -0,0 +1,222 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "animation_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace libwebp {
+
+namespace {
+
+// Sizes (in bytes) of the WebP container elements, see
+// https://developers.google.com/speed/webp/docs/riff_container
+const size_t kTagSize = 4;
+const size_t kChunkHeaderSize = 8;
+const size_t kRiffHeaderSize = 12;
+const size_t kVP8XChunkSize = 10;
+const size_t kANIMChunkSize = 6;
+const size_t kANMFChunkSize = 16;  // Without the frame's image chunks.
+
+// Size of the RIFF header followed by the VP8X and ANIM chunks.
+const size_t kStartSize = kRiffHeaderSize +
+                          (kChunkHeaderSize + kVP8XChunkSize) +
+                          (kChunkHeaderSize + kANIMChunkSize);
+
+const uint8_t kAnimationFlag = 0x02;
+const uint8_t kAlphaFlag = 0x10;
+const uint8_t kNoBlendFlag = 0x02;
+const int kMaxDuration = (1 << 24) - 1;
+
+// The chunk headers are built in fixed buffers, so that writing does not
+// allocate. Both functions advance '*dst' past the written bytes.
+void PutTag(const char tag[4], uint8_t** const dst) {
+  memcpy(*dst, tag, kTagSize);
+  *dst += kTagSize;
+}
+
+void PutLE(uint32_t value, int num_bytes, uint8_t** const dst) {
+  for (int i = 0; i < num_bytes; ++i) {
+    *(*dst)++ = (value >> (8 * i)) & 0xff;
+  }
+}
+
+uint32_t GetLE32(const uint8_t* const data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+         (uint32_t(data[3]) << 24);
+}
+
+// Calls 'fn(chunk, chunk_size)' for each chunk of the still WebP 'bitstream'
+// that belongs in an ANMF chunk (ALPH, VP8 and VP8L), 'chunk' pointing at the
+// chunk header and 'chunk_size' excluding padding. Returns false if the
+// bitstream is invalid or if 'fn' returns false.
+template <typename Function>
+bool ForEachImageChunk(const uint8_t* bitstream, size_t bitstream_size,
+                       Function fn) {
+  if (bitstream == nullptr || bitstream_size < kRiffHeaderSize ||
+      memcmp(bitstream, "RIFF", kTagSize) ||
+      memcmp(bitstream + 8, "WEBP", kTagSize)) {
+    return false;
+  }
+  bool has_image = false;
+  size_t offset = kRiffHeaderSize;
+  while (offset + kChunkHeaderSize <= bitstream_size) {
+    const uint8_t* const chunk = bitstream + offset;
+    const size_t payload_size = GetLE32(chunk + kTagSize);
+    if (payload_size > bitstream_size - offset - kChunkHeaderSize) {
+      return false;
+    }
+    if (!memcmp(chunk, "ALPH", kTagSize) || !memcmp(chunk, "VP8 ", kTagSize) ||
+        !memcmp(chunk, "VP8L", kTagSize)) {
+      if (memcmp(chunk, "ALPH", kTagSize)) has_image = true;
+      if (!fn(chunk, kChunkHeaderSize + payload_size)) return false;
+    }
+    offset += kChunkHeaderSize + payload_size + (payload_size & 1);
+  }
+  return has_image;
+}
+
+}  // namespace
+
+AnimationWriter::AnimationWriter(int fd) : fd_(fd) {}
+
+AnimationWriter::AnimationWriter(WebPMemoryWriter* const memory_writer)
+    : memory_writer_(memory_writer) {}
+
+size_t AnimationWriter::HeaderSize() {
+  return kTagSize + (kChunkHeaderSize + kVP8XChunkSize) +
+         (kChunkHeaderSize + kANIMChunkSize);
+}
+
+size_t AnimationWriter::FrameChunkSize(const uint8_t* bitstream,
+                                       size_t bitstream_size) {
+  size_t size = kChunkHeaderSize + kANMFChunkSize;
+  const bool ok = ForEachImageChunk(
+      bitstream, bitstream_size, [&size](const uint8_t*, size_t chunk_size) {
+        size += chunk_size + (chunk_size & 1);
+        return true;
+      });
+  return ok ? size : 0;
+}
+
+size_t AnimationWriter::AnimationSize(size_t frames_size) {
+  return kChunkHeaderSize + HeaderSize() + frames_size;
+}
+
+bool AnimationWriter::IsSeekable(int fd) {
+  return lseek(fd, 0, SEEK_CUR) != -1;
+}
+
+bool AnimationWriter::Write(const uint8_t* data, size_t data_size) {
+  size_ += data_size;
+  if (memory_writer_ != nullptr) {
+    // WebPMemoryWrite() only reads 'custom_ptr', but the picture must still
+    // be a valid one.
+    WebPPicture pic;
+    if (!WebPPictureInit(&pic)) return false;
+    pic.custom_ptr = memory_writer_;
+    return WebPMemoryWrite(data, data_size, &pic);
+  }
+  while (data_size > 0) {
+    const ssize_t written = write(fd_, data, data_size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    data_size -= written;
+  }
+  return true;
+}
+
+bool AnimationWriter::Start(int width, int height, bool has_alpha,
+                            int loop_count, uint32_t bgcolor,
+                            size_t riff_size) {
+  if (width <= 0 || height <= 0) return false;
+  if (riff_size == 0) {
+    start_offset_ = (memory_writer_ != nullptr) ? memory_writer_->size
+                                                : lseek(fd_, 0, SEEK_CUR);
+    if (start_offset_ < 0) return false;
+  }
+  riff_size_ = riff_size;
+  size_ = 0;
+
+  uint8_t header[kStartSize];
+  uint8_t* dst = header;
+  PutTag("RIFF", &dst);
+  PutLE(riff_size, 4, &dst);
+  PutTag("WEBP", &dst);
+
+  PutTag("VP8X", &dst);
+  PutLE(kVP8XChunkSize, 4, &dst);
+  PutLE(kAnimationFlag | (has_alpha ? kAlphaFlag : 0), 4, &dst);
+  PutLE(width - 1, 3, &dst);
+  PutLE(height - 1, 3, &dst);
+
+  PutTag("ANIM", &dst);
+  PutLE(kANIMChunkSize, 4, &dst);
+  PutLE(bgcolor, 4, &dst);
+  PutLE(loop_count, 2, &dst);
+
+  width_ = width;
+  height_ = height;
+  return Write(header, dst - header);
+}
+
+bool AnimationWriter::AddFrame(const uint8_t* bitstream, size_t bitstream_size,
+                               int duration_ms) {
+  const size_t chunk_size = FrameChunkSize(bitstream, bitstream_size);
+  if (chunk_size == 0 || width_ == 0) return false;
+
+  uint8_t header[kChunkHeaderSize + kANMFChunkSize];
+  uint8_t* dst = header;
+  PutTag("ANMF", &dst);
+  PutLE(chunk_size - kChunkHeaderSize, 4, &dst);
+  PutLE(0, 3, &dst);  // X offset.
+  PutLE(0, 3, &dst);  // Y offset.
+  PutLE(width_ - 1, 3, &dst);
+  PutLE(height_ - 1, 3, &dst);
+  PutLE(std::min(std::max(duration_ms, 0), kMaxDuration), 3, &dst);
+  *dst++ = kNoBlendFlag;
+  if (!Write(header, dst - header)) return false;
+
+  static const uint8_t kPadding = 0;
+  return ForEachImageChunk(
+      bitstream, bitstream_size, [this](const uint8_t* chunk, size_t size) {
+        return Write(chunk, size) && ((size & 1) == 0 || Write(&kPadding, 1));
+      });
+}
+
+bool AnimationWriter::Finish() {
+  if (size_ < kChunkHeaderSize) return false;
+  const size_t riff_size = size_ - kChunkHeaderSize;
+  if (riff_size_ != 0) return riff_size == riff_size_;
+
+  uint8_t size_field[4];
+  uint8_t* dst = size_field;
+  PutLE(riff_size, 4, &dst);
+  if (memory_writer_ != nullptr) {
+    memcpy(memory_writer_->mem + start_offset_ + kTagSize, size_field,
+           sizeof(size_field));
+    return true;
+  }
+  return pwrite(fd_, size_field, sizeof(size_field),
+                start_offset_ + kTagSize) == ssize_t(sizeof(size_field));
+}
+
+}  // namespace libwebp
@@ -0,0 +1,84 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_ANIMATION_WRITER_H_
+#define THUMBNAILER_SRC_ANIMATION_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "webp/encode.h"
+
+namespace libwebp {
+
+// Writes a WebP animation chunk by chunk to a file descriptor, so that only
+// one encoded frame has to be held in memory at a time, or to memory. All the
+// frames cover the whole canvas and are not blended.
+class AnimationWriter {
+ public:
+  // The file descriptor must stay open until Finish() is called.
+  explicit AnimationWriter(int fd);
+
+  // Appends the animation to 'memory_writer', which must outlive the writer.
+  explicit AnimationWriter(WebPMemoryWriter* const memory_writer);
+
+  // Writes the RIFF header and the VP8X and ANIM chunks. 'riff_size' is the
+  // size of the RIFF payload if known in advance (see FrameChunkSize()), or 0
+  // to patch it in Finish(), which requires a seekable file descriptor when
+  // not writing to memory.
+  bool Start(int width, int height, bool has_alpha, int loop_count,
+             uint32_t bgcolor, size_t riff_size);
+
+  // Appends an ANMF chunk holding the image of 'bitstream', a complete
+  // still WebP as produced by WebPEncode(), displayed for 'duration_ms'.
+  bool AddFrame(const uint8_t* bitstream, size_t bitstream_size,
+                int duration_ms);
+
+  // Appends 'data' as is, e.g. a whole animation produced earlier.
+  bool Write(const uint8_t* data, size_t data_size);
+
+  // Patches the RIFF size if needed. Returns false if the written size does
+  // not match the 'riff_size' given to Start().
+  bool Finish();
+
+  // Returns the number of bytes written so far.
+  size_t size() const { return size_; }
+
+  // Returns the RIFF payload size of an animation without any frame.
+  static size_t HeaderSize();
+
+  // Returns the number of bytes AddFrame() writes for 'bitstream', or 0 if
+  // 'bitstream' is invalid.
+  static size_t FrameChunkSize(const uint8_t* bitstream, size_t bitstream_size);
+
+  // Returns the total size of an animation whose ANMF chunks add up to
+  // 'frames_size' bytes.
+  static size_t AnimationSize(size_t frames_size);
+
+  // Returns true if 'fd' supports positional writes.
+  static bool IsSeekable(int fd);
+
+ private:
+  int fd_ = -1;
+  WebPMemoryWriter* const memory_writer_ = nullptr;
+  int width_ = 0;
+  int height_ = 0;
+  long long start_offset_ = 0;  // Position of the RIFF header in the file.
+  size_t riff_size_ = 0;
+  size_t size_ = 0;
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_ANIMATION_WRITER_H_
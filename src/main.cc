@@ -12,18 +12,37 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/flags/usage.h"
+#include "alloc_tracker.h"
+#include "google/protobuf/text_format.h"
+#include "google/protobuf/util/json_util.h"
 #include "thumbnailer.h"
+#include "thumbnailer_batch.h"
+#include "thumbnailer_job.h"
+#include "thumbnailer_server.h"
+#include "tracer.h"
 #include "utils/thumbnailer_utils.h"
 
 ABSL_FLAG(std::string, o, "out.webp", "Output file name.");
+ABSL_FLAG(bool, stream_output, false,
+          "Write the animation to the output file ('-' for stdout) chunk by "
+          "chunk from the frame encodings kept by the search, without "
+          "assembling it in memory. The output cache is then only read. "
+          "Not supported with -budget_ladder or -resolutions.");
 
 // Thumbnailer algorithm options.
 ABSL_FLAG(uint32_t, soft_max_size, 153600,
@@ -33,6 +52,15 @@ ABSL_FLAG(uint32_t, hard_max_size, 153600,
           "'soft_max_size', it will be set to 'soft_max_size'.");
 ABSL_FLAG(float, slope_dpsnr, 1.0,
           "Maximum PSNR change used in slope optimization.");
+ABSL_FLAG(std::vector<std::string>, budget_ladder, {},
+          "Comma-separated byte budgets. If set, one animation is generated "
+          "per budget, written to the output file name suffixed with "
+          "'_<budget>'.");
+ABSL_FLAG(std::vector<std::string>, resolutions, {},
+          "Comma-separated output dimensions such as 320x240 (0 keeps the "
+          "aspect ratio, e.g. 160x0). If set, one animation is generated per "
+          "resolution, written to the output file name suffixed with "
+          "'_<width>x<height>'.");
 
 // WebP encoding options.
 ABSL_FLAG(uint32_t, loop_count, 0,
@@ -42,30 +70,199 @@ ABSL_FLAG(uint32_t, min_lossy_quality, 0,
 ABSL_FLAG(uint32_t, m, 4, "Effort/speed trade-off (0=fast, 6=slower-better).");
 ABSL_FLAG(bool, allow_mixed, false, "Use mixed lossy/lossless compression.");
 
+// Input options.
+ABSL_FLAG(uint32_t, frame_duration, 100,
+          "Frame duration (in milliseconds) used for frame sources without "
+          "timing information, e.g. multi-page TIFF.");
+ABSL_FLAG(bool, pnm_stream, false,
+          "Read the frames from a stream of concatenated PNM images ('-' for "
+          "stdin), e.g. ffmpeg's image2pipe output.");
+ABSL_FLAG(bool, lazy_decode, false,
+          "Keep the images of the frame list encoded in memory and decode "
+          "them on first use.");
+ABSL_FLAG(uint32_t, window_ms, 0,
+          "Only keep the frames of the last 'window_ms' milliseconds of the "
+          "input, e.g. of a live -pnm_stream (0 = keep all the frames).");
+
+// Memory options.
+ABSL_FLAG(uint64_t, memory_limit, 0,
+          "Memory limit (in bytes) for the decoded frames. If set, frames are "
+          "kept losslessly compressed and decoded on demand (0 = no limit, "
+          "64 MiB with -pnm_stream).");
+
+// Output cache options.
+ABSL_FLAG(std::string, output_cache_dir, "",
+          "Directory caching the generated animations, so that identical "
+          "requests are answered without running any algorithm.");
+ABSL_FLAG(uint64_t, output_cache_size, 1ull << 30,
+          "Maximum size (in bytes) of the output cache directory. The least "
+          "recently used animations are evicted first.");
+
+// Server options.
+ABSL_FLAG(std::string, serve, "",
+          "Run as a server listening on this Unix domain socket instead of "
+          "processing a single input. Each request carries its own options.");
+ABSL_FLAG(uint32_t, server_threads, 0,
+          "Number of requests handled concurrently by the server (0 = one per "
+          "hardware thread).");
+ABSL_FLAG(uint64_t, server_max_request_size, 64ull << 20,
+          "Maximum size (in bytes) of a request received by the server. "
+          "Connections sending larger requests are closed.");
+ABSL_FLAG(uint64_t, server_rd_cache_points, 1ull << 19,
+          "Maximum number of frame measurements kept by the server for the "
+          "next requests. The least recently used ones are evicted first.");
+
+// Batch options.
+ABSL_FLAG(std::string, batch, "",
+          "Run the jobs of this BatchManifest (protobuf text format) instead "
+          "of processing a single input. Each job carries its own options.");
+ABSL_FLAG(uint32_t, batch_jobs, 0,
+          "Maximum number of batch jobs run concurrently (0 = one per "
+          "hardware thread).");
+
 // Binary options.
 ABSL_FLAG(bool, verbose, false, "Print various encoding statistics.");
+ABSL_FLAG(std::string, stats_output, "",
+          "Write the performance statistics of the job (ThumbnailerStats) to "
+          "this file ('-' for stdout).");
+ABSL_FLAG(std::string, stats_format, "text",
+          "Format of -stats_output: 'text' (protobuf text format) or 'json'.");
+ABSL_FLAG(bool, track_allocations, false,
+          "Count the heap allocations of the job and of each phase, and "
+          "their high-water mark, in -stats_output.");
+ABSL_FLAG(std::string, trace_output, "",
+          "Record a timeline of the algorithm phases, frame encodings and "
+          "animation assemblies, and write it to this file as Chrome trace "
+          "event JSON (viewable in Perfetto).");
 
 // Thumbnailer algorithms.
 ABSL_FLAG(std::string, algorithm, "equal_quality",
           "Method used to generate animation.");
 
-// Returns false on invalid configurations.
-bool ThumbnailerValidateOption(
-    const thumbnailer::ThumbnailerOption& thumbnailer_option) {
-  if (thumbnailer_option.min_lossy_quality() > 100) return false;
-  if (thumbnailer_option.webp_method() > 6) return false;
-  if (thumbnailer_option.slope_dpsnr() < 0) return false;
-  if (thumbnailer_option.slope_dpsnr() > 99) return false;
-  return true;
+namespace {
+
+// Memory limit (in bytes) for the decoded frames of a -pnm_stream without
+// -memory_limit, so that the frames are kept compressed as they arrive
+// instead of all decoded.
+const uint64_t kDefaultStreamMemoryLimit = 64ull << 20;
+
+// Inserts "_<suffix>" before the extension of 'filename'.
+std::string LadderFileName(const std::string& filename,
+                           const std::string& suffix) {
+  const size_t dot = filename.rfind('.');
+  const size_t slash = filename.rfind('/');
+  const size_t pos = (dot == std::string::npos ||
+                      (slash != std::string::npos && dot < slash))
+                         ? filename.size()
+                         : dot;
+  return filename.substr(0, pos) + "_" + suffix + filename.substr(pos);
 }
 
+// Writes 'stats' as requested by the -stats_output and -stats_format flags.
+// Returns false on error.
+bool WriteStats(const thumbnailer::ThumbnailerStats& stats) {
+  const std::string output = absl::GetFlag(FLAGS_stats_output);
+  if (output.empty()) return true;
+  std::string content;
+  const std::string format = absl::GetFlag(FLAGS_stats_format);
+  if (format == "json") {
+    google::protobuf::util::JsonPrintOptions options;
+    options.add_whitespace = true;
+    options.preserve_proto_field_names = true;
+    if (!google::protobuf::util::MessageToJsonString(stats, &content, options)
+             .ok()) {
+      return false;
+    }
+  } else if (format != "text" ||
+             !google::protobuf::TextFormat::PrintToString(stats, &content)) {
+    std::cerr << "Invalid -stats_format " << format << std::endl;
+    return false;
+  }
+  if (output == "-") {
+    std::cout << content << std::flush;
+    return true;
+  }
+  std::ofstream file(output);
+  file << content;
+  return bool(file);
+}
+
+// Writes the trace on exit if -trace_output is set.
+class TraceOutput {
+ public:
+  TraceOutput() : path_(absl::GetFlag(FLAGS_trace_output)) {
+    if (!path_.empty()) libwebp::Tracer::Enable();
+  }
+  ~TraceOutput() {
+    if (path_.empty()) return;
+    libwebp::Tracer::Disable();
+    if (!libwebp::Tracer::WriteJson(path_)) {
+      std::cerr << "Error writing trace to " << path_ << std::endl;
+    }
+  }
+
+ private:
+  const std::string path_;
+};
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
 
   absl::SetProgramUsageMessage(
-      "Usage: thumbnailer [options] frame_list.txt -o=output.webp\n\nBy "
+      "Usage: thumbnailer [options] frame_list.txt -o=output.webp\n"
+      "       thumbnailer [options] input.{webp,tiff} -o=output.webp\n\nBy "
       "default, use lossy encoding and impose the same quality to all frames.");
   std::vector<char*> positional_args = absl::ParseCommandLine(argc, argv);
+  const TraceOutput trace_output;
+  if (absl::GetFlag(FLAGS_track_allocations) &&
+      !libwebp::AllocTracker::Enable()) {
+    std::cerr << "Allocation tracking is not supported on this platform."
+              << std::endl;
+  }
+
+  std::unique_ptr<libwebp::OutputCache> output_cache;
+  if (!absl::GetFlag(FLAGS_output_cache_dir).empty()) {
+    output_cache.reset(
+        new libwebp::OutputCache(absl::GetFlag(FLAGS_output_cache_dir),
+                                 absl::GetFlag(FLAGS_output_cache_size)));
+  }
+
+  const std::string socket_path = absl::GetFlag(FLAGS_serve);
+  if (!socket_path.empty()) {
+    libwebp::ThumbnailerServer server(socket_path,
+                                      absl::GetFlag(FLAGS_server_threads),
+                                      output_cache.get(),
+                                      absl::GetFlag(
+                                          FLAGS_server_max_request_size),
+                                      absl::GetFlag(
+                                          FLAGS_server_rd_cache_points));
+    if (!server.Start()) {
+      std::cerr << "Failed to listen on " << socket_path << std::endl;
+      return 1;
+    }
+    server.Serve();
+    google::protobuf::ShutdownProtobufLibrary();
+    return 0;
+  }
+
+  const std::string manifest_path = absl::GetFlag(FLAGS_batch);
+  if (!manifest_path.empty()) {
+    thumbnailer::BatchManifest manifest;
+    if (!libwebp::ReadBatchManifest(manifest_path, &manifest)) {
+      std::cerr << "Failed to read batch manifest " << manifest_path
+                << std::endl;
+      return 1;
+    }
+    const int num_failed =
+        libwebp::RunBatch(manifest, absl::GetFlag(FLAGS_batch_jobs),
+                          output_cache.get());
+    std::cout << manifest.jobs_size() - num_failed << "/"
+              << manifest.jobs_size() << " jobs succeeded." << std::endl;
+    google::protobuf::ShutdownProtobufLibrary();
+    return (num_failed == 0) ? 0 : 1;
+  }
 
   // Parse thumbnailer options.
   thumbnailer::ThumbnailerOption thumbnailer_option;
@@ -81,14 +278,35 @@ int main(int argc, char* argv[]) {
   thumbnailer_option.set_webp_method(absl::GetFlag(FLAGS_m));
   thumbnailer_option.set_slope_dpsnr(
       std::abs(absl::GetFlag(FLAGS_slope_dpsnr)));
+  uint64_t memory_limit = absl::GetFlag(FLAGS_memory_limit);
+  if (memory_limit == 0 && absl::GetFlag(FLAGS_pnm_stream)) {
+    memory_limit = kDefaultStreamMemoryLimit;
+  }
+  thumbnailer_option.set_memory_limit(memory_limit);
+  thumbnailer_option.set_window_ms(absl::GetFlag(FLAGS_window_ms));
 
-  if (!ThumbnailerValidateOption(thumbnailer_option)) {
+  if (!libwebp::ValidateOption(thumbnailer_option)) {
     std::cerr << "Invalid thumbnailer configuration." << std::endl;
     return 1;
   }
+  // The ladders write one file per animation, each assembled in memory.
+  if (absl::GetFlag(FLAGS_stream_output) &&
+      (!absl::GetFlag(FLAGS_budget_ladder).empty() ||
+       !absl::GetFlag(FLAGS_resolutions).empty())) {
+    std::cerr << "-stream_output cannot be combined with -budget_ladder or "
+                 "-resolutions."
+              << std::endl;
+    return 1;
+  }
 
   // Initialize thumbnailer.
   libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(thumbnailer_option);
+  if (output_cache != nullptr &&
+      thumbnailer.SetOutputCache(output_cache.get()) !=
+          libwebp::Thumbnailer::Status::kOk) {
+    std::cerr << "Error setting the output cache." << std::endl;
+    return 1;
+  }
 
   // Process list of images and timestamps.
   if (positional_args.size() != 2) {  // including argv[0]
@@ -96,27 +314,62 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  std::vector<EnclosedWebPPicture> pics;
-  std::ifstream input_list(positional_args.back());
-  std::string filename;
-  int timestamp_ms;
+  // Frames are handed to the thumbnailer as they are read. Without a memory
+  // limit, the thumbnailer borrows the pictures, which must be kept alive.
+  // Otherwise it keeps its own compressed copy and they are freed right away.
+  std::vector<libwebp::Frame> frames;
+  int num_frames = 0;
+  const bool keep_frames = (thumbnailer_option.memory_limit() == 0);
+  const libwebp::FrameCallback add_frame = [&](libwebp::Frame frame) {
+    if (thumbnailer.AddFrame(*frame.pic, frame.timestamp) !=
+        libwebp::Thumbnailer::Status::kOk) {
+      std::cerr << "Error adding frame with timestamp " << frame.timestamp
+                << std::endl;
+      return false;
+    }
+    ++num_frames;
+    if (keep_frames) frames.push_back(std::move(frame));
+    return true;
+  };
 
-  while (input_list >> filename >> timestamp_ms) {
-    pics.emplace_back(new WebPPicture, libwebp::WebPPictureDelete);
-    WebPPicture* current_frame = pics.back().get();
-    WebPPictureInit(current_frame);
-    if (!libwebp::ReadPicture(filename.c_str(), current_frame)) {
-      std::cerr << "Failed to read image " << filename << std::endl;
+  // The input is either a frame list, an animated WebP / multi-page TIFF used
+  // as the complete frame source, or a PNM stream.
+  const std::string input = positional_args.back();
+  const int frame_duration = absl::GetFlag(FLAGS_frame_duration);
+  if (absl::GetFlag(FLAGS_pnm_stream)) {
+    const int fd =
+        (input == "-") ? STDIN_FILENO : open(input.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Failed to open PNM stream " << input << std::endl;
       return 1;
     }
-    if (thumbnailer.AddFrame(*current_frame, timestamp_ms) !=
-        libwebp::Thumbnailer::Status::kOk) {
-      std::cerr << "Error adding frame " << filename << std::endl;
+    const libwebp::UtilsStatus status =
+        libwebp::ReadPNMStream(fd, frame_duration, add_frame);
+    if (fd != STDIN_FILENO) close(fd);
+    if (status != libwebp::UtilsStatus::kOk) return 1;
+  } else if (absl::GetFlag(FLAGS_lazy_decode)) {
+    // The thumbnailer keeps its own copy of the encoded images.
+    const libwebp::UtilsStatus status = libwebp::ReadEncodedFrameList(
+        input.c_str(),
+        [&](const uint8_t* data, size_t data_size, int timestamp) {
+          if (thumbnailer.AddEncodedFrame(data, data_size, timestamp) !=
+              libwebp::Thumbnailer::Status::kOk) {
+            std::cerr << "Error adding frame with timestamp " << timestamp
+                      << std::endl;
+            return false;
+          }
+          ++num_frames;
+          return true;
+        });
+    if (status != libwebp::UtilsStatus::kOk) return 1;
+  } else {
+    if (libwebp::ReadFrames(input.c_str(), frame_duration, add_frame) !=
+        libwebp::UtilsStatus::kOk) {
       return 1;
     }
   }
 
-  if (pics.empty()) {
+  if (num_frames == 0) {
     std::cerr << "No input frame(s) for generating animation." << std::endl;
     return 1;
   }
@@ -129,40 +382,111 @@ int main(int argc, char* argv[]) {
       libwebp::Thumbnailer::Method::kEqualQuality;
 
   std::string method_flag = absl::GetFlag(FLAGS_algorithm);
-  if (method_flag == "equal_psnr") {
-    // Generate animation so that all frames have the same PSNR.
-    method = libwebp::Thumbnailer::Method::kEqualPSNR;
-  } else if (method_flag == "equal_quality") {
-    // Generate animation so that all frames have the same quality.
-    method = libwebp::Thumbnailer::Method::kEqualQuality;
-  } else if (method_flag == "near_ll_diff") {
-    // Generate animation allowing near-lossless method. The pre-processing
-    // value for each near-lossless frames can be different.
-    method = libwebp::Thumbnailer::Method::kNearllDiff;
-  } else if (method_flag == "near_ll_equal") {
-    // Generate animation allowing near-lossless method. Use the same
-    // pre-processing value for all near-lossless frames.
-    method = libwebp::Thumbnailer::Method::kNearllEqual;
-  } else if (method_flag == "slope_optim") {
-    // Generate animation with slope optimization.
-    method = libwebp::Thumbnailer::Method::kSlopeOptim;
-  } else {
-    std::cerr << "Unknown -algorithm " << method << std::endl;
+  if (!libwebp::ParseMethod(method_flag, &method)) {
+    std::cerr << "Unknown -algorithm " << method_flag << std::endl;
     return 1;
   }
 
-  libwebp::Thumbnailer::Status status =
-      thumbnailer.GenerateAnimation(&webp_data, method);
-
   // Write animation to file.
   const std::string output = absl::GetFlag(FLAGS_o);
-  if (status == libwebp::Thumbnailer::Status::kOk) {
-    ImgIoUtilWriteFile(output.c_str(), webp_data.bytes, webp_data.size);
-  } else {
+
+  const std::vector<std::string> ladder = absl::GetFlag(FLAGS_budget_ladder);
+  if (!ladder.empty()) {
+    std::vector<size_t> budgets;
+    for (const std::string& budget : ladder) {
+      char* end;
+      budgets.push_back(strtoull(budget.c_str(), &end, 10));
+      if (budget.empty() || *end != '\0' || budgets.back() == 0) {
+        std::cerr << "Invalid -budget_ladder value " << budget << std::endl;
+        return 1;
+      }
+    }
+    std::vector<WebPData> animations;
+    if (thumbnailer.GenerateAnimationLadder(budgets, &animations, method) !=
+        libwebp::Thumbnailer::Status::kOk) {
+      std::cerr << "Error generating thumbnails." << std::endl;
+      return 1;
+    }
+    bool ok = true;
+    for (std::size_t i = 0; i < budgets.size(); ++i) {
+      const std::string filename =
+          LadderFileName(output, std::to_string(budgets[i]));
+      if (!ImgIoUtilWriteFile(filename.c_str(), animations[i].bytes,
+                              animations[i].size)) {
+        std::cerr << "Error writing " << filename << std::endl;
+        ok = false;
+      }
+      WebPDataClear(&animations[i]);
+    }
+    if (!WriteStats(thumbnailer.stats())) {
+      std::cerr << "Error writing statistics." << std::endl;
+    }
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+  }
+
+  const std::vector<std::string> resolutions =
+      absl::GetFlag(FLAGS_resolutions);
+  if (!resolutions.empty()) {
+    std::vector<std::pair<int, int>> dimensions;
+    for (const std::string& resolution : resolutions) {
+      int width, height;
+      char end;
+      if (sscanf(resolution.c_str(), "%dx%d%c", &width, &height, &end) != 2 ||
+          width < 0 || height < 0) {
+        std::cerr << "Invalid -resolutions value " << resolution << std::endl;
+        return 1;
+      }
+      dimensions.emplace_back(width, height);
+    }
+    std::vector<WebPData> animations;
+    if (thumbnailer.GenerateAnimationResolutions(dimensions, &animations,
+                                                 method) !=
+        libwebp::Thumbnailer::Status::kOk) {
+      std::cerr << "Error generating thumbnails." << std::endl;
+      return 1;
+    }
+    bool ok = true;
+    for (std::size_t i = 0; i < resolutions.size(); ++i) {
+      const std::string filename = LadderFileName(output, resolutions[i]);
+      if (!ImgIoUtilWriteFile(filename.c_str(), animations[i].bytes,
+                              animations[i].size)) {
+        std::cerr << "Error writing " << filename << std::endl;
+        ok = false;
+      }
+      WebPDataClear(&animations[i]);
+    }
+    if (!WriteStats(thumbnailer.stats())) {
+      std::cerr << "Error writing statistics." << std::endl;
+    }
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+  }
+
+  thumbnailer.SetStreamOutput(absl::GetFlag(FLAGS_stream_output));
+  libwebp::Thumbnailer::Status status =
+      thumbnailer.GenerateAnimation(&webp_data, method);
+  bool ok = (status == libwebp::Thumbnailer::Status::kOk);
+  if (!ok) {
     std::cerr << "Error generating thumbnail." << std::endl;
+  } else if (absl::GetFlag(FLAGS_stream_output)) {
+    const int fd = (output == "-") ? STDOUT_FILENO
+                                   : open(output.c_str(),
+                                          O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = (fd >= 0 && thumbnailer.WriteAnimation(fd) ==
+                         libwebp::Thumbnailer::Status::kOk);
+    if (fd >= 0 && fd != STDOUT_FILENO && close(fd) != 0) ok = false;
+    if (!ok) std::cerr << "Error writing thumbnail." << std::endl;
+  } else if (!ImgIoUtilWriteFile(output.c_str(), webp_data.bytes,
+                                 webp_data.size)) {
+    std::cerr << "Error writing thumbnail." << std::endl;
+    ok = false;
+  }
+  if (!WriteStats(thumbnailer.stats())) {
+    std::cerr << "Error writing statistics." << std::endl;
   }
   WebPDataClear(&webp_data);
 
   google::protobuf::ShutdownProtobufLibrary();
-  return 0;
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,204 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "output_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+namespace libwebp {
+
+namespace {
+
+const unsigned __int128 kFNVPrime = (unsigned __int128)1 << 88 | 0x13b;
+const char kEntrySuffix[] = ".webp";
+const char kTempSuffix[] = ".webp.tmp";
+
+// Temporary files older than this were left by a writer that crashed before
+// renaming them.
+const time_t kTempFileGracePeriodS = 10 * 60;
+
+bool IsEntry(const std::string& name) {
+  const size_t suffix_size = sizeof(kEntrySuffix) - 1;
+  return name.size() > suffix_size &&
+         name.compare(name.size() - suffix_size, suffix_size, kEntrySuffix) ==
+             0;
+}
+
+bool IsTempFile(const std::string& name) {
+  return name.find(kTempSuffix) != std::string::npos;
+}
+
+}  // namespace
+
+void CacheKeyBuilder::Update(const void* data, size_t data_size) {
+  const uint8_t* const bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < data_size; ++i) {
+    hash_ ^= bytes[i];
+    hash_ *= kFNVPrime;
+  }
+}
+
+void CacheKeyBuilder::Update(uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; ++i) bytes[i] = (value >> (8 * i)) & 0xff;
+  Update(bytes, sizeof(bytes));
+}
+
+void CacheKeyBuilder::Update(const WebPPicture& pic) {
+  Update(uint64_t(pic.width));
+  Update(uint64_t(pic.height));
+  if (pic.use_argb) {
+    for (int y = 0; y < pic.height; ++y) {
+      Update(pic.argb + size_t(y) * pic.argb_stride, pic.width * 4);
+    }
+    return;
+  }
+  const int uv_width = (pic.width + 1) / 2;
+  const int uv_height = (pic.height + 1) / 2;
+  for (int y = 0; y < pic.height; ++y) {
+    Update(pic.y + size_t(y) * pic.y_stride, pic.width);
+    if (pic.a != NULL) Update(pic.a + size_t(y) * pic.a_stride, pic.width);
+  }
+  for (int y = 0; y < uv_height; ++y) {
+    Update(pic.u + size_t(y) * pic.uv_stride, uv_width);
+    Update(pic.v + size_t(y) * pic.uv_stride, uv_width);
+  }
+}
+
+std::string CacheKeyBuilder::ToString() const {
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string str(32, '0');
+  unsigned __int128 hash = hash_;
+  for (int i = 31; i >= 0; --i) {
+    str[i] = kHexDigits[hash & 0xf];
+    hash >>= 4;
+  }
+  return str;
+}
+
+OutputCache::OutputCache(const std::string& directory, size_t max_size)
+    : directory_(directory), max_size_(max_size) {
+  mkdir(directory_.c_str(), 0755);
+  Scan(/*entries=*/nullptr);
+}
+
+void OutputCache::Scan(
+    std::vector<std::pair<struct timespec, std::string>>* const entries) {
+  total_size_ = 0;
+  DIR* const dir = opendir(directory_.c_str());
+  if (dir == NULL) return;
+  const time_t now = time(NULL);
+  while (const dirent* const entry = readdir(dir)) {
+    struct stat entry_stat;
+    const std::string path = directory_ + "/" + entry->d_name;
+    if (IsTempFile(entry->d_name)) {
+      // Written by a Store() in progress, or left by a crashed one.
+      if (stat(path.c_str(), &entry_stat) != 0) continue;
+      if (now - entry_stat.st_mtim.tv_sec > kTempFileGracePeriodS &&
+          unlink(path.c_str()) == 0) {
+        continue;
+      }
+      total_size_ += entry_stat.st_size;
+    } else if (IsEntry(entry->d_name) &&
+               stat(path.c_str(), &entry_stat) == 0) {
+      if (entries != nullptr) entries->emplace_back(entry_stat.st_mtim, path);
+      total_size_ += entry_stat.st_size;
+    }
+  }
+  closedir(dir);
+}
+
+std::string OutputCache::EntryPath(const std::string& key) const {
+  return directory_ + "/" + key + kEntrySuffix;
+}
+
+bool OutputCache::Lookup(const std::string& key,
+                         std::vector<uint8_t>* const data) {
+  const std::string path = EntryPath(key);
+  std::ifstream input(path, std::ios::binary);
+  if (!input.is_open()) return false;
+  data->assign(std::istreambuf_iterator<char>(input),
+               std::istreambuf_iterator<char>());
+  if (input.bad() || data->empty()) return false;
+  // The modification time orders the entries for eviction.
+  utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+  return true;
+}
+
+bool OutputCache::Store(const std::string& key, const uint8_t* data,
+                        size_t data_size) {
+  if (data_size > max_size_) return false;
+  // Write to a temporary file first so that readers never see partial
+  // entries, even from other processes.
+  const std::string path = EntryPath(key);
+  const std::string temp_path =
+      directory_ + "/" + key + kTempSuffix + std::to_string(getpid()) + "_" +
+      std::to_string(std::hash<std::string>()(path) ^ uintptr_t(data));
+  {
+    std::ofstream output(temp_path, std::ios::binary);
+    if (!output.is_open()) return false;
+    output.write(reinterpret_cast<const char*>(data), data_size);
+    if (!output.good()) {
+      output.close();
+      unlink(temp_path.c_str());
+      return false;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  struct stat old_stat;
+  const bool replaced = (stat(path.c_str(), &old_stat) == 0);
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (replaced) total_size_ -= std::min<size_t>(total_size_, old_stat.st_size);
+  total_size_ += data_size;
+  if (total_size_ > max_size_) Evict();
+  return true;
+}
+
+void OutputCache::Evict() {
+  // Rescan, as other processes may share the directory.
+  std::vector<std::pair<struct timespec, std::string>> entries;
+  Scan(&entries);
+
+  std::sort(entries.begin(), entries.end(),
+            [](const std::pair<struct timespec, std::string>& a,
+               const std::pair<struct timespec, std::string>& b) {
+              return a.first.tv_sec < b.first.tv_sec ||
+                     (a.first.tv_sec == b.first.tv_sec &&
+                      a.first.tv_nsec < b.first.tv_nsec);
+            });
+  for (const auto& entry : entries) {
+    if (total_size_ <= max_size_) break;
+    struct stat entry_stat;
+    if (stat(entry.second.c_str(), &entry_stat) == 0 &&
+        unlink(entry.second.c_str()) == 0) {
+      total_size_ -= std::min<size_t>(total_size_, entry_stat.st_size);
+    }
+  }
+}
+
+}  // namespace libwebp
@@ -0,0 +1,89 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_OUTPUT_CACHE_H_
+#define THUMBNAILER_SRC_OUTPUT_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "webp/encode.h"
+
+namespace libwebp {
+
+// Computes a 128-bit FNV-1a hash, used as a content address.
+class CacheKeyBuilder {
+ public:
+  void Update(const void* data, size_t data_size);
+  void Update(uint64_t value);
+
+  // Hashes the pixels of 'pic', ARGB or YUVA, ignoring the stride.
+  void Update(const WebPPicture& pic);
+
+  // Returns the hash as 32 hexadecimal digits.
+  std::string ToString() const;
+
+ private:
+  unsigned __int128 hash_ = (unsigned __int128)0x6c62272e07bb0142ull << 64 |
+                            0x62b821756295c58dull;
+};
+
+// Stores animations in a directory, one file per key, and evicts the least
+// recently used ones when the total size exceeds a limit. Several processes
+// may share the same directory. Temporary files left by crashed writers count
+// towards the limit until they are deleted, some minutes later, by the next
+// scan of the directory. Thread-safe.
+class OutputCache {
+ public:
+  // Creates 'directory' if needed.
+  OutputCache(const std::string& directory, size_t max_size);
+
+  OutputCache(const OutputCache&) = delete;
+  OutputCache& operator=(const OutputCache&) = delete;
+
+  // Returns true and fills 'data' with the animation stored under 'key', if
+  // any. Marks the entry as recently used.
+  bool Lookup(const std::string& key, std::vector<uint8_t>* const data);
+
+  // Stores 'data' under 'key'. Returns false on error.
+  bool Store(const std::string& key, const uint8_t* data, size_t data_size);
+
+ private:
+  const std::string directory_;
+  const size_t max_size_;
+  std::mutex mutex_;
+  size_t total_size_ = 0;  // Approximate if shared with other processes.
+
+  std::string EntryPath(const std::string& key) const;
+
+  // Recomputes 'total_size_' from the directory, deleting the stale
+  // temporary files, and appends the entries with their modification time to
+  // 'entries' if not null. 'mutex_' must be held, except in the constructor.
+  void Scan(
+      std::vector<std::pair<struct timespec, std::string>>* const entries);
+
+  // Removes the least recently used entries until the total size fits
+  // 'max_size_'. 'mutex_' must be held.
+  void Evict();
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_OUTPUT_CACHE_H_
@@ -0,0 +1,265 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "picture_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+#include "../imageio/image_dec.h"
+#include "probes.h"
+#include "tracer.h"
+#include "utils/thumbnailer_utils.h"
+
+namespace libwebp {
+
+namespace {
+
+// Minimum number of decoded pictures kept in memory, whatever the limit.
+const size_t kMinDecodedPictures = 2;
+
+// Number of pictures decoded ahead of their use, e.g. the next frame
+// prefetched by the thumbnailer.
+const size_t kPrefetchDepth = 1;
+
+// Number of decoded pictures kept in memory without a limit.
+const size_t kDefaultMaxDecoded = kMinDecodedPictures + kPrefetchDepth;
+
+// Decodes 'data' into an ARGB picture. Returns nullptr on error.
+PictureCache::Handle Decode(const uint8_t* data, size_t data_size) {
+  TraceScope trace("DecodePicture", "bytes", data_size);
+  std::shared_ptr<WebPPicture> pic(new WebPPicture, WebPPictureDelete);
+  if (!WebPPictureInit(pic.get())) return nullptr;
+  pic->use_argb = 1;
+  const WebPImageReader reader = WebPGuessImageReader(data, data_size);
+  if (!reader(data, data_size, pic.get(), /*keep_alpha=*/1,
+              /*metadata=*/NULL)) {
+    return nullptr;
+  }
+  return pic;
+}
+
+}  // namespace
+
+PictureCache::PictureCache(size_t memory_limit)
+    : memory_limit_(memory_limit), prefetch_tasks_(ThreadPool::Default()) {}
+
+PictureCache::~PictureCache() {
+  // The workers may still be decoding into the entries.
+  prefetch_tasks_.Wait();
+}
+
+int PictureCache::NewEntry() {
+  int id;
+  if (!released_ids_.empty()) {
+    id = released_ids_.back();
+    released_ids_.pop_back();
+  } else {
+    if (num_entries_ == int(entries_.size())) entries_.emplace_back();
+    id = num_entries_++;
+  }
+  Entry& entry = entries_[id];
+  entry.data.clear();  // Keeps the capacity.
+  entry.decoded.reset();
+  entry.decoding = false;
+  entry.prefetching = false;
+  entry.in_lru = false;
+  return id;
+}
+
+int PictureCache::AddBorrowed(const WebPPicture& pic) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int id = NewEntry();
+  // Non-owning handle: the picture stays owned by the caller. The aliasing
+  // constructor does not allocate a control block.
+  entries_[id].decoded = Handle(Handle(), &pic);
+  return id;
+}
+
+int PictureCache::AddEntry(const uint8_t* data, size_t data_size) {
+  const int id = NewEntry();
+  entries_[id].data.assign(data, data + data_size);
+  compressed_size_ += data_size;
+  return id;
+}
+
+int PictureCache::AddCompressed(const WebPPicture& pic) {
+  // Fastest lossless settings. 'exact' keeps the RGB values under transparent
+  // areas so that the decoded picture is identical to the original one.
+  WebPConfig config;
+  if (!WebPConfigInit(&config)) return -1;
+  config.lossless = 1;
+  config.exact = 1;
+  config.method = 0;
+  config.quality = 0;
+
+  WebPMemoryWriter memory_writer;
+  WebPMemoryWriterInit(&memory_writer);
+  WebPPicture encoded_pic;
+  if (!WebPPictureCopy(&pic, &encoded_pic)) return -1;
+  encoded_pic.writer = WebPMemoryWrite;
+  encoded_pic.custom_ptr = &memory_writer;
+  const bool ok = WebPEncode(&config, &encoded_pic);
+  WebPPictureFree(&encoded_pic);
+  if (!ok) {
+    WebPMemoryWriterClear(&memory_writer);
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int id = AddEntry(memory_writer.mem, memory_writer.size);
+  WebPMemoryWriterClear(&memory_writer);
+  return id;
+}
+
+int PictureCache::AddEncoded(const uint8_t* data, size_t data_size) {
+  if (data == nullptr || data_size == 0) return -1;
+  std::lock_guard<std::mutex> lock(mutex_);
+  return AddEntry(data, data_size);
+}
+
+PictureCache::Handle PictureCache::Get(int id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (id < 0 || id >= num_entries_) return nullptr;
+  if (entries_[id].data.empty()) return entries_[id].decoded;
+  entries_[id].prefetching = false;
+
+  // Another thread may be decoding the same picture.
+  decoded_cond_.wait(lock, [this, id] { return !entries_[id].decoding; });
+
+  if (entries_[id].decoded == nullptr) {
+    THUMBNAILER_PROBE1(picture_cache__miss, id);
+    // Decode without holding the lock. The encoded bytes are neither modified
+    // nor freed while 'decoding' is set, even if 'entries_' grows.
+    entries_[id].decoding = true;
+    ++num_decoding_;
+    const std::vector<uint8_t>& data = entries_[id].data;
+    const uint8_t* const data_ptr = data.data();
+    const size_t data_size = data.size();
+    lock.unlock();
+    const auto start = std::chrono::steady_clock::now();
+    const Handle pic = Decode(data_ptr, data_size);
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    lock.lock();
+    ++stats_.num_decodes;
+    stats_.decode_ms += elapsed.count();
+    entries_[id].decoding = false;
+    --num_decoding_;
+    decoded_cond_.notify_all();
+    if (pic == nullptr) return nullptr;
+    entries_[id].decoded = pic;
+
+    if (max_decoded_ == 0 && memory_limit_ > 0) {
+      const size_t picture_size = size_t(pic->width) * pic->height * 4;
+      max_decoded_ =
+          std::max(kMinDecodedPictures, memory_limit_ / picture_size);
+    }
+  } else {
+    THUMBNAILER_PROBE1(picture_cache__hit, id);
+    ++stats_.num_hits;
+  }
+  Touch(id);
+  return entries_[id].decoded;
+}
+
+void PictureCache::Prefetch(int id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id < 0 || id >= num_entries_) return;
+  Entry& entry = entries_[id];
+  if (entry.data.empty() || entry.decoded != nullptr || entry.decoding ||
+      entry.prefetching) {
+    return;
+  }
+  entry.prefetching = true;
+  prefetch_tasks_.Run([this, id]() { Get(id); });
+}
+
+void PictureCache::Release(int id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (id < 0 || id >= num_entries_) return;
+  decoded_cond_.wait(lock, [this, id] { return !entries_[id].decoding; });
+  Entry& entry = entries_[id];
+  if (entry.in_lru) {
+    free_lru_nodes_.splice(free_lru_nodes_.begin(), lru_, entry.lru_pos);
+    entry.in_lru = false;
+  }
+  compressed_size_ -= entry.data.size();
+  entry.data.clear();
+  entry.decoded.reset();
+  released_ids_.push_back(id);
+}
+
+void PictureCache::Touch(int id) {
+  Entry& entry = entries_[id];
+  // Nodes are moved between lists rather than allocated.
+  if (entry.in_lru) {
+    lru_.splice(lru_.begin(), lru_, entry.lru_pos);
+  } else if (!free_lru_nodes_.empty()) {
+    lru_.splice(lru_.begin(), free_lru_nodes_, free_lru_nodes_.begin());
+    lru_.front() = id;
+  } else {
+    lru_.push_front(id);
+  }
+  entry.lru_pos = lru_.begin();
+  entry.in_lru = true;
+
+  // Without a limit, only a few pictures stay decoded, so that encoded
+  // pictures do not end up all decoded as the frames are visited.
+  const size_t max_decoded =
+      (memory_limit_ > 0) ? max_decoded_ : kDefaultMaxDecoded;
+  while (lru_.size() > max_decoded) {
+    Entry& evicted = entries_[lru_.back()];
+    // Pictures still in use are freed when their last handle is released.
+    evicted.decoded.reset();
+    evicted.in_lru = false;
+    free_lru_nodes_.splice(free_lru_nodes_.begin(), lru_,
+                           std::prev(lru_.end()));
+  }
+}
+
+void PictureCache::Clear() {
+  prefetch_tasks_.Wait();
+  std::unique_lock<std::mutex> lock(mutex_);
+  decoded_cond_.wait(lock, [this] { return num_decoding_ == 0; });
+  for (int id = 0; id < num_entries_; ++id) {
+    entries_[id].data.clear();
+    entries_[id].decoded.reset();
+    entries_[id].in_lru = false;
+  }
+  num_entries_ = 0;
+  released_ids_.clear();
+  free_lru_nodes_.splice(free_lru_nodes_.begin(), lru_);
+  max_decoded_ = 0;
+  compressed_size_ = 0;
+}
+
+void PictureCache::Reset(size_t memory_limit) {
+  Clear();
+  std::lock_guard<std::mutex> lock(mutex_);
+  memory_limit_ = memory_limit;
+}
+
+size_t PictureCache::compressed_size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return compressed_size_;
+}
+
+PictureCache::Stats PictureCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace libwebp
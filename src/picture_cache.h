@@ -0,0 +1,135 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_PICTURE_CACHE_H_
+#define THUMBNAILER_SRC_PICTURE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+#include "webp/encode.h"
+
+namespace libwebp {
+
+// Holds the pictures of the frames. A picture is either borrowed from the
+// caller, or kept encoded in memory (any format supported by imageio) and
+// decoded on demand. Decoded pictures are kept in an LRU whose size is bounded
+// by 'memory_limit', or to a few pictures without a limit. Thread-safe.
+class PictureCache {
+ public:
+  typedef std::shared_ptr<const WebPPicture> Handle;
+
+  // 'memory_limit' (in bytes) bounds the decoded pictures held by the LRU.
+  // With 0, the LRU holds a small fixed number of pictures instead.
+  explicit PictureCache(size_t memory_limit = 0);
+
+  // Waits for the background decodings to finish.
+  ~PictureCache();
+
+  PictureCache(const PictureCache&) = delete;
+  PictureCache& operator=(const PictureCache&) = delete;
+
+  // Adds a picture owned by the caller, which must outlive the cache or the
+  // next Clear(). Returns the picture's id.
+  int AddBorrowed(const WebPPicture& pic);
+
+  // Adds a copy of 'pic' compressed with lossless WebP. The caller may free
+  // 'pic' afterwards. Returns the picture's id, or -1 on error.
+  int AddCompressed(const WebPPicture& pic);
+
+  // Adds a copy of the encoded image 'data'. Nothing is decoded until the
+  // picture is requested. Returns the picture's id, or -1 on error.
+  int AddEncoded(const uint8_t* data, size_t data_size);
+
+  // Returns the picture with the given id, decoding it if needed. The picture
+  // stays valid as long as the handle is held, even if it gets evicted from
+  // the LRU. Returns nullptr on error.
+  Handle Get(int id);
+
+  // Starts decoding the picture with the given id on a background thread if
+  // it is not decoded yet, so that a later Get() does not have to wait.
+  void Prefetch(int id);
+
+  // Frees the picture with the given id, e.g. once its frame is removed. The
+  // id and its entry are reused by the next added picture, so that a stream
+  // of pictures keeps a bounded number of entries. Handles already returned
+  // by Get() stay valid.
+  void Release(int id);
+
+  // Removes all the pictures. The storage of the entries and of the LRU is
+  // kept for the next pictures.
+  void Clear();
+
+  // Removes all the pictures and sets a new 'memory_limit'.
+  void Reset(size_t memory_limit);
+
+  // Returns the total size (in bytes) of the compressed pictures.
+  size_t compressed_size() const;
+
+  // Cumulative counters, never reset.
+  struct Stats {
+    int num_hits = 0;       // Get() calls finding the picture decoded.
+    int num_decodes = 0;    // Get() calls decoding the picture.
+    double decode_ms = 0.;  // Time spent decoding, summed over the threads.
+  };
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    std::vector<uint8_t> data;  // Encoded image, empty if borrowed.
+    Handle decoded;  // Borrowed picture, or decoded one while in the LRU.
+    bool decoding = false;
+    bool prefetching = false;  // Set while a Prefetch() task is queued.
+    bool in_lru = false;
+    std::list<int>::iterator lru_pos;
+  };
+
+  size_t memory_limit_;
+  mutable std::mutex mutex_;
+  std::condition_variable decoded_cond_;  // Signaled when a decoding ends.
+  // Only the first 'num_entries_' entries are in use. The others are kept
+  // to reuse their storage.
+  std::vector<Entry> entries_;
+  int num_entries_ = 0;
+  std::vector<int> released_ids_;  // Ids below 'num_entries_' to reuse.
+  std::list<int> lru_;  // Ids of the decoded pictures, most recent first.
+  std::list<int> free_lru_nodes_;  // Spare nodes spliced into 'lru_'.
+  size_t max_decoded_ = 0;
+  size_t compressed_size_ = 0;
+  int num_decoding_ = 0;
+  Stats stats_;
+  TaskGroup prefetch_tasks_;  // Run on the default ThreadPool.
+
+  // Returns a cleared entry, reusing a spare one if any. 'mutex_' must be
+  // held.
+  int NewEntry();
+
+  // Adds an entry holding 'data'. 'mutex_' must be held.
+  int AddEntry(const uint8_t* data, size_t data_size);
+
+  // Inserts 'id' at the front of the LRU, evicting the least recently used
+  // pictures if needed. 'mutex_' must be held.
+  void Touch(int id);
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_PICTURE_CACHE_H_
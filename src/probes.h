@@ -0,0 +1,69 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_PROBES_H_
+#define THUMBNAILER_SRC_PROBES_H_
+
+// USDT (statically defined tracing) probes of the "thumbnailer" provider,
+// for tools such as bpftrace or perf to attach to a running process, e.g.
+//   bpftrace -e 'usdt:./thumbnailer:thumbnailer:encode__done
+//                { @size[arg1] = hist(arg4); }'
+// A probe is a single nop until a tool attaches to it. The arguments must be
+// integers or pointers, and are evaluated even then, so they should be
+// values at hand. Without <sys/sdt.h> (systemtap-sdt-dev), or when
+// THUMBNAILER_DISABLE_PROBES is defined, the probes compile to nothing and
+// their arguments are not evaluated.
+//
+// Probes (arguments in order):
+//   phase__start, phase__end: name of the phase (string).
+//   encode__start: frame index, quality, lossless, near_lossless.
+//   encode__done: the same and the size of the encoded frame in bytes.
+//   measure__start, measure__done: same as encode__*, for the encodings
+//     measuring the size and PSNR of a frame.
+//   assembly__start: number of frames.
+//   assembly__done: number of frames, size of the animation in bytes.
+//   rd_cache__hit: frame index, quality, 1 if from the shared RD cache.
+//   rd_cache__miss: frame index, quality.
+//   output_cache__hit: size of the animation. output_cache__miss.
+//   picture_cache__hit, picture_cache__miss: id of the picture.
+
+#if defined(__has_include) && !defined(THUMBNAILER_DISABLE_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define THUMBNAILER_HAVE_PROBES 1
+#endif
+#endif
+
+#if defined(THUMBNAILER_HAVE_PROBES)
+#define THUMBNAILER_PROBE0(name) DTRACE_PROBE(thumbnailer, name)
+#define THUMBNAILER_PROBE1(name, a) DTRACE_PROBE1(thumbnailer, name, a)
+#define THUMBNAILER_PROBE2(name, a, b) DTRACE_PROBE2(thumbnailer, name, a, b)
+#define THUMBNAILER_PROBE3(name, a, b, c) \
+  DTRACE_PROBE3(thumbnailer, name, a, b, c)
+#define THUMBNAILER_PROBE4(name, a, b, c, d) \
+  DTRACE_PROBE4(thumbnailer, name, a, b, c, d)
+#define THUMBNAILER_PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5(thumbnailer, name, a, b, c, d, e)
+#else
+#define THUMBNAILER_PROBE0(name) \
+  do {                           \
+  } while (0)
+#define THUMBNAILER_PROBE1(name, a) THUMBNAILER_PROBE0(name)
+#define THUMBNAILER_PROBE2(name, a, b) THUMBNAILER_PROBE0(name)
+#define THUMBNAILER_PROBE3(name, a, b, c) THUMBNAILER_PROBE0(name)
+#define THUMBNAILER_PROBE4(name, a, b, c, d) THUMBNAILER_PROBE0(name)
+#define THUMBNAILER_PROBE5(name, a, b, c, d, e) THUMBNAILER_PROBE0(name)
+#endif
+
+#endif  // THUMBNAILER_SRC_PROBES_H_
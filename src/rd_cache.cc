@@ -0,0 +1,74 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rd_cache.h"
+
+namespace libwebp {
+
+bool RDCache::Lookup(const std::string& key, Point* const point) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // Looked up again after each wait: the entry may have been abandoned.
+    const auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      entries_.emplace(key, Entry{/*measuring=*/true, {0, 0.f}, {}});
+      return false;
+    }
+    if (!it->second.measuring) {
+      *point = it->second.point;
+      lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+      return true;
+    }
+    measured_cond_.wait(lock);
+  }
+}
+
+void RDCache::Insert(const std::string& key, const Point& point) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      it = entries_.emplace(key, Entry{/*measuring=*/true, {0, 0.f}, {}}).first;
+    }
+    Entry& entry = it->second;
+    if (entry.measuring) {
+      lru_.push_front(&it->first);
+    } else {
+      lru_.splice(lru_.begin(), lru_, entry.lru_it);
+    }
+    entry = {/*measuring=*/false, point, lru_.begin()};
+    while (max_points_ > 0 && lru_.size() > max_points_) {
+      const std::string* const oldest_key = lru_.back();
+      lru_.pop_back();
+      entries_.erase(entries_.find(*oldest_key));
+    }
+  }
+  measured_cond_.notify_all();
+}
+
+void RDCache::Abandon(const std::string& key) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(key);
+    if (it != entries_.end() && it->second.measuring) entries_.erase(it);
+  }
+  measured_cond_.notify_all();
+}
+
+size_t RDCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lru_.size();
+}
+
+}  // namespace libwebp
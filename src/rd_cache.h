@@ -0,0 +1,83 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_RD_CACHE_H_
+#define THUMBNAILER_SRC_RD_CACHE_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace libwebp {
+
+// Holds the size and PSNR of frames encoded with given settings, so that
+// several Thumbnailers over the same frames (e.g. one per method or budget)
+// measure each point once. Keys are built by the caller, from the content
+// of the frame and the encoding settings. When several threads look up a
+// point being measured, the first one measures it while the others wait for
+// its result. Beyond a given number of points, the least recently used ones
+// are evicted. Thread-safe.
+class RDCache {
+ public:
+  struct Point {
+    size_t size;
+    float psnr;
+  };
+
+  // Keeps at most 'max_points' measured points, or all of them if 0.
+  explicit RDCache(size_t max_points = 0) : max_points_(max_points) {}
+  RDCache(const RDCache&) = delete;
+  RDCache& operator=(const RDCache&) = delete;
+
+  // Returns true and fills 'point' if the point of 'key' is known, waiting
+  // for it if it is being measured, and marks it as recently used. Otherwise
+  // returns false: the caller is then in charge of measuring it and must call
+  // either Insert() or Abandon() with 'key'.
+  bool Lookup(const std::string& key, Point* const point);
+
+  // Stores the point measured after a failed Lookup(), evicting the least
+  // recently used point if there are too many.
+  void Insert(const std::string& key, const Point& point);
+
+  // Gives up the measurement of 'key' after a failed Lookup(), e.g. on
+  // error. One of the waiting threads, if any, then measures it instead.
+  void Abandon(const std::string& key);
+
+  // Returns the number of points stored.
+  size_t size() const;
+
+ private:
+  struct Entry {
+    bool measuring;
+    Point point;
+    // Position in 'lru_', valid if not 'measuring'.
+    std::list<const std::string*>::iterator lru_it;
+  };
+
+  const size_t max_points_;
+  mutable std::mutex mutex_;
+  std::condition_variable measured_cond_;
+  std::unordered_map<std::string, Entry> entries_;
+  // Keys of the measured points, most recently used first. They point into
+  // 'entries_', whose keys do not move.
+  std::list<const std::string*> lru_;
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_RD_CACHE_H_
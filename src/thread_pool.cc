@@ -0,0 +1,191 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <utility>
+
+#include "alloc_tracker.h"
+
+namespace libwebp {
+
+namespace {
+
+// Pool and queue index of the current thread, if it is a worker.
+thread_local ThreadPool* current_pool = nullptr;
+thread_local int current_index = -1;
+
+// Number of pending tasks each queue has room for up front, so that the
+// first tasks scheduled on a queue do not allocate either.
+const size_t kInitialQueueCapacity = 64;
+
+}  // namespace
+
+ThreadPool::ThreadPool(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    queues_.emplace_back(new Queue);
+    queues_.back()->tasks.reserve(kInitialQueueCapacity);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (std::thread& worker : workers_) worker.join();
+}
+
+ThreadPool* ThreadPool::Default() {
+  static ThreadPool* const pool = new ThreadPool();
+  return pool;
+}
+
+void ThreadPool::Schedule(Task task) {
+  Push({std::move(task), /*group=*/nullptr, /*alloc_scope=*/nullptr});
+}
+
+void ThreadPool::Push(PendingTask task) {
+  const int index = (current_pool == this)
+                        ? current_index
+                        : next_queue_.fetch_add(1) % queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++num_pending_;
+  }
+  cond_.notify_one();
+}
+
+bool ThreadPool::PopTask(int index, const TaskGroup* const group,
+                         PendingTask* const task) {
+  const int num_queues = queues_.size();
+  auto matches = [group](const PendingTask& t) {
+    return group == nullptr || t.group == group;
+  };
+  // The newest task of the own queue is the most likely to be cache-hot.
+  if (index >= 0) {
+    Queue& queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    const auto it =
+        std::find_if(queue.tasks.rbegin(), queue.tasks.rend(), matches);
+    if (it != queue.tasks.rend()) {
+      *task = std::move(*it);
+      queue.tasks.erase(std::next(it).base());
+      std::lock_guard<std::mutex> pending_lock(mutex_);
+      --num_pending_;
+      return true;
+    }
+  }
+  // Steal the oldest task of another queue.
+  for (int i = 1; i <= num_queues; ++i) {
+    Queue& queue = *queues_[(std::max(index, 0) + i) % num_queues];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    const auto it =
+        std::find_if(queue.tasks.begin(), queue.tasks.end(), matches);
+    if (it != queue.tasks.end()) {
+      *task = std::move(*it);
+      queue.tasks.erase(it);
+      std::lock_guard<std::mutex> pending_lock(mutex_);
+      --num_pending_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::RunPendingTask(const TaskGroup* const group) {
+  PendingTask task;
+  if (!PopTask((current_pool == this) ? current_index : -1, group, &task)) {
+    return false;
+  }
+  RunTask(&task);
+  return true;
+}
+
+void ThreadPool::RunTask(PendingTask* const task) {
+  {
+    ScopedAllocScope scoped_alloc(task->alloc_scope);
+    task->function();
+    // Frees the captures while the group is still alive.
+    task->function = Task();
+  }
+  if (task->group != nullptr) task->group->Done();
+}
+
+void ThreadPool::WorkerLoop(int index) {
+  current_pool = this;
+  current_index = index;
+  while (true) {
+    PendingTask task;
+    if (PopTask(index, /*group=*/nullptr, &task)) {
+      RunTask(&task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return stopping_ || num_pending_ > 0; });
+    if (stopping_) return;
+  }
+}
+
+TaskGroup::TaskGroup(ThreadPool* const pool) : pool_(pool) {}
+
+TaskGroup::~TaskGroup() { Wait(); }
+
+void TaskGroup::Run(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++num_pending_;
+  }
+  // The allocations of the task are counted by the scope that runs it.
+  pool_->Push({std::move(task), this, AllocScope::Current()});
+}
+
+void TaskGroup::Done() {
+  // The group may be destroyed as soon as the count reaches 0 and 'mutex_' is
+  // released.
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--num_pending_ == 0) cond_.notify_all();
+}
+
+void TaskGroup::Wait() {
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (num_pending_ == 0) return;
+    }
+    // Help with the own tasks instead of blocking a worker.
+    if (pool_->RunPendingTask(this)) continue;
+    // The remaining tasks are running on other threads, or were queued after
+    // the last check. Poll again shortly in the latter case.
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait_for(lock, std::chrono::milliseconds(1),
+                   [this] { return num_pending_ == 0; });
+  }
+}
+
+}  // namespace libwebp
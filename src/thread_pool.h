@@ -0,0 +1,235 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_THREAD_POOL_H_
+#define THUMBNAILER_SRC_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace libwebp {
+
+class AllocScope;
+class TaskGroup;
+
+// Callable run by a ThreadPool. Like std::function<void()>, but move-only and
+// stored inline, without allocating, if it fits in a few pointers, as do the
+// per-frame lambdas of the thumbnailer. Larger callables are stored on the
+// heap.
+class Task {
+ public:
+  Task() = default;
+
+  // Implicit, like std::function.
+  template <typename Function,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<Function>::type, Task>::value>::type>
+  Task(Function&& function)
+      : invoke_(&Invoke<typename std::decay<Function>::type>),
+        manage_(&Manage<typename std::decay<Function>::type>) {
+    typedef typename std::decay<Function>::type Callable;
+    if constexpr (FitsInline<Callable>()) {
+      new (storage_) Callable(std::forward<Function>(function));
+    } else {
+      *reinterpret_cast<Callable**>(storage_) =
+          new Callable(std::forward<Function>(function));
+    }
+  }
+
+  Task(Task&& other) noexcept { MoveFrom(&other); }
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      Clear();
+      MoveFrom(&other);
+    }
+    return *this;
+  }
+
+  ~Task() { Clear(); }
+
+  explicit operator bool() const { return invoke_ != nullptr; }
+
+  void operator()() { invoke_(storage_); }
+
+ private:
+  static const size_t kInlineSize = 6 * sizeof(void*);
+
+  template <typename Callable>
+  static constexpr bool FitsInline() {
+    return sizeof(Callable) <= kInlineSize &&
+           alignof(Callable) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<Callable>::value;
+  }
+
+  template <typename Callable>
+  static Callable* Get(void* const storage) {
+    if constexpr (FitsInline<Callable>()) {
+      return static_cast<Callable*>(storage);
+    } else {
+      return *static_cast<Callable**>(storage);
+    }
+  }
+
+  template <typename Callable>
+  static void Invoke(void* const storage) {
+    (*Get<Callable>(storage))();
+  }
+
+  // Moves the callable held in 'storage' to 'to', or destroys it if 'to' is
+  // null.
+  template <typename Callable>
+  static void Manage(void* const storage, void* const to) {
+    if constexpr (FitsInline<Callable>()) {
+      Callable* const callable = Get<Callable>(storage);
+      if (to != nullptr) new (to) Callable(std::move(*callable));
+      callable->~Callable();
+    } else if (to != nullptr) {
+      *static_cast<Callable**>(to) = Get<Callable>(storage);
+    } else {
+      delete Get<Callable>(storage);
+    }
+  }
+
+  void MoveFrom(Task* const other) {
+    if (other->manage_ == nullptr) return;
+    other->manage_(other->storage_, storage_);
+    invoke_ = other->invoke_;
+    manage_ = other->manage_;
+    other->invoke_ = nullptr;
+    other->manage_ = nullptr;
+  }
+
+  void Clear() {
+    if (manage_ == nullptr) return;
+    manage_(storage_, nullptr);
+    invoke_ = nullptr;
+    manage_ = nullptr;
+  }
+
+  // The callable, or a pointer to it if it does not fit.
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+  void (*invoke_)(void* storage) = nullptr;
+  void (*manage_)(void* storage, void* to) = nullptr;
+};
+
+// Work-stealing thread pool. Each worker has its own task queue: tasks
+// scheduled from a worker go to its queue and are run last-in first-out by
+// that worker, while idle workers steal the oldest tasks of the others. This
+// lets nested tasks (e.g. per-frame encodes scheduled by a job) spread over
+// the workers left idle by other jobs.
+class ThreadPool {
+ public:
+  // Starts 'num_threads' workers, or one per hardware thread if 0.
+  explicit ThreadPool(int num_threads = 0);
+
+  // Waits for the running tasks to finish. Pending tasks are dropped.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Queues 'task' to be run by one of the workers.
+  void Schedule(Task task);
+
+  // Runs one pending task of 'group' on the calling thread, or any pending
+  // task if 'group' is null. Returns false if there was none.
+  bool RunPendingTask(const TaskGroup* const group = nullptr);
+
+  int num_threads() const { return workers_.size(); }
+
+  // Returns the process-wide pool shared by the thumbnailer internals and the
+  // job drivers. It is never destroyed.
+  static ThreadPool* Default();
+
+ private:
+  friend class TaskGroup;
+
+  struct PendingTask {
+    Task function;
+    TaskGroup* group = nullptr;         // Null if scheduled directly.
+    AllocScope* alloc_scope = nullptr;  // Made current while the task runs.
+  };
+  struct Queue {
+    std::mutex mutex;
+    // Oldest first. The storage is kept, so that a steady flow of tasks does
+    // not allocate.
+    std::vector<PendingTask> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues_;  // One per worker.
+  std::atomic<unsigned int> next_queue_{0};     // For external Schedule().
+  std::mutex mutex_;
+  std::condition_variable cond_;  // Signaled when a task is scheduled.
+  int num_pending_ = 0;           // Guarded by 'mutex_'.
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+
+  // Queues 'task' in the queue of the calling worker, or in the next one.
+  void Push(PendingTask task);
+
+  // Pops a task, from the queue 'index' first if valid, then from the others.
+  // Only considers the tasks of 'group' unless it is null.
+  bool PopTask(int index, const TaskGroup* const group,
+               PendingTask* const task);
+
+  // Runs 'task' and tells its group, if any, that it is done.
+  static void RunTask(PendingTask* const task);
+
+  void WorkerLoop(int index);
+};
+
+// Set of tasks run on a ThreadPool that can be waited for. The waiting thread
+// runs pending tasks of the group meanwhile, so groups can be waited for from
+// within tasks of the same pool. Tasks of other groups are left to the
+// workers, so that a waiting job never ends up running an unrelated one, such
+// as another batch runner, on its stack.
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool* const pool);
+
+  // Waits for the tasks of the group.
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void Run(Task task);
+
+  // Returns once all the tasks run so far are done.
+  void Wait();
+
+ private:
+  friend class ThreadPool;
+
+  // Called by the pool once a task of the group has run.
+  void Done();
+
+  ThreadPool* const pool_;
+  std::mutex mutex_;
+  std::condition_variable cond_;  // Signaled when the last task is done.
+  int num_pending_ = 0;           // Guarded by 'mutex_'.
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_THREAD_POOL_H_
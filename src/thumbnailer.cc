@@ -14,74 +14,553 @@
 
 #include "thumbnailer.h"
 
-#define CONVERT_WEBP_MUX_STATUS(webp_mux_error)     \
-  do {                                              \
-    const WebPMuxError error = (webp_mux_error);    \
-    if (error != WEBP_MUX_OK) return kWebPMuxError; \
-  } while (0);
+#include <sys/resource.h>
+#include <time.h>
+
+#include <chrono>
+
+#include "animation_writer.h"
+#include "probes.h"
+#include "tracer.h"
 
 namespace libwebp {
 
-Thumbnailer::Thumbnailer() {
-  WebPAnimEncoderOptionsInit(&anim_config_);
-  loop_count_ = 0;
-  byte_budget_ = 153600;
-  minimum_lossy_quality_ = 0;
-  verbose_ = false;
-  webp_method_ = 4;
-  slope_dPSNR_ = 1.0;
+namespace {
+
+// Returns the peak resident set size of the process, in kilobytes.
+long GetPeakRSSKb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+  return usage.ru_maxrss;
+}
+
+double WallTimeMs() {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
 }
 
+// Returns the CPU time of 'clock', e.g. CLOCK_THREAD_CPUTIME_ID.
+double CpuTimeMs(clockid_t clock) {
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) return 0.;
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Adds the CPU time of the calling thread during its lifetime to 'total_us',
+// and to 'worker_us' if the calling thread is not 'job_thread'.
+class ScopedThreadCpuTime {
+ public:
+  ScopedThreadCpuTime(std::atomic<int64_t>* const total_us,
+                      std::atomic<int64_t>* const worker_us,
+                      std::thread::id job_thread)
+      : total_us_(total_us),
+        worker_us_(std::this_thread::get_id() != job_thread ? worker_us
+                                                             : nullptr),
+        start_ms_(CpuTimeMs(CLOCK_THREAD_CPUTIME_ID)) {}
+  ~ScopedThreadCpuTime() {
+    const int64_t cpu_us =
+        int64_t((CpuTimeMs(CLOCK_THREAD_CPUTIME_ID) - start_ms_) * 1e3);
+    *total_us_ += cpu_us;
+    if (worker_us_ != nullptr) *worker_us_ += cpu_us;
+  }
+
+ private:
+  std::atomic<int64_t>* const total_us_;
+  std::atomic<int64_t>* const worker_us_;
+  const double start_ms_;
+};
+
+// Returns the size of the samples of 'pic', in bytes.
+size_t PictureSize(const WebPPicture& pic) {
+  const size_t num_pixels = size_t(pic.width) * pic.height;
+  if (pic.use_argb) return num_pixels * 4;
+  return num_pixels * 3 / 2 + ((pic.a != nullptr) ? num_pixels : 0);
+}
+
+// Returns true if the still WebP 'bitstream' has an alpha channel.
+bool HasAlpha(const std::vector<uint8_t>& bitstream) {
+  WebPBitstreamFeatures features;
+  return WebPGetFeatures(bitstream.data(), bitstream.size(), &features) ==
+             VP8_STATUS_OK &&
+         features.has_alpha;
+}
+
+}  // namespace
+
+Thumbnailer::Thumbnailer()
+    : Thumbnailer(thumbnailer::ThumbnailerOption()) {}
+
 Thumbnailer::Thumbnailer(
+    const thumbnailer::ThumbnailerOption& thumbnailer_option)
+    : pictures_(thumbnailer_option.memory_limit()) {
+  SetOptions(thumbnailer_option);
+}
+
+Thumbnailer::~Thumbnailer() {
+  for (WebPMemoryWriter& bitstream : bitstreams_) {
+    WebPMemoryWriterClear(&bitstream);
+  }
+}
+
+void Thumbnailer::SetOptions(
     const thumbnailer::ThumbnailerOption& thumbnailer_option) {
+  options_ = thumbnailer_option;
   verbose_ = thumbnailer_option.verbose();
-  WebPAnimEncoderOptionsInit(&anim_config_);
+  memory_limit_ = thumbnailer_option.memory_limit();
   loop_count_ = thumbnailer_option.loop_count();
   byte_budget_ = thumbnailer_option.soft_max_size();
   minimum_lossy_quality_ = thumbnailer_option.min_lossy_quality();
-  anim_config_.allow_mixed = thumbnailer_option.allow_mixed();
+  allow_mixed_ = thumbnailer_option.allow_mixed();
   webp_method_ = thumbnailer_option.webp_method();
   slope_dPSNR_ = thumbnailer_option.slope_dpsnr();
+  window_ms_ = thumbnailer_option.window_ms();
+
+  // Options that do not change the animation are left out of the cache key.
+  thumbnailer::ThumbnailerOption key_option = thumbnailer_option;
+  key_option.clear_verbose();
+  key_option.clear_memory_limit();
+  // Serialized in place, so that a reset with similar options reuses the
+  // buffer.
+  key_option.SerializeToString(&option_key_);
+  has_result_ = false;
+}
+
+void Thumbnailer::SetCancellationToken(const CancellationToken* const token) {
+  cancellation_token_ = token;
+}
+
+void Thumbnailer::SetProgressCallback(ProgressCallback callback) {
+  progress_callback_ = std::move(callback);
+}
+
+void Thumbnailer::SetStreamOutput(bool stream_output) {
+  stream_output_ = stream_output;
+}
+
+Thumbnailer::Status Thumbnailer::StartProbe() {
+  if (cancellation_token_ != nullptr && cancellation_token_->IsCancelled()) {
+    return kCancelled;
+  }
+  ++num_probes_;
+  return kOk;
+}
+
+void Thumbnailer::ReportProgress() {
+  if (!progress_callback_) return;
+  progress_.num_probes = num_probes_;
+  progress_callback_(progress_);
+}
+
+void Thumbnailer::SetPhase(const char* phase) {
+  EndPhase();
+  THUMBNAILER_PROBE1(phase__start, phase);
+  progress_.phase = phase;
+  phase_start_wall_ms_ = WallTimeMs();
+  // The CPU time of other jobs running in the process is left out.
+  phase_start_cpu_ms_ = CpuTimeMs(CLOCK_THREAD_CPUTIME_ID);
+  phase_start_worker_cpu_us_ = worker_cpu_us_;
+  if (track_allocations_) {
+    phase_start_alloc_ = alloc_scope_.counters();
+    alloc_peak_bytes_ =
+        std::max(alloc_peak_bytes_, phase_start_alloc_.peak_bytes);
+    alloc_scope_.ResetPeak();
+  }
+  ReportProgress();
+}
+
+void Thumbnailer::EndPhase() {
+  const char* const phase = progress_.phase;
+  if (phase[0] == '\0' || !strcmp(phase, "done")) return;
+  THUMBNAILER_PROBE1(phase__end, phase);
+  AddPhaseTime(phase, WallTimeMs() - phase_start_wall_ms_,
+               CpuTimeMs(CLOCK_THREAD_CPUTIME_ID) - phase_start_cpu_ms_ +
+                   (worker_cpu_us_ - phase_start_worker_cpu_us_) / 1e3);
+  if (track_allocations_) {
+    const AllocScope::Counters alloc = alloc_scope_.counters();
+    thumbnailer::ThumbnailerStats::Phase* const stats = GetPhaseStats(phase);
+    stats->set_num_allocations(stats->num_allocations() +
+                               alloc.num_allocations -
+                               phase_start_alloc_.num_allocations);
+    stats->set_allocated_bytes(stats->allocated_bytes() +
+                               alloc.allocated_bytes -
+                               phase_start_alloc_.allocated_bytes);
+    stats->set_peak_heap_bytes(
+        std::max(stats->peak_heap_bytes(),
+                 alloc.peak_bytes - phase_start_alloc_.current_bytes));
+  }
+  progress_.phase = "";
+}
+
+thumbnailer::ThumbnailerStats::Phase* Thumbnailer::GetPhaseStats(
+    const char* const phase) {
+  for (thumbnailer::ThumbnailerStats::Phase& stats : *stats_.mutable_phases()) {
+    if (stats.name() == phase) return &stats;
+  }
+  thumbnailer::ThumbnailerStats::Phase* const stats = stats_.add_phases();
+  stats->set_name(phase);
+  return stats;
+}
+
+void Thumbnailer::AddPhaseTime(const char* const phase, double wall_ms,
+                               double cpu_ms) {
+  thumbnailer::ThumbnailerStats::Phase* const stats = GetPhaseStats(phase);
+  stats->set_wall_ms(stats->wall_ms() + wall_ms);
+  stats->set_cpu_ms(stats->cpu_ms() + cpu_ms);
+}
+
+AllocScope* Thumbnailer::StartAllocScope() {
+  track_allocations_ = AllocTracker::IsEnabled();
+  if (!track_allocations_) return AllocScope::Current();
+  alloc_scope_.Start();
+  alloc_peak_bytes_ = 0;
+  return &alloc_scope_;
+}
+
+void Thumbnailer::StartStats() {
+  stats_.Clear();
+  start_picture_stats_ = pictures_.stats();
+  rd_cache_hits_ = 0;
+  rd_cache_misses_ = 0;
+  shared_rd_cache_hits_ = 0;
+  reused_encodes_ = 0;
+  bytes_copied_ = 0;
+  encode_cpu_us_ = 0;
+  worker_cpu_us_ = 0;
+  job_thread_ = std::this_thread::get_id();
+  num_assemblies_ = 0;
+}
+
+void Thumbnailer::FinishStats(Status status, const WebPData& webp_data) {
+  EndPhase();
+  const PictureCache::Stats picture_stats = pictures_.stats();
+  const int num_decodes =
+      picture_stats.num_decodes - start_picture_stats_.num_decodes;
+  if (num_decodes > 0) {
+    AddPhaseTime("decode",
+                 picture_stats.decode_ms - start_picture_stats_.decode_ms, 0.);
+  }
+  stats_.set_num_encodes(num_probes_);
+  stats_.set_num_assemblies(num_assemblies_);
+  stats_.set_rd_cache_hits(rd_cache_hits_);
+  stats_.set_rd_cache_misses(rd_cache_misses_);
+  stats_.set_shared_rd_cache_hits(shared_rd_cache_hits_);
+  stats_.set_reused_encodes(reused_encodes_);
+  stats_.set_picture_cache_hits(picture_stats.num_hits -
+                                start_picture_stats_.num_hits);
+  stats_.set_picture_cache_misses(num_decodes);
+  stats_.set_bytes_copied(bytes_copied_);
+  stats_.set_encode_cpu_ms(encode_cpu_us_ / 1e3);
+  if (track_allocations_) {
+    const AllocScope::Counters alloc = alloc_scope_.counters();
+    stats_.set_num_allocations(alloc.num_allocations);
+    stats_.set_allocated_bytes(alloc.allocated_bytes);
+    stats_.set_peak_heap_bytes(std::max(alloc_peak_bytes_, alloc.peak_bytes));
+  }
+  stats_.set_peak_rss_kb(GetPeakRSSKb());
+  if (status != kOk) return;
+  stats_.set_animation_size(webp_data.size);
+  if (stats_.output_cache_hit()) return;
+
+  for (const FrameData& frame : frames_) {
+    const WebPConfig& config = frame.final_config;
+    thumbnailer::ThumbnailerStats::Frame* const stats = stats_.add_frames();
+    stats->set_timestamp_ms(frame.timestamp_ms);
+    stats->set_quality(config.quality);
+    stats->set_lossless(config.lossless);
+    if (config.lossless) stats->set_near_lossless(config.near_lossless);
+    if (config.lossless && config.near_lossless == 100) {
+      stats->set_psnr(99.f);
+    } else if (!config.lossless && frame.lossy_psnr[int(config.quality)] >= 0) {
+      stats->set_psnr(frame.lossy_psnr[int(config.quality)]);
+    } else {
+      stats->set_psnr(frame.final_psnr);
+    }
+    if (frame.has_final_bitstream) {
+      stats->set_size(frame.final_bitstream.size());
+    }
+  }
+}
+
+void Thumbnailer::Reset() {
+  pictures_.Clear();
+  // Keep the records, with their RD cache vectors, for the next frames. They
+  // are stacked on top of the records of the dropped frames, if any, so that
+  // the n-th next frame gets the record of the n-th one, whose buffers were
+  // sized by a similar frame in similar jobs, until a frame is dropped.
+  for (auto it = frames_.rbegin(); it != frames_.rend(); ++it) {
+    spare_frames_.push_back(std::move(*it));
+  }
+  frames_.clear();
+  width_ = 0;
+  height_ = 0;
+  cached_animation_.clear();
+  has_result_ = false;
+  latest_timestamp_ms_ = 0;
+  start_timestamp_ms_ = 0;
+}
+
+void Thumbnailer::Reset(
+    const thumbnailer::ThumbnailerOption& thumbnailer_option) {
+  Reset();
+  pictures_.Reset(thumbnailer_option.memory_limit());
+  SetOptions(thumbnailer_option);
+}
+
+void Thumbnailer::FrameData::Reuse(int new_pic_id, int new_timestamp_ms,
+                                   const WebPConfig& new_config) {
+  pic_id = new_pic_id;
+  timestamp_ms = new_timestamp_ms;
+  config = new_config;
+  final_config = new_config;
+  encoded_size = 0;
+  final_quality = -1;
+  final_psnr = 0.0;
+  near_lossless = false;
+  task_status = kOk;
+  std::fill(lossy_size.begin(), lossy_size.end(), -1);
+  std::fill(lossy_psnr.begin(), lossy_psnr.end(), -1);
+  std::fill(lossy_chunk_size.begin(), lossy_chunk_size.end(), -1);
+  bitstream.clear();  // Keeps the capacity.
+  has_bitstream = false;
+  final_bitstream.clear();
+  has_final_bitstream = false;
+}
+
+WebPConfig Thumbnailer::NewFrameConfig() const {
+  WebPConfig config;
+  if (!WebPConfigInit(&config)) assert(false);
+  config.show_compressed = 1;
+  config.method = webp_method_;
+  return config;
+}
+
+int Thumbnailer::FindFrame(int timestamp_ms) const {
+  for (std::size_t i = 0; i < frames_.size(); ++i) {
+    if (frames_[i].timestamp_ms == timestamp_ms) return i;
+  }
+  return -1;
+}
 
-  // All frames are key frames.
-  anim_config_.kmax = 1;
+void Thumbnailer::AddFrameData(int pic_id, int timestamp_ms,
+                               const CacheKeyBuilder& content_key) {
+  const WebPConfig new_config = NewFrameConfig();
+  if (spare_frames_.empty()) {
+    frames_.emplace_back(pic_id, timestamp_ms, new_config);
+  } else {
+    spare_frames_.back().Reuse(pic_id, timestamp_ms, new_config);
+    frames_.push_back(std::move(spare_frames_.back()));
+    spare_frames_.pop_back();
+  }
+  frames_.back().content_key = content_key;
+  latest_timestamp_ms_ = std::max(latest_timestamp_ms_, timestamp_ms);
+  if (window_ms_ > 0) EvictFrames();
+}
+
+void Thumbnailer::DropFrame(int ind) {
+  pictures_.Release(frames_[ind].pic_id);
+  spare_frames_.push_back(std::move(frames_[ind]));
+  frames_.erase(frames_.begin() + ind);
+}
+
+void Thumbnailer::EvictFrames() {
+  const long long oldest_kept = (long long)latest_timestamp_ms_ - window_ms_;
+  for (std::size_t i = 0; i < frames_.size();) {
+    if (frames_[i].timestamp_ms > oldest_kept) {
+      ++i;
+      continue;
+    }
+    start_timestamp_ms_ =
+        std::max(start_timestamp_ms_, frames_[i].timestamp_ms);
+    DropFrame(i);
+  }
 }
 
-Thumbnailer::~Thumbnailer() { WebPAnimEncoderDelete(enc_); }
+Thumbnailer::Status Thumbnailer::SetOutputCache(
+    OutputCache* const output_cache) {
+  if (!frames_.empty()) return kGenericError;
+  output_cache_ = output_cache;
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::SetRDCache(RDCache* const rd_cache) {
+  if (!frames_.empty()) return kGenericError;
+  rd_cache_ = rd_cache;
+  return kOk;
+}
 
 Thumbnailer::Status Thumbnailer::AddFrame(const WebPPicture& pic,
                                           int timestamp_ms) {
   // Verify dimension of frames.
-  if (!frames_.empty() && (pic.width != frames_[0].pic.width ||
-                           pic.height != frames_[0].pic.height)) {
+  if (width_ > 0 && (pic.width != width_ || pic.height != height_)) {
     return kImageFormatError;
   }
-  WebPConfig new_config;
-  if (!WebPConfigInit(&new_config)) assert(false);
-  new_config.show_compressed = 1;
-  new_config.method = webp_method_;
-  frames_.emplace_back(pic, timestamp_ms, new_config);
+  // With a memory limit, only a few frames are kept decoded at a time.
+  const int pic_id = (memory_limit_ > 0) ? pictures_.AddCompressed(pic)
+                                         : pictures_.AddBorrowed(pic);
+  if (pic_id < 0) return kMemoryError;
+  width_ = pic.width;
+  height_ = pic.height;
+  CacheKeyBuilder content_key;
+  if (rd_cache_ != nullptr || output_cache_ != nullptr) {
+    content_key.Update(uint64_t(0));  // Tells pixels from encoded images.
+    content_key.Update(pic);
+  }
+  AddFrameData(pic_id, timestamp_ms, content_key);
   return kOk;
 }
 
+Thumbnailer::Status Thumbnailer::AddEncodedFrame(const uint8_t* data,
+                                                 size_t data_size,
+                                                 int timestamp_ms) {
+  const int pic_id = pictures_.AddEncoded(data, data_size);
+  if (pic_id < 0) return kMemoryError;
+  // Hashing the encoded image avoids decoding it up front.
+  CacheKeyBuilder content_key;
+  if (rd_cache_ != nullptr || output_cache_ != nullptr) {
+    content_key.Update(uint64_t(1));
+    content_key.Update(data, data_size);
+  }
+  AddFrameData(pic_id, timestamp_ms, content_key);
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::ReplaceFrame(const WebPPicture& pic,
+                                              int timestamp_ms) {
+  const int ind = FindFrame(timestamp_ms);
+  if (ind < 0) return kGenericError;
+  if (width_ > 0 && (pic.width != width_ || pic.height != height_)) {
+    return kImageFormatError;
+  }
+  const int pic_id = (memory_limit_ > 0) ? pictures_.AddCompressed(pic)
+                                         : pictures_.AddBorrowed(pic);
+  if (pic_id < 0) return kMemoryError;
+  pictures_.Release(frames_[ind].pic_id);
+  width_ = pic.width;
+  height_ = pic.height;
+  // The measurements and the encoding of the previous picture are dropped.
+  frames_[ind].Reuse(pic_id, timestamp_ms, NewFrameConfig());
+  if (rd_cache_ != nullptr || output_cache_ != nullptr) {
+    frames_[ind].content_key = CacheKeyBuilder();
+    frames_[ind].content_key.Update(uint64_t(0));
+    frames_[ind].content_key.Update(pic);
+  }
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::RemoveFrame(int timestamp_ms) {
+  const int ind = FindFrame(timestamp_ms);
+  if (ind < 0) return kGenericError;
+  DropFrame(ind);
+  return kOk;
+}
+
+void Thumbnailer::ResetSearchState() {
+  const WebPConfig new_config = NewFrameConfig();
+  for (FrameData& frame : frames_) {
+    frame.config = new_config;
+    frame.final_config = new_config;
+    frame.has_final_bitstream = false;  // Made with the previous final config.
+    frame.encoded_size = 0;
+    frame.final_quality = -1;
+    frame.final_psnr = 0.0;
+    frame.near_lossless = false;
+  }
+}
+
+Thumbnailer::Status Thumbnailer::InitCanvas() {
+  if (frames_.empty()) return kGenericError;
+  if (width_ > 0) return kOk;
+  const PictureCache::Handle pic = pictures_.Get(frames_[0].pic_id);
+  if (pic == nullptr) return kImageFormatError;
+  width_ = pic->width;
+  height_ = pic->height;
+  return kOk;
+}
+
+PictureCache::Handle Thumbnailer::GetPicture(int ind) {
+  // Frames are mostly visited in order.
+  if (ind + 1 < int(frames_.size())) {
+    pictures_.Prefetch(frames_[ind + 1].pic_id);
+  }
+  PictureCache::Handle pic = pictures_.Get(frames_[ind].pic_id);
+  if (pic != nullptr && (pic->width != width_ || pic->height != height_)) {
+    std::cerr << "Frame dimensions mismatched." << std::endl;
+    return nullptr;
+  }
+  return pic;
+}
+
 Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
                                                  size_t* const pic_size,
                                                  float* const pic_psnr) {
-  const int quality = int(frames_[ind].config.quality);
-  if (!frames_[ind].config.lossless && frames_[ind].lossy_size[quality] != -1) {
-    *pic_size = frames_[ind].lossy_size[quality];
-    *pic_psnr = frames_[ind].lossy_psnr[quality];
+  FrameData& frame = frames_[ind];
+  const int quality = int(frame.config.quality);
+  if (frame.config.lossless) {
+    return MeasurePictureStats(ind, pic_size, pic_psnr);
+  }
+  if (frame.lossy_size[quality] != -1) {
+    THUMBNAILER_PROBE3(rd_cache__hit, ind, quality, 0);
+    *pic_size = frame.lossy_size[quality];
+    *pic_psnr = frame.lossy_psnr[quality];
+    ++rd_cache_hits_;
     return kOk;
   }
+  if (rd_cache_ == nullptr) {
+    CHECK_THUMBNAILER_STATUS(MeasurePictureStats(ind, pic_size, pic_psnr));
+  } else {
+    // The lossy encoding only depends on the picture, the quality and the
+    // method.
+    CacheKeyBuilder key = frame.content_key;
+    key.Update(uint64_t(frame.config.method));
+    key.Update(uint64_t(quality));
+    const std::string key_string = key.ToString();
+    RDCache::Point point;
+    if (rd_cache_->Lookup(key_string, &point)) {
+      THUMBNAILER_PROBE3(rd_cache__hit, ind, quality, 1);
+      *pic_size = point.size;
+      *pic_psnr = point.psnr;
+      ++rd_cache_hits_;
+      ++shared_rd_cache_hits_;
+    } else {
+      const Status status = MeasurePictureStats(ind, pic_size, pic_psnr);
+      if (status != kOk) {
+        rd_cache_->Abandon(key_string);
+        return status;
+      }
+      rd_cache_->Insert(key_string, {*pic_size, *pic_psnr});
+    }
+  }
+  frame.lossy_size[quality] = *pic_size;
+  frame.lossy_psnr[quality] = *pic_psnr;
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::MeasurePictureStats(int ind,
+                                                     size_t* const pic_size,
+                                                     float* const pic_psnr) {
+  const int quality = int(frames_[ind].config.quality);
+  CHECK_THUMBNAILER_STATUS(StartProbe());
+  ++rd_cache_misses_;
+  THUMBNAILER_PROBE2(rd_cache__miss, ind, quality);
+  THUMBNAILER_PROBE4(measure__start, ind, quality,
+                     frames_[ind].config.lossless,
+                     frames_[ind].config.near_lossless);
+  TraceScope trace("MeasureFrame", "frame", ind, "quality", quality);
+  ScopedThreadCpuTime cpu_time(&encode_cpu_us_, &worker_cpu_us_, job_thread_);
+
+  const PictureCache::Handle pic = GetPicture(ind);
+  if (pic == nullptr) return kStatsError;
 
   WebPPicture encoded_pic;
   WebPMemoryWriter memory_writer;
   WebPMemoryWriterInit(&memory_writer);
 
-  if (!WebPPictureCopy(&frames_[ind].pic, &encoded_pic)) {
+  if (!WebPPictureCopy(pic.get(), &encoded_pic)) {
     WebPPictureFree(&encoded_pic);
     return kStatsError;
   }
+  bytes_copied_ += PictureSize(encoded_pic);
 
   // Lossy will modify the 'encoded_pic' but not lossless and near-lossless.
   // Therefore, keep the encoded bitstream in the memory and decode it to
@@ -107,6 +586,7 @@ Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
       *pic_size = encoded_pic.stats->coded_size;
       WebPPictureFree(&encoded_pic);
       WebPMemoryWriterClear(&memory_writer);
+      THUMBNAILER_PROBE5(measure__done, ind, quality, 1, 100, *pic_size);
       return kOk;
     } else {
       // Decode the bitstream stored in 'memory_writer' to get the altered
@@ -131,8 +611,7 @@ Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
   *pic_size = encoded_pic.stats->coded_size;
 
   float distortion_result[5];
-  if (!WebPPictureDistortion(&frames_[ind].pic, &encoded_pic, 0,
-                             distortion_result)) {
+  if (!WebPPictureDistortion(pic.get(), &encoded_pic, 0, distortion_result)) {
     WebPPictureFree(&encoded_pic);
     WebPMemoryWriterClear(&memory_writer);
     return kStatsError;
@@ -140,14 +619,12 @@ Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
     *pic_psnr = distortion_result[4];  // PSNR-all.
   }
 
-  if (!frames_[ind].config.lossless) {
-    frames_[ind].lossy_size[quality] = *pic_size;
-    frames_[ind].lossy_psnr[quality] = *pic_psnr;
-  }
-
   WebPPictureFree(&encoded_pic);
   WebPMemoryWriterClear(&memory_writer);
 
+  THUMBNAILER_PROBE5(measure__done, ind, quality,
+                     frames_[ind].config.lossless,
+                     frames_[ind].config.near_lossless, *pic_size);
   return kOk;
 }
 
@@ -162,83 +639,516 @@ size_t Thumbnailer::GetAnimationSize(WebPData* const webp_data) {
   return std::max(sum_frame_sizes, int(webp_data->size));
 }
 
-Thumbnailer::Status Thumbnailer::SetLoopCount(WebPData* const webp_data) {
-  std::unique_ptr<WebPMux, void (*)(WebPMux*)> mux(WebPMuxCreate(webp_data, 1),
-                                                   WebPMuxDelete);
-  if (mux == nullptr) return kWebPMuxError;
+void Thumbnailer::AcceptAnimation(WebPData* const webp_data,
+                                  WebPData* const new_webp_data) {
+  WebPDataClear(webp_data);
+  *webp_data = *new_webp_data;
+  WebPDataInit(new_webp_data);
+  // Keep the encodings of the animation, which later probes may overwrite.
+  for (FrameData& frame : frames_) {
+    const std::vector<uint8_t>* const bitstream = GetBitstream(frame);
+    if (bitstream == &frame.bitstream) {
+      // Swapping keeps the capacity of both buffers for the next encodings.
+      frame.final_bitstream.swap(frame.bitstream);
+      frame.has_bitstream = false;
+      frame.has_final_bitstream = true;
+    } else if (bitstream == nullptr) {
+      frame.has_final_bitstream = false;
+    }
+    frame.final_config = frame.config;
+  }
 
-  WebPMuxAnimParams new_params;
-  CONVERT_WEBP_MUX_STATUS(WebPMuxGetAnimationParams(mux.get(), &new_params));
+  // The PSNR is only known if all the frames were measured with their config.
+  float psnr_sum = 0.f;
+  for (const FrameData& frame : frames_) {
+    const WebPConfig& config = frame.config;
+    if (config.lossless && config.near_lossless == 100) {
+      psnr_sum += 99.f;
+    } else if (!config.lossless &&
+               frame.lossy_psnr[int(config.quality)] >= 0) {
+      psnr_sum += frame.lossy_psnr[int(config.quality)];
+    } else {
+      psnr_sum = 0.f;
+      break;
+    }
+  }
+  progress_.best_size = webp_data->size;
+  progress_.best_psnr = psnr_sum / frames_.size();
+  ReportProgress();
+}
 
-  new_params.loop_count = loop_count_;
-  CONVERT_WEBP_MUX_STATUS(WebPMuxSetAnimationParams(mux.get(), &new_params));
+Thumbnailer::Status Thumbnailer::EncodeFrame(int ind,
+                                             const WebPConfig& config,
+                                             WebPMemoryWriter* const writer) {
+  CHECK_THUMBNAILER_STATUS(StartProbe());
+  TraceScope trace("EncodeFrame", "frame", ind, "quality", config.quality);
+  THUMBNAILER_PROBE4(encode__start, ind, int(config.quality), config.lossless,
+                     config.near_lossless);
+  ScopedThreadCpuTime cpu_time(&encode_cpu_us_, &worker_cpu_us_, job_thread_);
+  const PictureCache::Handle frame_pic = GetPicture(ind);
+  if (frame_pic == nullptr) return kMemoryError;
+  WebPPicture pic;
+  if (!WebPPictureCopy(frame_pic.get(), &pic)) return kMemoryError;
+  bytes_copied_ += PictureSize(pic);
+  pic.writer = WebPMemoryWrite;
+  pic.custom_ptr = writer;
+  const bool ok = WebPEncode(&config, &pic);
+  WebPPictureFree(&pic);
+  if (!ok) return kMemoryError;
 
-  WebPDataClear(webp_data);
-  CONVERT_WEBP_MUX_STATUS(WebPMuxAssemble(mux.get(), webp_data));
+  // Like WebPAnimEncoder, keep the smaller of the lossy and lossless encodings
+  // when mixed compression is allowed.
+  if (allow_mixed_) {
+    WebPConfig other_config = config;
+    other_config.lossless = !config.lossless;
+    WebPMemoryWriter other_writer;
+    WebPMemoryWriterInit(&other_writer);
+    if (!WebPPictureCopy(frame_pic.get(), &pic)) {
+      WebPMemoryWriterClear(&other_writer);
+      return kMemoryError;
+    }
+    bytes_copied_ += PictureSize(pic);
+    pic.writer = WebPMemoryWrite;
+    pic.custom_ptr = &other_writer;
+    const bool other_ok = WebPEncode(&other_config, &pic);
+    WebPPictureFree(&pic);
+    if (other_ok && other_writer.size < writer->size) {
+      std::swap(*writer, other_writer);
+    }
+    WebPMemoryWriterClear(&other_writer);
+  }
+  THUMBNAILER_PROBE5(encode__done, ind, int(config.quality), config.lossless,
+                     config.near_lossless, writer->size);
+  return kOk;
+}
 
+Thumbnailer::Status Thumbnailer::WriteAnimation(int fd) {
+  if (!cached_animation_.empty()) {
+    AnimationWriter writer(fd);
+    if (!writer.Write(cached_animation_.data(), cached_animation_.size())) {
+      return kWriteError;
+    }
+    return kOk;
+  }
+  // The frames hold the encodings of the last accepted animation, unless
+  // they were edited since.
+  if (!has_result_) return kGenericError;
+  for (const FrameData& frame : frames_) {
+    if (!frame.has_final_bitstream) return kGenericError;
+  }
+  CHECK_THUMBNAILER_STATUS(InitCanvas());
+
+  bool has_alpha = false;
+  for (const FrameData& frame : frames_) {
+    has_alpha |= HasAlpha(frame.final_bitstream);
+  }
+
+  // The RIFF size is patched at the end on seekable outputs. Otherwise it has
+  // to be known up front.
+  size_t riff_size = 0;
+  if (!AnimationWriter::IsSeekable(fd)) {
+    riff_size = AnimationWriter::HeaderSize();
+    for (const FrameData& frame : frames_) {
+      riff_size += AnimationWriter::FrameChunkSize(
+          frame.final_bitstream.data(), frame.final_bitstream.size());
+    }
+  }
+
+  AnimationWriter writer(fd);
+  if (!writer.Start(width_, height_, has_alpha, loop_count_,
+                    bgcolor_, riff_size)) {
+    return kWriteError;
+  }
+  int prev_timestamp = start_timestamp_ms_;
+  for (const FrameData& frame : frames_) {
+    if (cancellation_token_ != nullptr && cancellation_token_->IsCancelled()) {
+      return kCancelled;
+    }
+    if (!writer.AddFrame(frame.final_bitstream.data(),
+                         frame.final_bitstream.size(),
+                         frame.timestamp_ms - prev_timestamp)) {
+      return kWriteError;
+    }
+    prev_timestamp = frame.timestamp_ms;
+  }
+
+  if (!writer.Finish()) return kWriteError;
+  if (verbose_) {
+    std::cout << "Streamed animation size: " << writer.size() << std::endl;
+  }
   return kOk;
 }
 
 Thumbnailer::Status Thumbnailer::GenerateAnimation(WebPData* const webp_data,
                                                    Method method) {
+  return Generate(webp_data, method, /*incremental=*/false);
+}
+
+Thumbnailer::Status Thumbnailer::RegenerateAnimation(
+    WebPData* const webp_data, Method method) {
+  return Generate(webp_data, method, /*incremental=*/true);
+}
+
+Thumbnailer::Status Thumbnailer::Generate(WebPData* const webp_data,
+                                          Method method, bool incremental) {
+  TraceScope trace("GenerateAnimation", "frames", frames_.size(), "method",
+                   method);
+  ScopedAllocScope alloc_scope(StartAllocScope());
+  StartStats();
+  // An incremental regeneration depends on the previous animation, not only
+  // on the frames: its result is neither looked up nor stored.
+  const bool use_output_cache =
+      (output_cache_ != nullptr && !(incremental && has_result_));
+  std::string cache_key;
+  if (use_output_cache) {
+    cache_key = OutputCacheKey(method);
+    if (output_cache_->Lookup(cache_key, &cached_animation_)) {
+      THUMBNAILER_PROBE1(output_cache__hit, cached_animation_.size());
+      const WebPData cached = {cached_animation_.data(),
+                               cached_animation_.size()};
+      WebPDataClear(webp_data);
+      if (stream_output_) {
+        webp_data->size = cached.size;  // Written by WriteAnimation().
+      } else if (!WebPDataCopy(&cached, webp_data)) {
+        return kMemoryError;
+      }
+      if (verbose_) std::cout << "Output cache hit." << std::endl;
+      has_result_ = false;  // The frames do not hold this animation.
+      stats_.set_output_cache_hit(true);
+      FinishStats(kOk, *webp_data);
+      return kOk;
+    }
+    THUMBNAILER_PROBE0(output_cache__miss);
+  }
+  cached_animation_.clear();
+  num_probes_ = 0;
+  progress_ = {"", 0, 0, 0.f};
+  if (cancellation_token_ != nullptr && cancellation_token_->IsCancelled()) {
+    return kCancelled;
+  }
+  CHECK_THUMBNAILER_STATUS(InitCanvas());
+
+  Status status;
+  if (incremental && has_result_) {
+    status = RegenerateIncrementally(webp_data, method);
+  } else {
+    ResetSearchState();
+    status = RunMethod(webp_data, method);
+  }
+  has_result_ = (status == kOk);
+  if (verbose_) {
+    if (memory_limit_ > 0) {
+      std::cout << "Compressed frames size: " << pictures_.compressed_size()
+                << std::endl;
+    }
+    std::cout << "Peak RSS: " << GetPeakRSSKb() << " KB" << std::endl;
+  }
+  if (status == kOk) {
+    progress_.best_size = webp_data->size;
+    SetPhase("done");
+  }
+  FinishStats(status, *webp_data);
+  if (status == kOk && use_output_cache && !stream_output_ &&
+      !output_cache_->Store(cache_key, webp_data->bytes, webp_data->size) &&
+      verbose_) {
+    std::cerr << "Could not store the animation in the output cache."
+              << std::endl;
+  }
+  return status;
+}
+
+std::string Thumbnailer::OutputCacheKey(Method method) const {
+  // The frames are hashed in timestamp order, so that the key does not depend
+  // on the edits that led to them.
+  std::vector<const FrameData*> frames;
+  frames.reserve(frames_.size());
+  for (const FrameData& frame : frames_) frames.push_back(&frame);
+  std::sort(frames.begin(), frames.end(),
+            [](const FrameData* a, const FrameData* b) -> bool {
+              return a->timestamp_ms < b->timestamp_ms;
+            });
+  CacheKeyBuilder key;
+  for (const FrameData* const frame : frames) {
+    const std::string content_key = frame->content_key.ToString();
+    key.Update(content_key.data(), content_key.size());
+    key.Update(uint64_t(frame->timestamp_ms));
+  }
+  // Sets the duration of the first frame, e.g. after a window eviction.
+  key.Update(uint64_t(start_timestamp_ms_));
+  key.Update(option_key_.data(), option_key_.size());
+  key.Update(uint64_t(method));
+  return key.ToString();
+}
+
+Thumbnailer::Status Thumbnailer::RegenerateIncrementally(
+    WebPData* const webp_data, Method method) {
+  TraceScope trace("RegenerateIncrementally");
+  std::sort(frames_.begin(), frames_.end(),
+            [](const FrameData& a, const FrameData& b) -> bool {
+              return a.timestamp_ms < b.timestamp_ms;
+            });
+
+  // Untouched frames keep their final configuration. New frames take the one
+  // of the closest previous untouched frame, or of the first one.
+  SetPhase("incremental");
+  const int num_frames = frames_.size();
+  int first_untouched = -1;
+  for (int i = 0; i < num_frames && first_untouched < 0; ++i) {
+    if (frames_[i].has_final_bitstream) first_untouched = i;
+  }
+  int num_new_frames = 0;
+  int prev = first_untouched;
+  for (int i = 0; i < num_frames && first_untouched >= 0; ++i) {
+    FrameData& frame = frames_[i];
+    if (frame.has_final_bitstream) {
+      prev = i;
+    } else {
+      ++num_new_frames;
+      frame.final_config = frames_[prev].final_config;
+      frame.final_quality = frames_[prev].final_quality;
+      frame.near_lossless = frames_[prev].near_lossless;
+    }
+    frame.config = frame.final_config;
+  }
+
+  if (first_untouched >= 0) {
+    WebPData new_webp_data;
+    WebPDataInit(&new_webp_data);
+    CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
+    if (new_webp_data.size <= byte_budget_) {
+      if (verbose_) {
+        std::cout << "Kept the previous configurations, " << num_new_frames
+                  << " new frame(s) encoded." << std::endl;
+      }
+      AcceptAnimation(webp_data, &new_webp_data);
+      return kOk;
+    }
+    WebPDataClear(&new_webp_data);
+  }
+
+  // The untouched frames keep their measurements and encodings, so the new
+  // search mostly encodes the new frames.
+  ResetSearchState();
+  return RunMethod(webp_data, method);
+}
+
+Thumbnailer::Status Thumbnailer::GenerateAnimationLadder(
+    const std::vector<size_t>& budgets, std::vector<WebPData>* const webp_data,
+    Method method) {
+  TraceScope trace("GenerateAnimationLadder", "budgets", budgets.size());
+  ScopedAllocScope alloc_scope(StartAllocScope());
+  StartStats();
+  cached_animation_.clear();
+  num_probes_ = 0;
+  progress_ = {"", 0, 0, 0.f};
+  CHECK_THUMBNAILER_STATUS(InitCanvas());
+
+  std::vector<int> order(budgets.size());
+  for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&budgets](int a, int b) { return budgets[a] < budgets[b]; });
+
+  webp_data->resize(budgets.size());
+  for (WebPData& data : *webp_data) WebPDataInit(&data);
+  // The animations of all the budgets are returned.
+  const bool stream_output = stream_output_;
+  stream_output_ = false;
+  const size_t byte_budget = byte_budget_;
+  Status status = kOk;
+  for (int i : order) {
+    ResetSearchState();
+    byte_budget_ = budgets[i];
+    status = RunMethod(&(*webp_data)[i], method);
+    if (status != kOk) break;
+    if (verbose_) {
+      std::cout << "Budget " << budgets[i]
+                << ": animation size: " << (*webp_data)[i].size << std::endl;
+    }
+  }
+  byte_budget_ = byte_budget;
+  stream_output_ = stream_output;
+  // The frames hold the animation of the largest budget.
+  const bool has_animation = (status == kOk && !order.empty());
+  has_result_ = has_animation;
+  FinishStats(status, has_animation ? (*webp_data)[order.back()]
+                                    : WebPData{nullptr, 0});
+
+  if (status != kOk) {
+    for (WebPData& data : *webp_data) WebPDataClear(&data);
+    webp_data->clear();
+    return status;
+  }
+  SetPhase("done");
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::RunMethod(WebPData* const webp_data,
+                                           Method method) {
+  Status status;
   if (method == kEqualQuality) {
-    return GenerateAnimationEqualQuality(webp_data);
+    SetPhase("equal_quality");
+    status = GenerateAnimationEqualQuality(webp_data);
   } else if (method == kEqualPSNR) {
-    return GenerateAnimationEqualPSNR(webp_data);
+    SetPhase("equal_psnr");
+    status = GenerateAnimationEqualPSNR(webp_data);
   } else if (method == kSlopeOptim) {
-    return GenerateAnimationSlopeOptim(webp_data);
+    SetPhase("slope_optim");
+    status = GenerateAnimationSlopeOptim(webp_data);
   } else if (method == kNearllDiff) {
-    CHECK_THUMBNAILER_STATUS(GenerateAnimationEqualQuality(webp_data));
-    return NearLosslessDiff(webp_data);
+    SetPhase("equal_quality");
+    status = GenerateAnimationEqualQuality(webp_data);
+    if (status == kOk) SetPhase("near_ll_diff");
+    if (status == kOk) status = NearLosslessDiff(webp_data);
   } else if (method == kNearllEqual) {
-    CHECK_THUMBNAILER_STATUS(GenerateAnimationEqualQuality(webp_data));
-    return NearLosslessEqual(webp_data);
+    SetPhase("equal_quality");
+    status = GenerateAnimationEqualQuality(webp_data);
+    if (status == kOk) SetPhase("near_ll_equal");
+    if (status == kOk) status = NearLosslessEqual(webp_data);
   } else {
     std::cerr << "Invalid method." << std::endl;
     return kGenericError;
   }
+  return status;
 }
 
-Thumbnailer::Status Thumbnailer::GenerateAnimationConfigured(
-    WebPData* const webp_data) {
-  // Delete the previous WebPAnimEncoder object and initialize a new one.
-  WebPAnimEncoderDelete(enc_);
-  enc_ = WebPAnimEncoderNew(frames_[0].pic.width, frames_[0].pic.height,
-                            &anim_config_);
-  if (enc_ == nullptr) return kMemoryError;
-
-  // Fill the animation.
-  int prev_timestamp = 0;
-  for (const FrameData& frame : frames_) {
-    // Copy the 'frame.pic' to a new WebPPicture object and remain the original
-    // 'frame.pic' for later comparison.
-    WebPPicture new_pic;
-
-    // WebPAnimEncoderAdd uses starting timestamps instead of ending timestamps.
-    if (!WebPPictureCopy(&frame.pic, &new_pic) ||
-        !WebPAnimEncoderAdd(enc_, &new_pic, prev_timestamp, &frame.config)) {
-      WebPPictureFree(&new_pic);
-      return kMemoryError;
+const std::vector<uint8_t>* Thumbnailer::GetBitstream(
+    const FrameData& frame) {
+  if (frame.has_bitstream && !memcmp(&frame.bitstream_config, &frame.config,
+                                     sizeof(frame.config))) {
+    return &frame.bitstream;
+  }
+  if (frame.has_final_bitstream && !memcmp(&frame.final_config, &frame.config,
+                                           sizeof(frame.config))) {
+    return &frame.final_bitstream;
+  }
+  return nullptr;
+}
+
+Thumbnailer::Status Thumbnailer::EncodeFrames(bool measure_only) {
+  // Encode the frames in parallel. The scratch buffers are kept from one call
+  // to the next and only grow.
+  const int num_frames = frames_.size();
+  while (int(bitstreams_.size()) < num_frames) {
+    bitstreams_.emplace_back();
+    WebPMemoryWriterInit(&bitstreams_.back());
+  }
+  {
+    TaskGroup tasks(ThreadPool::Default());
+    for (int i = 0; i < num_frames; ++i) {
+      const FrameData& frame = frames_[i];
+      frames_[i].task_status = kOk;
+      if (GetBitstream(frame) != nullptr) {
+        if (!measure_only) ++reused_encodes_;
+        continue;
+      }
+      if (measure_only && !frame.config.lossless &&
+          frame.lossy_chunk_size[int(frame.config.quality)] >= 0) {
+        continue;
+      }
+      tasks.Run([this, i]() {
+        FrameData& frame = frames_[i];
+        WebPMemoryWriter& writer = bitstreams_[i];
+        writer.size = 0;
+        frame.task_status = EncodeFrame(i, frame.config, &writer);
+        if (frame.task_status != kOk) return;
+        const size_t chunk_size =
+            AnimationWriter::FrameChunkSize(writer.mem, writer.size);
+        if (chunk_size == 0) {
+          frame.task_status = kMemoryError;
+          return;
+        }
+        frame.bitstream.assign(writer.mem, writer.mem + writer.size);
+        bytes_copied_ += writer.size;
+        frame.bitstream_config = frame.config;
+        frame.has_bitstream = true;
+        if (!frame.config.lossless) {
+          frame.lossy_chunk_size[int(frame.config.quality)] = chunk_size;
+        }
+      });
     }
-    WebPPictureFree(&new_pic);
-    prev_timestamp = frame.timestamp_ms;
+    tasks.Wait();
   }
+  for (const FrameData& frame : frames_) {
+    CHECK_THUMBNAILER_STATUS(frame.task_status);
+  }
+  return kOk;
+}
 
-  // Add last frame.
-  if (!WebPAnimEncoderAdd(enc_, NULL, frames_.back().timestamp_ms, NULL)) {
-    return kMemoryError;
+bool Thumbnailer::GetUniformAnimationSize(int quality,
+                                          size_t* const size) const {
+  size_t frames_size = 0;
+  for (const FrameData& frame : frames_) {
+    if (frame.lossy_chunk_size[quality] < 0) return false;
+    frames_size += frame.lossy_chunk_size[quality];
   }
+  *size = AnimationWriter::AnimationSize(frames_size);
+  return true;
+}
 
-  if (!WebPAnimEncoderAssemble(enc_, webp_data)) {
-    return kMemoryError;
+Thumbnailer::Status Thumbnailer::GenerateAnimationConfigured(
+    WebPData* const webp_data) {
+  CHECK_THUMBNAILER_STATUS(EncodeFrames(/*measure_only=*/false));
+
+  if (stream_output_) {
+    // The animation is only written by WriteAnimation(), so its size is
+    // enough.
+    size_t frames_size = 0;
+    for (const FrameData& frame : frames_) {
+      const std::vector<uint8_t>& bitstream = *GetBitstream(frame);
+      frames_size +=
+          AnimationWriter::FrameChunkSize(bitstream.data(), bitstream.size());
+    }
+    WebPDataInit(webp_data);
+    webp_data->size = AnimationWriter::AnimationSize(frames_size);
+    ReportProgress();
+    return kOk;
   }
 
-  if (loop_count_ == 0) return kOk;
-  return SetLoopCount(webp_data);
+  // Assemble the animation.
+  TraceScope trace("AssembleAnimation", "frames", frames_.size());
+  THUMBNAILER_PROBE1(assembly__start, frames_.size());
+  const double start_wall_ms = WallTimeMs();
+  const double start_cpu_ms = CpuTimeMs(CLOCK_THREAD_CPUTIME_ID);
+  bool has_alpha = false;
+  for (const FrameData& frame : frames_) {
+    has_alpha |= HasAlpha(*GetBitstream(frame));
+  }
+  WebPMemoryWriter memory_writer;
+  WebPMemoryWriterInit(&memory_writer);
+  AnimationWriter writer(&memory_writer);
+  Status status = kOk;
+  if (!writer.Start(width_, height_, has_alpha, loop_count_,
+                    bgcolor_, /*riff_size=*/0)) {
+    status = kMemoryError;
+  }
+  int prev_timestamp = start_timestamp_ms_;
+  for (std::size_t i = 0; i < frames_.size() && status == kOk; ++i) {
+    const std::vector<uint8_t>& bitstream = *GetBitstream(frames_[i]);
+    if (!writer.AddFrame(bitstream.data(), bitstream.size(),
+                         frames_[i].timestamp_ms - prev_timestamp)) {
+      status = kMemoryError;
+    }
+    prev_timestamp = frames_[i].timestamp_ms;
+  }
+  if (status == kOk && !writer.Finish()) status = kMemoryError;
+  if (status != kOk) {
+    WebPMemoryWriterClear(&memory_writer);
+    return status;
+  }
+  webp_data->bytes = memory_writer.mem;
+  webp_data->size = memory_writer.size;
+  ++num_assemblies_;
+  THUMBNAILER_PROBE2(assembly__done, frames_.size(), memory_writer.size);
+  bytes_copied_ += memory_writer.size;
+  AddPhaseTime("assembly", WallTimeMs() - start_wall_ms,
+               CpuTimeMs(CLOCK_THREAD_CPUTIME_ID) - start_cpu_ms);
+  ReportProgress();
+  return kOk;
 }
 
 Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
     WebPData* const webp_data) {
+  TraceScope trace("GenerateAnimationEqualQuality");
   // Sort frames.
   std::sort(frames_.begin(), frames_.end(),
             [](const FrameData& a, const FrameData& b) -> bool {
@@ -266,23 +1176,54 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
 
   int max_quality = 100;
   int final_quality = -1;
+  int accepted_quality = -1;  // Quality of the animation in 'webp_data'.
   WebPData new_webp_data;
   WebPDataInit(&new_webp_data);
 
+  // With the same quality for all frames, the animation size is the sum of
+  // the frame chunk sizes, so the frames measured by previous searches (e.g.
+  // for other budgets, or before an edit) are not encoded again.
+  const bool uniform_quality = !slope_optim_done;
+
   while (min_quality <= max_quality) {
     int mid_quality = (min_quality + max_quality) / 2;
+    TraceScope probe_trace("EqualQualityProbe", "quality", mid_quality);
     for (FrameData& frame : frames_) {
       if (!frame.near_lossless) {
         frame.config.quality = std::max(frame.final_quality, mid_quality);
       }
     }
 
-    CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
+    if (uniform_quality) {
+      CHECK_THUMBNAILER_STATUS(EncodeFrames(/*measure_only=*/true));
+      size_t anim_size;
+      if (!GetUniformAnimationSize(mid_quality, &anim_size)) {
+        return kGenericError;
+      }
+      if (anim_size > byte_budget_) {
+        max_quality = mid_quality - 1;
+        continue;
+      }
+      final_quality = mid_quality;
+      min_quality = mid_quality + 1;
+      // Assemble the animation right away if no frame needs encoding.
+      bool all_encoded = true;
+      for (const FrameData& frame : frames_) {
+        all_encoded &= (GetBitstream(frame) != nullptr);
+      }
+      if (all_encoded) {
+        CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
+        accepted_quality = mid_quality;
+        AcceptAnimation(webp_data, &new_webp_data);
+      }
+      continue;
+    }
 
+    CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
     if (new_webp_data.size <= byte_budget_) {
       final_quality = mid_quality;
-      WebPDataClear(webp_data);
-      *webp_data = new_webp_data;
+      accepted_quality = mid_quality;
+      AcceptAnimation(webp_data, &new_webp_data);
       min_quality = mid_quality + 1;
     } else {
       max_quality = mid_quality - 1;
@@ -290,6 +1231,14 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
     }
   }
 
+  // The final quality may have been measured without assembling the
+  // animation.
+  if (final_quality != -1 && accepted_quality != final_quality) {
+    for (FrameData& frame : frames_) frame.config.quality = final_quality;
+    CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
+    AcceptAnimation(webp_data, &new_webp_data);
+  }
+
   for (std::size_t i = 0; i < frames_.size(); ++i) {
     if (!frames_[i].near_lossless && frames_[i].final_quality < final_quality) {
       frames_[i].final_quality = final_quality;
@@ -305,8 +1254,50 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
   return (!slope_optim_done && final_quality == -1) ? kByteBudgetError : kOk;
 }
 
+Thumbnailer::Status Thumbnailer::FindQualityForPSNR(int ind, int target_psnr,
+                                                    bool* const in_range) {
+  FrameData& frame = frames_[ind];
+  int frame_min_quality = 0;
+  int frame_max_quality = 100;
+  int frame_final_quality = -1;
+
+  float frame_lowest_psnr;
+  float frame_highest_psnr;
+  size_t current_size;
+  frame.config.quality = 0;
+  CHECK_THUMBNAILER_STATUS(
+      GetPictureStats(ind, &current_size, &frame_lowest_psnr));
+  frame.config.quality = 100;
+  CHECK_THUMBNAILER_STATUS(
+      GetPictureStats(ind, &current_size, &frame_highest_psnr));
+
+  // Target PSNR is out of range.
+  *in_range = (target_psnr <= std::floor(frame_highest_psnr) &&
+               target_psnr >= std::floor(frame_lowest_psnr));
+  if (!*in_range) return kOk;
+
+  // Binary search for quality value.
+  while (frame_min_quality <= frame_max_quality) {
+    int frame_mid_quality = (frame_min_quality + frame_max_quality) / 2;
+    frame.config.quality = frame_mid_quality;
+    float current_psnr;
+    CHECK_THUMBNAILER_STATUS(
+        GetPictureStats(ind, &current_size, &current_psnr));
+    if (std::floor(current_psnr) <= target_psnr) {
+      frame_final_quality = frame_mid_quality;
+      frame_min_quality = frame_mid_quality + 1;
+    } else {
+      frame_max_quality = frame_mid_quality - 1;
+    }
+  }
+
+  frame.config.quality = frame_final_quality;
+  return kOk;
+}
+
 Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
     WebPData* const webp_data) {
+  TraceScope trace("GenerateAnimationEqualPSNR");
   CHECK_THUMBNAILER_STATUS(GenerateAnimationEqualQuality(webp_data));
 
   int high_psnr = -1;
@@ -325,82 +1316,37 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
   }
 
   for (int target_psnr = high_psnr; target_psnr >= low_psnr; --target_psnr) {
-    bool all_frames_iterated = true;
-
-    WebPAnimEncoderDelete(enc_);
-    enc_ = WebPAnimEncoderNew(frames_[0].pic.width, frames_[0].pic.height,
-                              &anim_config_);
-    if (enc_ == nullptr) return kMemoryError;
-
-    int curr_ind = 0;
+    TraceScope target_trace("EqualPSNRTarget", "psnr", target_psnr);
     // For each frame, find the quality value that produces WebPPicture
-    // having PSNR close to target_psnr.
-    int prev_timestamp = 0;
-    for (FrameData& frame : frames_) {
-      int frame_min_quality = 0;
-      int frame_max_quality = 100;
-      int frame_final_quality = -1;
-
-      float frame_lowest_psnr;
-      float frame_highest_psnr;
-      size_t current_size;
-      frame.config.quality = 0;
-      CHECK_THUMBNAILER_STATUS(
-          GetPictureStats(curr_ind, &current_size, &frame_lowest_psnr));
-      frame.config.quality = 100;
-      CHECK_THUMBNAILER_STATUS(
-          GetPictureStats(curr_ind, &current_size, &frame_highest_psnr));
-
-      // Target PSNR is out of range.
-      if (target_psnr > std::floor(frame_highest_psnr) ||
-          target_psnr < std::floor(frame_lowest_psnr)) {
-        all_frames_iterated = false;
-        break;
-      }
-
-      // Binary search for quality value.
-      while (frame_min_quality <= frame_max_quality) {
-        int frame_mid_quality = (frame_min_quality + frame_max_quality) / 2;
-        frame.config.quality = frame_mid_quality;
-        float current_psnr;
-        CHECK_THUMBNAILER_STATUS(
-            GetPictureStats(curr_ind, &current_size, &current_psnr));
-        if (std::floor(current_psnr) <= target_psnr) {
-          frame_final_quality = frame_mid_quality;
-          frame_min_quality = frame_mid_quality + 1;
-        } else {
-          frame_max_quality = frame_mid_quality - 1;
-        }
-      }
-
-      frame.config.quality = frame_final_quality;
-
-      WebPPicture new_pic;
-      if (!WebPPictureCopy(&frame.pic, &new_pic) ||
-          !WebPAnimEncoderAdd(enc_, &new_pic, prev_timestamp, &frame.config)) {
-        WebPPictureFree(&new_pic);
-        return kMemoryError;
+    // having PSNR close to target_psnr. The frames are searched in parallel.
+    const int num_frames = frames_.size();
+    std::atomic<bool> all_frames_iterated(true);
+    {
+      TaskGroup tasks(ThreadPool::Default());
+      for (int i = 0; i < num_frames; ++i) {
+        frames_[i].task_status = kOk;
+        tasks.Run([this, i, target_psnr, &all_frames_iterated]() {
+          // No need to search if another frame is already out of range.
+          if (!all_frames_iterated) return;
+          bool in_range;
+          frames_[i].task_status =
+              FindQualityForPSNR(i, target_psnr, &in_range);
+          if (!in_range) all_frames_iterated = false;
+        });
       }
-      WebPPictureFree(&new_pic);
-      prev_timestamp = frame.timestamp_ms;
-      ++curr_ind;
+      tasks.Wait();
     }
-
-    // Add last frame.
-    if (!WebPAnimEncoderAdd(enc_, NULL, frames_.back().timestamp_ms, NULL)) {
-      return kMemoryError;
+    for (const FrameData& frame : frames_) {
+      CHECK_THUMBNAILER_STATUS(frame.task_status);
     }
 
     if (all_frames_iterated) {
       WebPData new_webp_data;
       WebPDataInit(&new_webp_data);
-      if (!WebPAnimEncoderAssemble(enc_, &new_webp_data)) {
-        return kMemoryError;
-      }
+      CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
       if (new_webp_data.size <= byte_budget_) {
         final_psnr = target_psnr;
-        WebPDataClear(webp_data);
-        *webp_data = new_webp_data;
+        AcceptAnimation(webp_data, &new_webp_data);
 
         int curr_ind = 0;
         for (FrameData& frame : frames_) {
@@ -424,8 +1370,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
     std::cout << std::endl;
   }
 
-  if (loop_count_ == 0) return kOk;
-  return SetLoopCount(webp_data);
+  return kOk;
 }
 
 }  // namespace libwebp
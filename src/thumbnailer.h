@@ -21,15 +21,24 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <functional>
 #include <memory>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "../imageio/image_dec.h"
 #include "../imageio/imageio_util.h"
 #include "../imageio/webpdec.h"
+#include "alloc_tracker.h"
+#include "output_cache.h"
+#include "picture_cache.h"
+#include "rd_cache.h"
 #include "src/thumbnailer.pb.h"
+#include "thread_pool.h"
 #include "webp/encode.h"
 #include "webp/mux.h"
 
@@ -41,6 +50,17 @@
 
 namespace libwebp {
 
+// Lets any thread stop a running Thumbnailer::GenerateAnimation() or
+// WriteAnimation(), which then return kCancelled.
+class CancellationToken {
+ public:
+  void Cancel() { cancelled_ = true; }
+  bool IsCancelled() const { return cancelled_; }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
 // Takes time stamped images as an input and produces an animation.
 class Thumbnailer {
  public:
@@ -48,6 +68,16 @@ class Thumbnailer {
   Thumbnailer(const thumbnailer::ThumbnailerOption& thumbnailer_option);
   ~Thumbnailer();
 
+  // Removes all the frames so that the thumbnailer can be used for another
+  // animation, optionally with new options. The frame records, their RD
+  // caches, the picture slots and the encoding buffers are kept, so that a
+  // loop of similar jobs reuses them instead of allocating new ones: after a
+  // first Reset(), a job with as many frames, whose encodings are not larger,
+  // makes no heap allocation besides those of libwebp. The output cache,
+  // cancellation token and progress callback stay set.
+  void Reset();
+  void Reset(const thumbnailer::ThumbnailerOption& thumbnailer_option);
+
   // Status codes for adding frame and generating animation.
   enum [[nodiscard]] Status{
       kOk = 0,            // On success.
@@ -59,6 +89,8 @@ class Thumbnailer {
       kWebPMuxError,  // In case of error related to WebPMux object.
       kSlopeOptimError,  // In case of error while using slope optimization to
                          // generate animation.
+      kWriteError,       // In case of error while writing the animation.
+      kCancelled,        // If the cancellation token was triggered.
       kGenericError      // For other errors.
   };
 
@@ -72,52 +104,354 @@ class Thumbnailer {
   static constexpr Method kMethodList[] = {
       kEqualQuality, kEqualPSNR, kNearllEqual, kNearllDiff, kSlopeOptim};
 
-  // Adds a frame with a timestamp (in millisecond). The 'pic' argument must
-  // outlive the last GenerateAnimation() call.
+  // Progress of GenerateAnimation().
+  struct Progress {
+    const char* phase;  // Algorithm being run, e.g. "equal_psnr".
+    int num_probes;     // Number of frame encodings done so far.
+    size_t best_size;   // Size of the best animation so far, 0 if none.
+    float best_psnr;    // Its mean frame PSNR, 0 if not known yet.
+  };
+  typedef std::function<void(const Progress&)> ProgressCallback;
+
+  // Makes GenerateAnimation() look up 'output_cache' (which must outlive the
+  // thumbnailer) before running any algorithm, and store the generated
+  // animation in it. The cache key covers the pixels of the current frames
+  // (or the bytes of the encoded images given to AddEncodedFrame(), so that
+  // the same pixels encoded differently get another key), their timestamps,
+  // the start of the first frame, the options and the method, whatever the
+  // edits that led to these frames.
+  // RegenerateAnimation() only uses the cache when it runs a full search.
+  // Must be called before adding frames.
+  Status SetOutputCache(OutputCache* const output_cache);
+
+  // Makes the frame size/PSNR measurements go through 'rd_cache' (which must
+  // outlive the thumbnailer), so that thumbnailers given the same frames,
+  // e.g. to compare methods or budgets, share them, including concurrently.
+  // Frames are identified by their pixels (or the encoded images given to
+  // AddEncodedFrame()). Must be called before adding frames.
+  Status SetRDCache(RDCache* const rd_cache);
+
+  // Makes GenerateAnimation() and WriteAnimation() check 'token' (which must
+  // outlive the thumbnailer, or be unset with nullptr) before each frame
+  // encoding, and return kCancelled once it is triggered.
+  void SetCancellationToken(const CancellationToken* const token);
+
+  // Calls 'callback' from the thread running GenerateAnimation() each time a
+  // candidate animation is built or accepted, and when the phase changes.
+  void SetProgressCallback(ProgressCallback callback);
+
+  // If 'stream_output' is set, GenerateAnimation() and RegenerateAnimation()
+  // do not assemble the candidate animations in memory: their size is the sum
+  // of the frames' chunk sizes, and the returned WebPData only has a size,
+  // with no bytes. The animation is then written with WriteAnimation(), and
+  // is not stored in the output cache.
+  void SetStreamOutput(bool stream_output);
+
+  // Adds a frame with a timestamp (in millisecond). Unless a memory limit is
+  // set, the 'pic' argument must outlive the last GenerateAnimation() or
+  // WriteAnimation() call, or the eviction of the frame by the sliding window.
+  // Otherwise 'pic' is compressed losslessly in memory and can be freed as
+  // soon as this function returns.
+  //
+  // With a 'window_ms' option, frames too old for the window are evicted. A
+  // live stream pushes its frames and calls RegenerateAnimation() to refresh
+  // the thumbnail, which mostly encodes the frames pushed since the previous
+  // refresh. GenerateAnimation() searches again for the best quality, still
+  // reusing the measurements of the frames kept in the window.
   Status AddFrame(const WebPPicture& pic, int timestamp_ms);
 
+  // Adds a frame from an encoded image (any format supported by imageio, e.g.
+  // JPEG, PNG or WebP) with a timestamp (in millisecond). 'data' is copied and
+  // only decoded when the frame is first used, on a background thread when
+  // possible. Only the decoded frames fitting the memory limit are kept, or a
+  // few of them without a limit.
+  Status AddEncodedFrame(const uint8_t* data, size_t data_size,
+                         int timestamp_ms);
+
+  // Replaces the picture of the frame ending at 'timestamp_ms', e.g. after an
+  // edit. The same lifetime rules as for AddFrame() apply to 'pic'. Returns
+  // kGenericError if there is no such frame.
+  Status ReplaceFrame(const WebPPicture& pic, int timestamp_ms);
+
+  // Removes the frame ending at 'timestamp_ms'. Returns kGenericError if there
+  // is no such frame.
+  Status RemoveFrame(int timestamp_ms);
+
   // Generates the animation using the specified method.
   Status GenerateAnimation(WebPData* const webp_data,
                            Method method = kEqualQuality);
 
+  // Same as GenerateAnimation(), after frames were added with AddFrame() or
+  // AddEncodedFrame(), replaced or removed since the last successful call.
+  // The encoded frames and the size/PSNR measurements of the untouched frames
+  // are reused, so that only the new frames get encoded when the previous
+  // configurations still fit the byte budget. Otherwise the search is run
+  // again, still without re-measuring the untouched frames.
+  Status RegenerateAnimation(WebPData* const webp_data,
+                             Method method = kEqualQuality);
+
+  // Generates one animation per byte budget (in bytes) of 'budgets' using the
+  // specified method. '*webp_data' receives the animations in the order of
+  // 'budgets', owned by the caller. The budgets are processed in ascending
+  // order and share the per-frame size/PSNR measurements as well as the
+  // animation sizes measured for each quality, so that each extra budget only
+  // costs a few encodes. The output cache is not used, and WriteAnimation()
+  // then streams the animation of the largest budget. On error, no animation
+  // is returned.
+  Status GenerateAnimationLadder(const std::vector<size_t>& budgets,
+                                 std::vector<WebPData>* const webp_data,
+                                 Method method = kEqualQuality);
+
+  // Generates one animation per output resolution of 'dimensions' (width and
+  // height, one of which may be 0 to keep the aspect ratio) using the
+  // specified method. Each frame is decoded once and downscaled in a cascade,
+  // each resolution from the smallest larger one that contains it, or from
+  // the source frame if none does. The searches of the resolutions run
+  // concurrently, each one using the output cache and the RD cache, if set.
+  // The progress callback is called for each of them, from their threads but
+  // never concurrently. '*webp_data' receives the animations in the order of
+  // 'dimensions', owned by the caller. Upscaling is not supported. On error,
+  // no animation is returned.
+  Status GenerateAnimationResolutions(
+      const std::vector<std::pair<int, int>>& dimensions,
+      std::vector<WebPData>* const webp_data, Method method = kEqualQuality);
+
+  // Returns the statistics of the last GenerateAnimation(),
+  // RegenerateAnimation(), GenerateAnimationLadder() or
+  // GenerateAnimationResolutions() call. For the latter, the counters, phases
+  // and allocations add up all the resolutions and the "rescale" phase of the
+  // frames, while the frames and the animation size describe the largest
+  // resolution.
+  const thumbnailer::ThumbnailerStats& stats() const { return stats_; }
+
+  // Streams the animation found by the last GenerateAnimation() call to the
+  // file descriptor 'fd', byte for byte. The frames' encodings kept from the
+  // search are written chunk by chunk, without being re-encoded nor assembled
+  // in memory. If the animation came from the output cache, it is written as
+  // is. Returns kGenericError if there is no such animation or if frames were
+  // added since.
+  Status WriteAnimation(int fd);
+
  private:
   struct FrameData {
-    WebPPicture pic;
+    int pic_id;  // Id of the frame's picture in 'pictures_'.
     int timestamp_ms = 0;  // Ending timestamp in milliseconds.
     WebPConfig config;
+    WebPConfig final_config;  // Config used in the last accepted animation.
     size_t encoded_size = 0;
     int final_quality = -1;
     float final_psnr = 0.0;
     bool near_lossless = false;
+    Status task_status = kOk;  // Result of the last per-frame parallel task.
 
     // Vectors storing the computed size and psnr of a frame for each lossy
     // quality factor (in range [0, 100]). This is to speed up duplicate
     // GetPictureStats calls.
     std::vector<int> lossy_size = std::vector<int>(101, -1);
     std::vector<float> lossy_psnr = std::vector<float>(101, -1);
+    // Size of the frame's ANMF chunk for each lossy quality factor, or -1 if
+    // unknown. Sums up to the animation size when all frames share a quality.
+    std::vector<int> lossy_chunk_size = std::vector<int>(101, -1);
 
-    FrameData(const WebPPicture& pic, int timestamp_ms,
-              const WebPConfig& config)
-        : pic(pic), timestamp_ms(timestamp_ms), config(config){};
+    // Hash of the frame's picture, the base of its keys in the shared RD
+    // cache and of the output cache key, if any.
+    CacheKeyBuilder content_key;
+
+    // Last encoding of the frame, valid if 'has_bitstream' is set, and the
+    // one of the last accepted animation, made with 'final_config' and valid
+    // if 'has_final_bitstream' is set. Either is reused while 'config' matches
+    // the configuration it was made with.
+    std::vector<uint8_t> bitstream;
+    WebPConfig bitstream_config;
+    bool has_bitstream = false;
+    std::vector<uint8_t> final_bitstream;
+    bool has_final_bitstream = false;
+
+    FrameData(int pic_id, int timestamp_ms, const WebPConfig& config)
+        : pic_id(pic_id),
+          timestamp_ms(timestamp_ms),
+          config(config),
+          final_config(config){};
+
+    // Reinitializes a spare record without reallocating its vectors.
+    void Reuse(int new_pic_id, int new_timestamp_ms,
+               const WebPConfig& new_config);
   };
   std::vector<FrameData> frames_;
-  WebPAnimEncoder* enc_ = NULL;
-  WebPAnimEncoderOptions anim_config_;
+  std::vector<FrameData> spare_frames_;  // Records kept by Reset().
+  std::vector<WebPMemoryWriter> bitstreams_;  // Scratch, one per frame.
+  // Scratch vectors of the search algorithms, kept from one call to the next.
+  std::vector<int> frame_indices_;
+  std::vector<float> frame_slopes_;
+  std::vector<std::pair<size_t, float>> frame_stats_;  // Sizes and PSNRs.
+  std::vector<std::pair<size_t, float>> new_frame_stats_;
+  PictureCache pictures_;
+  thumbnailer::ThumbnailerOption options_;
+  size_t memory_limit_ = 0;
+  int width_ = 0;
+  int height_ = 0;
   int loop_count_;
+  bool allow_mixed_;
+  uint32_t bgcolor_ = 0xffffffff;  // Opaque white, as for WebPAnimEncoder.
   size_t byte_budget_;
   int minimum_lossy_quality_;
   bool verbose_;
   int webp_method_;
   float slope_dPSNR_;
+  OutputCache* output_cache_ = nullptr;
+  RDCache* rd_cache_ = nullptr;
+  std::string option_key_;  // Options affecting the output, serialized.
+  std::vector<uint8_t> cached_animation_;  // Last output cache hit.
+  const CancellationToken* cancellation_token_ = nullptr;
+  ProgressCallback progress_callback_;
+  Progress progress_ = {"", 0, 0, 0.f};
+  bool stream_output_ = false;
+
+  bool has_result_ = false;  // Set if the frames hold a generated animation.
+  int window_ms_ = 0;
+  int latest_timestamp_ms_ = 0;  // Of the frames added so far.
+  int start_timestamp_ms_ = 0;   // Start of the first frame.
+  std::atomic<int> num_probes_{0};  // Updated by the encoding tasks.
+
+  // Statistics of the current call, and counters updated by the encoding
+  // tasks.
+  thumbnailer::ThumbnailerStats stats_;
+  PictureCache::Stats start_picture_stats_;
+  double phase_start_wall_ms_ = 0.;
+  double phase_start_cpu_ms_ = 0.;  // Of 'job_thread_'.
+  int64_t phase_start_worker_cpu_us_ = 0;
+  std::thread::id job_thread_;  // Running the current call.
+  std::atomic<int> rd_cache_hits_{0};
+  std::atomic<int> rd_cache_misses_{0};
+  std::atomic<int> shared_rd_cache_hits_{0};
+  std::atomic<int> reused_encodes_{0};
+  std::atomic<uint64_t> bytes_copied_{0};
+  std::atomic<int64_t> encode_cpu_us_{0};
+  std::atomic<int64_t> worker_cpu_us_{0};  // Encodings out of 'job_thread_'.
+  int num_assemblies_ = 0;
+
+  // Heap allocations of the current call, if tracked.
+  bool track_allocations_ = false;
+  AllocScope alloc_scope_;
+  AllocScope::Counters phase_start_alloc_ = {};
+  int64_t alloc_peak_bytes_ = 0;  // Highest peak of the finished phases.
+
+  // Returns kCancelled if the cancellation token was triggered, and counts a
+  // frame encoding otherwise. Thread-safe.
+  Status StartProbe();
+
+  // Calls the progress callback, if any.
+  void ReportProgress();
+
+  // Starts a new phase of GenerateAnimation().
+  void SetPhase(const char* phase);
+
+  // Adds the time of the current phase, if any, to the statistics.
+  void EndPhase();
+
+  // Returns the statistics of 'phase', added if needed. Phases may run
+  // several times, e.g. for each budget of a ladder.
+  thumbnailer::ThumbnailerStats::Phase* GetPhaseStats(
+      const char* const phase);
+
+  // Adds the given times to the statistics of 'phase'.
+  void AddPhaseTime(const char* const phase, double wall_ms, double cpu_ms);
+
+  // Starts tracking the allocations of a call if AllocTracker is enabled.
+  // Returns the scope to make current during the call.
+  AllocScope* StartAllocScope();
+
+  // Clears the statistics at the beginning of a call.
+  void StartStats();
+
+  // Completes the statistics at the end of a call.
+  void FinishStats(Status status, const WebPData& webp_data);
+
+  // Resets the frame configurations and search results left by a previous
+  // search, keeping the RD measurements.
+  void ResetSearchState();
+
+  // Runs the algorithm of 'method' on the frames.
+  Status RunMethod(WebPData* const webp_data, Method method);
+
+  // Generates the animation. If 'incremental' is set and a previous animation
+  // was generated, tries the previous configurations first.
+  Status Generate(WebPData* const webp_data, Method method, bool incremental);
+
+  // Encodes the new frames with the configurations of their neighbours and
+  // keeps the result if it fits the byte budget. Otherwise runs 'method'.
+  Status RegenerateIncrementally(WebPData* const webp_data, Method method);
+
+  // Returns the key of the animation of the current frames in the output
+  // cache, for 'method' and the current options.
+  std::string OutputCacheKey(Method method) const;
+
+  // Returns the configuration of a frame that was not searched yet.
+  WebPConfig NewFrameConfig() const;
+
+  // Returns the index of the frame ending at 'timestamp_ms', or -1.
+  int FindFrame(int timestamp_ms) const;
+
+  // Removes the 'ind'-th frame and releases its picture.
+  void DropFrame(int ind);
+
+  // Removes the frames that are out of the sliding window, if any.
+  void EvictFrames();
+
+  // Sets the members derived from 'thumbnailer_option'.
+  void SetOptions(const thumbnailer::ThumbnailerOption& thumbnailer_option);
+
+  // Appends the record of a new frame, reusing a spare one if any.
+  void AddFrameData(int pic_id, int timestamp_ms,
+                    const CacheKeyBuilder& content_key);
+
+  // Sets the canvas dimensions from the first frame if they are not known yet,
+  // which is the case if only encoded frames were added.
+  Status InitCanvas();
+
+  // Returns the picture of the 'ind'-th frame, or nullptr on error or if its
+  // dimensions do not match the canvas. Starts decoding the next frame.
+  PictureCache::Handle GetPicture(int ind);
 
   // Computes the size (in bytes) and PSNR of the 'ind'-th frame. The resulting
   // size and PSNR will be stored in '*pic_size' and '*pic_psnr' respectively.
+  // Lossy measurements are cached in the frame's record and in the shared RD
+  // cache, if any. Thread-safe as long as no other thread uses the same frame.
   Status GetPictureStats(int ind, size_t* const pic_size,
                          float* const pic_psnr);
 
-  Status SetLoopCount(WebPData* const webp_data);
+  // Encodes the 'ind'-th frame with its config to measure its size and PSNR,
+  // bypassing the caches.
+  Status MeasurePictureStats(int ind, size_t* const pic_size,
+                             float* const pic_psnr);
 
-  // Generates the animation with given config for each frame.
+  // Replaces '*webp_data' by '*new_webp_data', whose ownership is
+  // transferred, and records the frame configurations and encodings that
+  // produced it.
+  void AcceptAnimation(WebPData* const webp_data,
+                       WebPData* const new_webp_data);
+
+  // Encodes the 'ind'-th frame with 'config' into 'writer'. Thread-safe as
+  // long as no other thread uses the same frame.
+  Status EncodeFrame(int ind, const WebPConfig& config,
+                     WebPMemoryWriter* const writer);
+
+  // Returns the encoding of 'frame' made with its current config, or nullptr
+  // if there is none.
+  static const std::vector<uint8_t>* GetBitstream(const FrameData& frame);
+
+  // Encodes the frames whose last encoding does not match their config, in
+  // parallel on the default ThreadPool. If 'measure_only' is set, lossy frames
+  // whose chunk size is already known for their quality are skipped too.
+  Status EncodeFrames(bool measure_only);
+
+  // Returns in '*size' the size of the animation with all frames at the lossy
+  // 'quality', or false if the size of a frame is unknown.
+  bool GetUniformAnimationSize(int quality, size_t* const size) const;
+
+  // Generates the animation with given config for each frame. Only the frames
+  // whose last encoding does not match their config are encoded. With
+  // 'stream_output_', only the size of the animation is set.
   Status GenerateAnimationConfigured(WebPData* const webp_data);
 
   // Finds the best quality for lossy compression that makes the animation fit
@@ -126,6 +460,11 @@ class Thumbnailer {
   // argument is expected to be initialized.
   Status GenerateAnimationEqualQuality(WebPData* const webp_data);
 
+  // Sets the 'ind'-th frame's quality to the highest one giving a PSNR lower
+  // than 'target_psnr' + 1, if 'target_psnr' is within the PSNR range of the
+  // frame. Otherwise sets '*in_range' to false.
+  Status FindQualityForPSNR(int ind, int target_psnr, bool* const in_range);
+
   // Generates the animation so that all frames have similar PSNR (all) values.
   // In case of failure, returns the animation generated by
   // GenerateAnimationEqualQuality().
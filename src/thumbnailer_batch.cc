@@ -0,0 +1,133 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer_batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+#include "thread_pool.h"
+#include "thumbnailer.h"
+#include "thumbnailer_job.h"
+#include "utils/thumbnailer_utils.h"
+
+namespace libwebp {
+
+bool ReadBatchManifest(const std::string& filename,
+                       thumbnailer::BatchManifest* const manifest) {
+  std::ifstream input(filename);
+  if (!input.is_open()) return false;
+  std::stringstream content;
+  content << input.rdbuf();
+  return google::protobuf::TextFormat::ParseFromString(content.str(),
+                                                       manifest);
+}
+
+bool RunBatchJob(const thumbnailer::BatchJob& job,
+                 Thumbnailer* const thumbnailer, std::string* const error,
+                 OutputCache* const output_cache) {
+  Thumbnailer::Method method;
+  if (!ParseMethod(job.algorithm(), &method)) {
+    *error = "Unknown algorithm " + job.algorithm();
+    return false;
+  }
+  if (!ValidateOption(job.option())) {
+    *error = "Invalid thumbnailer configuration.";
+    return false;
+  }
+
+  // Same frame handling as the single-job mode: without a memory limit the
+  // thumbnailer borrows the pictures, which must be kept alive.
+  thumbnailer->Reset(job.option());
+  if (output_cache != nullptr &&
+      thumbnailer->SetOutputCache(output_cache) != Thumbnailer::kOk) {
+    *error = "Error setting the output cache.";
+    return false;
+  }
+  std::vector<Frame> frames;
+  int num_frames = 0;
+  const bool keep_frames = (job.option().memory_limit() == 0);
+  const UtilsStatus read_status = ReadFrames(
+      job.input().c_str(), job.frame_duration(), [&](Frame frame) {
+        if (thumbnailer->AddFrame(*frame.pic, frame.timestamp) !=
+            Thumbnailer::kOk) {
+          return false;
+        }
+        ++num_frames;
+        if (keep_frames) frames.push_back(std::move(frame));
+        return true;
+      });
+  if (read_status != kOk) {
+    *error = "Error reading frames from " + job.input();
+    return false;
+  }
+  if (num_frames == 0) {
+    *error = "No input frame(s) for generating animation.";
+    return false;
+  }
+
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  bool ok = (thumbnailer->GenerateAnimation(&webp_data, method) ==
+             Thumbnailer::kOk);
+  if (!ok) {
+    *error = "Error generating thumbnail.";
+  } else if (!ImgIoUtilWriteFile(job.output().c_str(), webp_data.bytes,
+                                 webp_data.size)) {
+    *error = "Error writing " + job.output();
+    ok = false;
+  }
+  WebPDataClear(&webp_data);
+  return ok;
+}
+
+int RunBatch(const thumbnailer::BatchManifest& manifest,
+             int max_concurrent_jobs, OutputCache* const output_cache) {
+  // The jobs share the default pool with the per-frame tasks of the
+  // thumbnailer, so that workers left idle by small jobs help the big ones.
+  // Each runner task processes jobs one at a time.
+  ThreadPool* const pool = ThreadPool::Default();
+  if (max_concurrent_jobs <= 0) max_concurrent_jobs = pool->num_threads();
+  const int num_runners = std::min(max_concurrent_jobs, manifest.jobs_size());
+
+  std::atomic<int> next_job(0);
+  std::atomic<int> num_failed(0);
+  std::mutex output_mutex;
+  TaskGroup runners(pool);
+  for (int r = 0; r < num_runners; ++r) {
+    runners.Run([&]() {
+      Thumbnailer thumbnailer;
+      for (int i = next_job++; i < manifest.jobs_size(); i = next_job++) {
+        const thumbnailer::BatchJob& job = manifest.jobs(i);
+        std::string error;
+        if (!RunBatchJob(job, &thumbnailer, &error, output_cache)) {
+          ++num_failed;
+          std::lock_guard<std::mutex> lock(output_mutex);
+          std::cerr << "Job " << i << " (" << job.input()
+                    << ") failed: " << error << std::endl;
+        }
+      }
+    });
+  }
+  runners.Wait();
+  return num_failed;
+}
+
+}  // namespace libwebp
@@ -0,0 +1,47 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_THUMBNAILER_BATCH_H_
+#define THUMBNAILER_SRC_THUMBNAILER_BATCH_H_
+
+#include <string>
+
+#include "output_cache.h"
+#include "src/thumbnailer.pb.h"
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+// Reads a BatchManifest in protobuf text format. Returns false on error.
+bool ReadBatchManifest(const std::string& filename,
+                       thumbnailer::BatchManifest* const manifest);
+
+// Reads the frames of 'job', generates the animation with 'thumbnailer' (reset
+// with the job's options) and writes it to the job's output. Returns false and
+// sets '*error' on failure. 'output_cache' is used if not null.
+bool RunBatchJob(const thumbnailer::BatchJob& job,
+                 Thumbnailer* const thumbnailer, std::string* const error,
+                 OutputCache* const output_cache = nullptr);
+
+// Runs the jobs of 'manifest' with up to 'max_concurrent_jobs' of them at a
+// time (one per hardware thread if 0). A failing job is reported and does not
+// stop the others. Each concurrent runner reuses a single Thumbnailer. The
+// jobs share 'output_cache' if not null. Returns the number of failed jobs.
+int RunBatch(const thumbnailer::BatchManifest& manifest,
+             int max_concurrent_jobs,
+             OutputCache* const output_cache = nullptr);
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_THUMBNAILER_BATCH_H_
@@ -0,0 +1,131 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer_job.h"
+
+namespace libwebp {
+
+bool ParseMethod(const std::string& name, Thumbnailer::Method* const method) {
+  if (name == "equal_psnr") {
+    // Generate animation so that all frames have the same PSNR.
+    *method = Thumbnailer::kEqualPSNR;
+  } else if (name == "equal_quality") {
+    // Generate animation so that all frames have the same quality.
+    *method = Thumbnailer::kEqualQuality;
+  } else if (name == "near_ll_diff") {
+    // Generate animation allowing near-lossless method. The pre-processing
+    // value for each near-lossless frames can be different.
+    *method = Thumbnailer::kNearllDiff;
+  } else if (name == "near_ll_equal") {
+    // Generate animation allowing near-lossless method. Use the same
+    // pre-processing value for all near-lossless frames.
+    *method = Thumbnailer::kNearllEqual;
+  } else if (name == "slope_optim") {
+    // Generate animation with slope optimization.
+    *method = Thumbnailer::kSlopeOptim;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* MethodName(Thumbnailer::Method method) {
+  switch (method) {
+    case Thumbnailer::kEqualQuality:
+      return "equal_quality";
+    case Thumbnailer::kEqualPSNR:
+      return "equal_psnr";
+    case Thumbnailer::kNearllEqual:
+      return "near_ll_equal";
+    case Thumbnailer::kNearllDiff:
+      return "near_ll_diff";
+    case Thumbnailer::kSlopeOptim:
+      return "slope_optim";
+  }
+  return "unknown";
+}
+
+bool ValidateOption(const thumbnailer::ThumbnailerOption& option) {
+  if (option.min_lossy_quality() > 100) return false;
+  if (option.webp_method() > 6) return false;
+  if (option.slope_dpsnr() < 0) return false;
+  if (option.slope_dpsnr() > 99) return false;
+  return true;
+}
+
+void RunRequest(const thumbnailer::ThumbnailerRequest& request,
+                thumbnailer::ThumbnailerResponse* const response,
+                OutputCache* const output_cache) {
+  Thumbnailer thumbnailer;
+  RunRequest(request, &thumbnailer, response, output_cache);
+}
+
+void RunRequest(const thumbnailer::ThumbnailerRequest& request,
+                Thumbnailer* const thumbnailer,
+                thumbnailer::ThumbnailerResponse* const response,
+                OutputCache* const output_cache) {
+  response->Clear();
+
+  Thumbnailer::Method method;
+  if (!ParseMethod(request.algorithm(), &method)) {
+    response->set_status(Thumbnailer::kGenericError);
+    response->set_error("Unknown algorithm " + request.algorithm());
+    return;
+  }
+  if (!ValidateOption(request.option())) {
+    response->set_status(Thumbnailer::kGenericError);
+    response->set_error("Invalid thumbnailer configuration.");
+    return;
+  }
+  if (request.frames().empty()) {
+    response->set_status(Thumbnailer::kGenericError);
+    response->set_error("No input frame(s) for generating animation.");
+    return;
+  }
+
+  thumbnailer->Reset(request.option());
+  if (output_cache != nullptr &&
+      thumbnailer->SetOutputCache(output_cache) != Thumbnailer::kOk) {
+    response->set_status(Thumbnailer::kGenericError);
+    response->set_error("Error setting the output cache.");
+    return;
+  }
+  for (const thumbnailer::InputFrame& frame : request.frames()) {
+    const Thumbnailer::Status status = thumbnailer->AddEncodedFrame(
+        reinterpret_cast<const uint8_t*>(frame.data().data()),
+        frame.data().size(), frame.timestamp_ms());
+    if (status != Thumbnailer::kOk) {
+      response->set_status(status);
+      response->set_error("Error adding frame with timestamp " +
+                          std::to_string(frame.timestamp_ms()));
+      return;
+    }
+  }
+
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  const Thumbnailer::Status status =
+      thumbnailer->GenerateAnimation(&webp_data, method);
+  response->set_status(status);
+  if (status == Thumbnailer::kOk) {
+    response->set_animation(webp_data.bytes, webp_data.size);
+  } else if (status == Thumbnailer::kCancelled) {
+    response->set_error("Cancelled.");
+  } else {
+    response->set_error("Error generating thumbnail.");
+  }
+  WebPDataClear(&webp_data);
+}
+
+}  // namespace libwebp
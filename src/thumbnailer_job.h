@@ -0,0 +1,50 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_THUMBNAILER_JOB_H_
+#define THUMBNAILER_SRC_THUMBNAILER_JOB_H_
+
+#include <string>
+
+#include "src/thumbnailer.pb.h"
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+// Converts an algorithm name (as given to the -algorithm flag) into a method.
+// Returns false if the name is unknown.
+bool ParseMethod(const std::string& name, Thumbnailer::Method* const method);
+
+// Returns the algorithm name of 'method', as accepted by ParseMethod().
+const char* MethodName(Thumbnailer::Method method);
+
+// Returns false on invalid configurations.
+bool ValidateOption(const thumbnailer::ThumbnailerOption& option);
+
+// Generates the animation described by 'request' into 'response'. Errors are
+// reported in the response. 'output_cache' is used if not null.
+void RunRequest(const thumbnailer::ThumbnailerRequest& request,
+                thumbnailer::ThumbnailerResponse* const response,
+                OutputCache* const output_cache = nullptr);
+
+// Same as above, reusing 'thumbnailer' (which is reset with the request's
+// options) to avoid reallocating its buffers from one request to the next.
+void RunRequest(const thumbnailer::ThumbnailerRequest& request,
+                Thumbnailer* const thumbnailer,
+                thumbnailer::ThumbnailerResponse* const response,
+                OutputCache* const output_cache = nullptr);
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_THUMBNAILER_JOB_H_
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include "thumbnailer.h"
+#include "tracer.h"
 
 namespace libwebp {
 // List of pre-processing values used in binary search for near-lossless to
@@ -22,6 +23,7 @@ namespace libwebp {
 static const int kPreprocessingList[6] = {0, 20, 40, 60, 80, 100};
 
 Thumbnailer::Status Thumbnailer::NearLosslessDiff(WebPData* const webp_data) {
+  TraceScope trace("NearLosslessDiff");
   size_t anim_size = GetAnimationSize(webp_data);
 
   int curr_ind = 0;
@@ -94,8 +96,7 @@ Thumbnailer::Status Thumbnailer::NearLosslessDiff(WebPData* const webp_data) {
   // If the animation size exceeds the byte budget, return the animation
   // produced by previous method as result.
   if (new_webp_data.size <= byte_budget_) {
-    WebPDataClear(webp_data);
-    *webp_data = new_webp_data;
+    AcceptAnimation(webp_data, &new_webp_data);
   } else {
     WebPDataClear(&new_webp_data);
   }
@@ -104,6 +105,7 @@ Thumbnailer::Status Thumbnailer::NearLosslessDiff(WebPData* const webp_data) {
 }
 
 Thumbnailer::Status Thumbnailer::NearLosslessEqual(WebPData* const webp_data) {
+  TraceScope trace("NearLosslessEqual");
   const int num_frames = frames_.size();
 
   // Encode frames following the ascending order of frame sizes.
@@ -117,10 +119,12 @@ Thumbnailer::Status Thumbnailer::NearLosslessEqual(WebPData* const webp_data) {
             });
 
   // Vector of frames encoded with near-lossless preprocessing 0.
-  std::vector<int> near_ll_frames;
+  std::vector<int>& near_ll_frames = frame_indices_;
+  near_ll_frames.clear();
   // Vector storing sizes and PSNR of near-losslessly-encoded frames with
   // preprocessing 0.
-  std::vector<std::pair<int, float>> near_ll_0_stats;
+  std::vector<std::pair<size_t, float>>& near_ll_0_stats = frame_stats_;
+  near_ll_0_stats.clear();
   size_t anim_size = GetAnimationSize(webp_data);
   // Find the maximum number of frames that can be encoded with near-lossless
   // preprocessing 0.
@@ -161,8 +165,7 @@ Thumbnailer::Status Thumbnailer::NearLosslessEqual(WebPData* const webp_data) {
   // If the animation size exceeds the byte budget, return the animation
   // produced by previous method as result.
   if (new_webp_data.size <= byte_budget_) {
-    WebPDataClear(webp_data);
-    *webp_data = new_webp_data;
+    AcceptAnimation(webp_data, &new_webp_data);
   } else {
     WebPDataClear(&new_webp_data);
     return kOk;
@@ -177,7 +180,8 @@ Thumbnailer::Status Thumbnailer::NearLosslessEqual(WebPData* const webp_data) {
     const int mid_near_lossless = kPreprocessingList[mid_ind];
     // Vector containing pair of (new size, new psnr) for all frames in the
     // 'near_ll_frames' vector.
-    std::vector<std::pair<size_t, float>> new_size_psnr;
+    std::vector<std::pair<size_t, float>>& new_size_psnr = new_frame_stats_;
+    new_size_psnr.clear();
 
     for (int curr_ind : near_ll_frames) {
       frames_[curr_ind].config.near_lossless = mid_near_lossless;
@@ -215,8 +219,7 @@ Thumbnailer::Status Thumbnailer::NearLosslessEqual(WebPData* const webp_data) {
   if (final_near_ll != 0) {
     CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
     if (new_webp_data.size <= byte_budget_) {
-      WebPDataClear(webp_data);
-      *webp_data = new_webp_data;
+      AcceptAnimation(webp_data, &new_webp_data);
     } else {
       WebPDataClear(&new_webp_data);
       int ind = 0;
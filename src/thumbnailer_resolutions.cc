@@ -0,0 +1,201 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer.h"
+
+#include <mutex>
+
+#include "tracer.h"
+#include "utils/thumbnailer_utils.h"
+
+namespace libwebp {
+
+Thumbnailer::Status Thumbnailer::GenerateAnimationResolutions(
+    const std::vector<std::pair<int, int>>& dimensions,
+    std::vector<WebPData>* const webp_data, Method method) {
+  TraceScope trace("GenerateAnimationResolutions", "rungs", dimensions.size());
+  // The rungs run on the thread pool, within this scope, so that their
+  // allocations are counted with the decoding and rescaling of the frames.
+  ScopedAllocScope alloc_scope(StartAllocScope());
+  StartStats();
+  cached_animation_.clear();
+  num_probes_ = 0;
+  progress_ = {"", 0, 0, 0.f};
+  CHECK_THUMBNAILER_STATUS(InitCanvas());
+
+  // Resolve the dimensions left to 0, then process the rungs from the
+  // largest to the smallest so that each one can be downscaled from a larger
+  // one rather than from the source.
+  const int num_rungs = dimensions.size();
+  std::vector<std::pair<int, int>> sizes(num_rungs);
+  std::vector<int> order(num_rungs);
+  for (int r = 0; r < num_rungs; ++r) {
+    int width = dimensions[r].first;
+    int height = dimensions[r].second;
+    if (width <= 0 && height <= 0) return kImageFormatError;
+    if (width <= 0) width = std::max(1, height * width_ / height_);
+    if (height <= 0) height = std::max(1, width * height_ / width_);
+    if (width > width_ || height > height_) return kImageFormatError;
+    sizes[r] = std::make_pair(width, height);
+    order[r] = r;
+  }
+  std::sort(order.begin(), order.end(), [&sizes](int a, int b) {
+    return sizes[a].first * sizes[a].second > sizes[b].first * sizes[b].second;
+  });
+
+  // One child thumbnailer per rung, with the same options and caches. Only
+  // the parent prints statistics. The children get the frames of the window
+  // as is. Their output cache keys differ by the pixels of the rescaled
+  // frames. They report their progress through the parent's callback, one
+  // at a time since they run concurrently.
+  thumbnailer::ThumbnailerOption rung_option = options_;
+  rung_option.set_verbose(false);
+  rung_option.clear_window_ms();
+  std::mutex progress_mutex;
+  ProgressCallback rung_progress_callback;
+  if (progress_callback_) {
+    rung_progress_callback = [this, &progress_mutex](const Progress& progress) {
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      progress_callback_(progress);
+    };
+  }
+  std::vector<std::unique_ptr<Thumbnailer>> rungs(num_rungs);
+  for (int r = 0; r < num_rungs; ++r) {
+    rungs[r].reset(new Thumbnailer(rung_option));
+    CHECK_THUMBNAILER_STATUS(rungs[r]->SetOutputCache(output_cache_));
+    CHECK_THUMBNAILER_STATUS(rungs[r]->SetRDCache(rd_cache_));
+    rungs[r]->SetCancellationToken(cancellation_token_);
+    rungs[r]->SetProgressCallback(rung_progress_callback);
+    rungs[r]->start_timestamp_ms_ = start_timestamp_ms_;
+  }
+
+  // Each source frame is decoded once. A rung is downscaled from the smallest
+  // larger rung that contains it in both dimensions, from the source
+  // otherwise, since a rung of a larger area may still be narrower. The rung
+  // pictures are kept until the children are done, since they borrow them
+  // without a memory limit.
+  SetPhase("rescale");
+  std::vector<EnclosedWebPPicture> pictures;
+  pictures.reserve(frames_.size() * num_rungs);
+  std::vector<const WebPPicture*> frame_pictures;  // In 'order'.
+  frame_pictures.reserve(num_rungs);
+  for (std::size_t i = 0; i < frames_.size(); ++i) {
+    const PictureCache::Handle source = GetPicture(i);
+    if (source == nullptr) return kMemoryError;
+    frame_pictures.clear();
+    for (int r : order) {
+      const WebPPicture* from = source.get();
+      for (auto it = frame_pictures.rbegin(); it != frame_pictures.rend();
+           ++it) {
+        if ((*it)->width >= sizes[r].first &&
+            (*it)->height >= sizes[r].second) {
+          from = *it;
+          break;
+        }
+      }
+      // Rescaling a view of 'from' leaves it untouched, without copying it.
+      EnclosedWebPPicture pic(new WebPPicture, WebPPictureDelete);
+      if (!WebPPictureInit(pic.get()) ||
+          !WebPPictureView(from, 0, 0, from->width, from->height,
+                           pic.get()) ||
+          !WebPPictureRescale(pic.get(), sizes[r].first, sizes[r].second)) {
+        return kMemoryError;
+      }
+      CHECK_THUMBNAILER_STATUS(
+          rungs[r]->AddFrame(*pic, frames_[i].timestamp_ms));
+      frame_pictures.push_back(pic.get());
+      pictures.push_back(std::move(pic));
+    }
+    // Free the rescaled pictures that the children copied.
+    if (memory_limit_ > 0) pictures.clear();
+  }
+  EndPhase();
+
+  // The searches of the rungs run concurrently.
+  webp_data->resize(num_rungs);
+  std::vector<Status> statuses(num_rungs, kOk);
+  {
+    TaskGroup tasks(ThreadPool::Default());
+    for (int r = 0; r < num_rungs; ++r) {
+      WebPDataInit(&(*webp_data)[r]);
+      tasks.Run([r, method, &rungs, &statuses, webp_data]() {
+        statuses[r] = rungs[r]->GenerateAnimation(&(*webp_data)[r], method);
+      });
+    }
+    tasks.Wait();
+  }
+
+  // The statistics add up the work of all the rungs, phases and allocations
+  // included, to the decoding and rescaling of the frames. The frames and the
+  // animation size are the ones of the largest resolution.
+  Status status = kOk;
+  int picture_cache_hits = 0;
+  int picture_cache_misses = 0;
+  bool output_cache_hit = true;
+  for (int r : order) {
+    if (status == kOk) status = statuses[r];
+    const thumbnailer::ThumbnailerStats& stats = rungs[r]->stats();
+    for (const thumbnailer::ThumbnailerStats::Phase& phase : stats.phases()) {
+      thumbnailer::ThumbnailerStats::Phase* const sum =
+          GetPhaseStats(phase.name().c_str());
+      sum->set_wall_ms(sum->wall_ms() + phase.wall_ms());
+      sum->set_cpu_ms(sum->cpu_ms() + phase.cpu_ms());
+      sum->set_num_allocations(sum->num_allocations() +
+                               phase.num_allocations());
+      sum->set_allocated_bytes(sum->allocated_bytes() +
+                               phase.allocated_bytes());
+      sum->set_peak_heap_bytes(
+          std::max(sum->peak_heap_bytes(), phase.peak_heap_bytes()));
+    }
+    num_probes_ += stats.num_encodes();
+    num_assemblies_ += stats.num_assemblies();
+    rd_cache_hits_ += stats.rd_cache_hits();
+    rd_cache_misses_ += stats.rd_cache_misses();
+    shared_rd_cache_hits_ += stats.shared_rd_cache_hits();
+    reused_encodes_ += stats.reused_encodes();
+    bytes_copied_ += stats.bytes_copied();
+    encode_cpu_us_ += int64_t(stats.encode_cpu_ms() * 1e3);
+    picture_cache_hits += stats.picture_cache_hits();
+    picture_cache_misses += stats.picture_cache_misses();
+    output_cache_hit &= stats.output_cache_hit();
+  }
+  const bool has_animation = (status == kOk && num_rungs > 0);
+  FinishStats(status, has_animation ? (*webp_data)[order[0]]
+                                    : WebPData{nullptr, 0});
+  stats_.set_picture_cache_hits(stats_.picture_cache_hits() +
+                                picture_cache_hits);
+  stats_.set_picture_cache_misses(stats_.picture_cache_misses() +
+                                  picture_cache_misses);
+
+  if (status != kOk) {
+    for (WebPData& data : *webp_data) WebPDataClear(&data);
+    webp_data->clear();
+    return status;
+  }
+  if (has_animation) {
+    stats_.set_output_cache_hit(output_cache_hit);
+    *stats_.mutable_frames() = rungs[order[0]]->stats().frames();
+  }
+
+  if (verbose_) {
+    for (int r = 0; r < num_rungs; ++r) {
+      std::cout << "Resolution " << sizes[r].first << "x" << sizes[r].second
+                << ": animation size: " << (*webp_data)[r].size << std::endl;
+    }
+  }
+  SetPhase("done");
+  return kOk;
+}
+
+}  // namespace libwebp
@@ -0,0 +1,317 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer_server.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "src/thumbnailer.pb.h"
+#include "thumbnailer_job.h"
+
+namespace libwebp {
+
+namespace {
+
+// Responses are not sent above this size.
+const uint32_t kMaxMessageSize = 1u << 30;
+
+// Size of the prefix holding the size of a message.
+const size_t kPrefixSize = 4;
+
+// The buffer of a message being received grows by at most this much per
+// read, so that a peer cannot make it allocate more than it sends.
+const size_t kReceiveChunkSize = 64u << 10;
+
+bool SendAll(int fd, const uint8_t* data, size_t data_size) {
+  while (data_size > 0) {
+    // MSG_NOSIGNAL: a client closing its end must not kill the server.
+    const ssize_t sent = send(fd, data, data_size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += sent;
+    data_size -= sent;
+  }
+  return true;
+}
+
+enum ReceiveStatus { kReceived, kPending, kFailed };
+
+// Receives the message sent on 'fd' into 'buffer', whose first '*received'
+// bytes were received by previous calls. Once kReceived is returned, these
+// bytes are the size prefix followed by the message. With MSG_DONTWAIT in
+// 'flags', returns kPending when no more bytes are available yet. Returns
+// kFailed on error, if the peer closed the connection or if the message is
+// larger than 'max_size'.
+ReceiveStatus ReceiveMessage(int fd, int flags, size_t max_size,
+                             std::vector<uint8_t>* const buffer,
+                             size_t* const received) {
+  while (true) {
+    size_t total_size = kPrefixSize;
+    if (*received >= kPrefixSize) {
+      const uint8_t* const prefix = buffer->data();
+      const uint32_t size = prefix[0] | (prefix[1] << 8) | (prefix[2] << 16) |
+                            (uint32_t(prefix[3]) << 24);
+      if (size > max_size) return kFailed;
+      total_size += size;
+    }
+    if (*received == total_size) return kReceived;
+    // Never reads past the message, which may be followed by the next one.
+    const size_t end = std::min(total_size, *received + kReceiveChunkSize);
+    if (buffer->size() < end) buffer->resize(end);
+    const ssize_t size =
+        recv(fd, buffer->data() + *received, end - *received, flags);
+    if (size < 0 && errno == EINTR) continue;
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return kPending;
+    }
+    if (size <= 0) return kFailed;
+    *received += size;
+  }
+}
+
+}  // namespace
+
+bool WriteMessage(int fd, const google::protobuf::MessageLite& message) {
+  const size_t size = message.ByteSizeLong();
+  if (size > kMaxMessageSize) return false;
+  std::vector<uint8_t> buffer(kPrefixSize + size);
+  for (size_t i = 0; i < kPrefixSize; ++i) buffer[i] = (size >> (8 * i)) & 0xff;
+  if (!message.SerializeToArray(buffer.data() + kPrefixSize, size)) {
+    return false;
+  }
+  return SendAll(fd, buffer.data(), buffer.size());
+}
+
+bool ReadMessage(int fd, google::protobuf::MessageLite* const message,
+                 size_t max_size) {
+  std::vector<uint8_t> buffer;
+  size_t received = 0;
+  if (ReceiveMessage(fd, /*flags=*/0, max_size, &buffer, &received) !=
+      kReceived) {
+    return false;
+  }
+  return message->ParseFromArray(buffer.data() + kPrefixSize,
+                                 received - kPrefixSize);
+}
+
+struct ThumbnailerServer::Connection {
+  Connection(int fd, RDCache* const rd_cache) : fd(fd) {
+    thumbnailer.SetCancellationToken(&token);
+    // Cannot fail: the thumbnailer has no frame yet. Reset() keeps it.
+    if (thumbnailer.SetRDCache(rd_cache) != Thumbnailer::kOk) assert(false);
+  }
+
+  const int fd;
+  // Receiving a request on the Serve() thread, running it on a worker, or
+  // to be closed by Serve(). Guarded by 'mutex_'.
+  enum State { kReceiving, kRunning, kClosing } state = kReceiving;
+  // Bytes of the request being received. The storage is kept for the next
+  // requests.
+  std::vector<uint8_t> buffer;
+  size_t received = 0;
+  thumbnailer::ThumbnailerRequest request;
+  thumbnailer::ThumbnailerResponse response;
+  Thumbnailer thumbnailer;  // Reused by the requests of the connection.
+  CancellationToken token;
+};
+
+ThumbnailerServer::ThumbnailerServer(const std::string& socket_path,
+                                     int num_threads,
+                                     OutputCache* const output_cache,
+                                     size_t max_request_size,
+                                     size_t max_rd_cache_points)
+    : socket_path_(socket_path),
+      output_cache_(output_cache),
+      max_request_size_(max_request_size),
+      rd_cache_(max_rd_cache_points),
+      pool_(new ThreadPool(num_threads)) {}
+
+ThumbnailerServer::~ThumbnailerServer() {
+  Stop();
+  // Wait for the running requests, then close the connections.
+  pool_.reset();
+  for (const auto& connection : connections_) close(connection.first);
+  for (int fd : wake_fds_) {
+    if (fd >= 0) close(fd);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+}
+
+bool ThumbnailerServer::Start() {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path_.size() >= sizeof(address.sun_path)) return false;
+  strncpy(address.sun_path, socket_path_.c_str(), sizeof(address.sun_path));
+
+  // Non-blocking, so that Serve() never waits in accept(). The accepted
+  // sockets are blocking: the workers send the responses in one go.
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd_ < 0) return false;
+  unlink(socket_path_.c_str());
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd_, SOMAXCONN) != 0 ||
+      pipe2(wake_fds_, O_NONBLOCK) != 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void ThumbnailerServer::Serve() {
+  std::vector<pollfd> fds;
+  while (!stopping_) {
+    fds.clear();
+    fds.push_back({listen_fd_, POLLIN, /*revents=*/0});
+    fds.push_back({wake_fds_[0], POLLIN, /*revents=*/0});
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = connections_.begin(); it != connections_.end();) {
+        const Connection& connection = *it->second;
+        if (connection.state == Connection::kClosing) {
+          close(connection.fd);
+          it = connections_.erase(it);
+          continue;
+        }
+        // POLLHUP and POLLERR are always reported, which cancels the running
+        // request of a client that hung up. A client that only shut down its
+        // writing side is still waiting for the response.
+        if (connection.state == Connection::kReceiving) {
+          fds.push_back({connection.fd, POLLIN, /*revents=*/0});
+        } else if (!connection.token.IsCancelled()) {
+          fds.push_back({connection.fd, /*events=*/0, /*revents=*/0});
+        }
+        ++it;
+      }
+    }
+    if (poll(fds.data(), fds.size(), /*timeout=*/-1) < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "poll() failed: " << strerror(errno) << std::endl;
+      break;
+    }
+    if (fds[1].revents != 0) {
+      uint8_t bytes[64];
+      while (read(wake_fds_[0], bytes, sizeof(bytes)) > 0) {
+      }
+    }
+    if (stopping_) break;
+    if (fds[0].revents != 0 && !Accept()) break;
+    for (std::size_t i = 2; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) continue;
+      Connection* connection;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connection = connections_[fds[i].fd].get();
+        if (connection->state == Connection::kRunning) {
+          connection->token.Cancel();
+          continue;
+        }
+      }
+      ReceiveRequest(connection);
+    }
+  }
+}
+
+bool ThumbnailerServer::Accept() {
+  const int fd = accept(listen_fd_, NULL, NULL);
+  if (fd < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+        errno == ECONNABORTED || stopping_) {
+      return true;
+    }
+    std::cerr << "accept() failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stopping_) {
+    close(fd);
+    return true;
+  }
+  connections_[fd].reset(new Connection(fd, &rd_cache_));
+  return true;
+}
+
+void ThumbnailerServer::ReceiveRequest(Connection* const connection) {
+  const ReceiveStatus status =
+      ReceiveMessage(connection->fd, MSG_DONTWAIT, max_request_size_,
+                     &connection->buffer, &connection->received);
+  if (status == kPending) return;
+  const bool ok =
+      (status == kReceived &&
+       connection->request.ParseFromArray(
+           connection->buffer.data() + kPrefixSize,
+           connection->received - kPrefixSize));
+  connection->received = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok || stopping_) {
+    connection->state = Connection::kClosing;
+    Wake();
+    return;
+  }
+  connection->state = Connection::kRunning;
+  pool_->Schedule([this, connection]() { HandleRequest(connection); });
+}
+
+void ThumbnailerServer::HandleRequest(Connection* const connection) {
+  RunRequest(connection->request, &connection->thumbnailer,
+             &connection->response, output_cache_);
+  const bool ok = !connection->token.IsCancelled() &&
+                  WriteMessage(connection->fd, connection->response);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connection->state = (ok && !stopping_) ? Connection::kReceiving
+                                           : Connection::kClosing;
+  }
+  Wake();
+}
+
+void ThumbnailerServer::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = true;
+  // Wakes up the workers blocked on a write.
+  for (const auto& connection : connections_) {
+    shutdown(connection.first, SHUT_RDWR);
+    connection.second->token.Cancel();
+  }
+  Wake();
+}
+
+void ThumbnailerServer::Wake() {
+  if (wake_fds_[1] < 0) return;
+  const uint8_t byte = 0;
+  // A full pipe already wakes up Serve().
+  while (write(wake_fds_[1], &byte, 1) < 0 && errno == EINTR) {
+  }
+}
+
+}  // namespace libwebp
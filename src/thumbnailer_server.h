@@ -0,0 +1,123 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_THUMBNAILER_SERVER_H_
+#define THUMBNAILER_SRC_THUMBNAILER_SERVER_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "google/protobuf/message_lite.h"
+#include "output_cache.h"
+#include "rd_cache.h"
+#include "thread_pool.h"
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+// Default maximum size (in bytes) of a received message.
+const size_t kDefaultMaxMessageSize = 64u << 20;
+
+// Default maximum number of frame measurements kept by the server's RD cache,
+// about 150 bytes each.
+const size_t kDefaultMaxRDCachePoints = 1u << 19;
+
+// Writes 'message' to the socket 'fd', prefixed by its size as a 4-byte
+// little-endian integer. Returns false on error.
+bool WriteMessage(int fd, const google::protobuf::MessageLite& message);
+
+// Reads a message written by WriteMessage() from 'fd'. Returns false on error,
+// if the peer closed the connection or if the message is larger than
+// 'max_size'. Memory is allocated as the bytes arrive, not from the size
+// announced by the peer.
+bool ReadMessage(int fd, google::protobuf::MessageLite* const message,
+                 size_t max_size = kDefaultMaxMessageSize);
+
+// Serves ThumbnailerRequest messages received over a Unix domain socket, and
+// answers each of them with a ThumbnailerResponse. A client may send several
+// requests over the same connection. The thread calling Serve() accepts the
+// connections and receives the requests as their bytes arrive, so that idle
+// or slow clients do not hold a worker. Complete requests are run by a pool
+// of workers that lives as long as the server. A request whose client
+// disconnects is cancelled, freeing its worker.
+class ThumbnailerServer {
+ public:
+  // Runs up to 'num_threads' requests at a time, or one per hardware thread
+  // if 0. All the requests share 'output_cache' if not null, which must
+  // outlive the server, and the RD cache of the server, which keeps the
+  // 'max_rd_cache_points' most recently used measurements. Connections
+  // sending a request larger than 'max_request_size' bytes are closed.
+  ThumbnailerServer(const std::string& socket_path, int num_threads,
+                    OutputCache* const output_cache = nullptr,
+                    size_t max_request_size = kDefaultMaxMessageSize,
+                    size_t max_rd_cache_points = kDefaultMaxRDCachePoints);
+  ~ThumbnailerServer();
+
+  ThumbnailerServer(const ThumbnailerServer&) = delete;
+  ThumbnailerServer& operator=(const ThumbnailerServer&) = delete;
+
+  // Binds the socket, replacing any existing file at 'socket_path'. Returns
+  // false on error.
+  bool Start();
+
+  // Accepts connections and receives their requests until Stop() is called.
+  void Serve();
+
+  // Stops accepting connections, cancels the running requests and closes the
+  // open connections. Thread-safe.
+  void Stop();
+
+  // Returns the cache of the frame measurements shared by the requests, so
+  // that frames sent again (e.g. the same clip with another budget or
+  // algorithm) are not measured twice.
+  const RDCache& rd_cache() const { return rd_cache_; }
+
+ private:
+  struct Connection;
+
+  const std::string socket_path_;
+  OutputCache* const output_cache_;
+  const size_t max_request_size_;
+  RDCache rd_cache_;
+  int listen_fd_ = -1;
+  int wake_fds_[2] = {-1, -1};  // Pipe waking up Serve().
+  std::atomic<bool> stopping_{false};
+  std::mutex mutex_;
+  // Open connections, by client socket. Only Serve() adds and removes them.
+  std::map<int, std::unique_ptr<Connection>> connections_;
+  std::unique_ptr<ThreadPool> pool_;
+
+  // Accepts a pending connection, if any. Returns false on error.
+  bool Accept();
+
+  // Receives the available bytes of the next request of 'connection', and
+  // schedules the request once complete.
+  void ReceiveRequest(Connection* const connection);
+
+  // Runs the received request of 'connection' and sends the response. Called
+  // by the workers.
+  void HandleRequest(Connection* const connection);
+
+  // Makes Serve() update the connections it polls.
+  void Wake();
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_THUMBNAILER_SERVER_H_
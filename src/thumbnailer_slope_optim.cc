@@ -13,11 +13,13 @@
 // limitations under the License.
 
 #include "thumbnailer.h"
+#include "tracer.h"
 
 namespace libwebp {
 
 Thumbnailer::Status Thumbnailer::GenerateAnimationSlopeOptim(
     WebPData* const webp_data) {
+  TraceScope trace("GenerateAnimationSlopeOptim");
   CHECK_THUMBNAILER_STATUS(LossyEncodeSlopeOptim(webp_data));
   CHECK_THUMBNAILER_STATUS(NearLosslessEqual(webp_data));
 
@@ -32,6 +34,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationSlopeOptim(
   size_t curr_anim_size = webp_data->size;
   const int KMaxIter = 5;
   for (int i = 0; i < KMaxIter; ++i) {
+    TraceScope iteration_trace("LossyEncodeNoSlopeOptim", "iteration", i);
     CHECK_THUMBNAILER_STATUS(LossyEncodeNoSlopeOptim(webp_data));
     if (curr_anim_size == webp_data->size) break;
     curr_anim_size = webp_data->size;
@@ -42,14 +45,18 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationSlopeOptim(
 }
 
 Thumbnailer::Status Thumbnailer::FindMedianSlope(float* const median_slope) {
-  std::vector<float> slopes;
-
-  int curr_ind = 0;
-  for (FrameData& frame : frames_) {
+  TraceScope trace("FindMedianSlope");
+  const int num_frames = frames_.size();
+  std::vector<float>& slopes = frame_slopes_;
+  slopes.assign(num_frames, 0.f);
+
+  // The frames are searched in parallel.
+  auto find_slope = [this, &slopes](int ind) -> Status {
+    FrameData& frame = frames_[ind];
     frame.config.quality = 100;
     float psnr_100;   // pic's psnr value with quality = 100.
     size_t size_100;  // pic'size with quality = 100.
-    CHECK_THUMBNAILER_STATUS(GetPictureStats(curr_ind, &size_100, &psnr_100));
+    CHECK_THUMBNAILER_STATUS(GetPictureStats(ind, &size_100, &psnr_100));
 
     int min_quality = 0;
     int max_quality = 100;
@@ -64,7 +71,7 @@ Thumbnailer::Status Thumbnailer::FindMedianSlope(float* const median_slope) {
       float new_psnr;
       size_t new_size;
 
-      CHECK_THUMBNAILER_STATUS(GetPictureStats(curr_ind, &new_size, &new_psnr));
+      CHECK_THUMBNAILER_STATUS(GetPictureStats(ind, &new_size, &new_psnr));
 
       if (psnr_100 - new_psnr <= slope_dPSNR_) {
         pic_final_slope = (psnr_100 - new_psnr) / float(size_100 - new_size);
@@ -74,9 +81,20 @@ Thumbnailer::Status Thumbnailer::FindMedianSlope(float* const median_slope) {
       }
     }
 
-    slopes.push_back(pic_final_slope);
-
-    ++curr_ind;
+    slopes[ind] = pic_final_slope;
+    return kOk;
+  };
+  {
+    TaskGroup tasks(ThreadPool::Default());
+    for (int i = 0; i < num_frames; ++i) {
+      tasks.Run([this, i, &find_slope]() {
+        frames_[i].task_status = find_slope(i);
+      });
+    }
+    tasks.Wait();
+  }
+  for (const FrameData& frame : frames_) {
+    CHECK_THUMBNAILER_STATUS(frame.task_status);
   }
 
   std::sort(slopes.begin(), slopes.end());
@@ -109,6 +127,7 @@ Thumbnailer::Status Thumbnailer::ComputeSlope(int ind, int low_quality,
 
 Thumbnailer::Status Thumbnailer::LossyEncodeSlopeOptim(
     WebPData* const webp_data) {
+  TraceScope trace("LossyEncodeSlopeOptim");
   // Sort frames.
   std::sort(frames_.begin(), frames_.end(),
             [](const FrameData& a, const FrameData& b) -> bool {
@@ -123,8 +142,10 @@ Thumbnailer::Status Thumbnailer::LossyEncodeSlopeOptim(
   WebPData new_webp_data;
   WebPDataInit(&new_webp_data);
 
-  std::vector<int> optim_list;  // Vector of frames needed to find the quality
-                                // in the next binary search loop.
+  // Vector of frames needed to find the quality in the next binary search
+  // loop.
+  std::vector<int>& optim_list = frame_indices_;
+  optim_list.clear();
   for (std::size_t i = 0; i < frames_.size(); ++i) {
     optim_list.push_back(i);
   }
@@ -134,6 +155,8 @@ Thumbnailer::Status Thumbnailer::LossyEncodeSlopeOptim(
   // can be different.
   while (min_quality <= max_quality && !optim_list.empty()) {
     int mid_quality = (min_quality + max_quality) / 2;
+    TraceScope probe_trace("SlopeOptimProbe", "quality", mid_quality,
+                           "frames", optim_list.size());
     const int last_ind = optim_list.size() - 1;
 
     // Remove all the frames that have dPSNR/dSize (in dB/bytes) smaller than
@@ -159,8 +182,7 @@ Thumbnailer::Status Thumbnailer::LossyEncodeSlopeOptim(
       for (int curr_frame : optim_list) {
         frames_[curr_frame].final_quality = mid_quality;
       }
-      WebPDataClear(webp_data);
-      *webp_data = new_webp_data;
+      AcceptAnimation(webp_data, &new_webp_data);
       min_quality = mid_quality + 1;
     } else {
       max_quality = mid_quality - 1;
@@ -242,8 +264,7 @@ Thumbnailer::Status Thumbnailer::LossyEncodeNoSlopeOptim(
   CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
 
   if (new_webp_data.size <= byte_budget_) {
-    WebPDataClear(webp_data);
-    *webp_data = new_webp_data;
+    AcceptAnimation(webp_data, &new_webp_data);
   } else {
     WebPDataClear(&new_webp_data);
     return kOk;
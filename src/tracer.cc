@@ -0,0 +1,144 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tracer.h"
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace libwebp {
+
+namespace {
+
+struct Event {
+  const char* name;
+  int64_t start_us;
+  int64_t duration_us;
+  const char* arg_names[2];
+  int arg_values[2];
+};
+
+// Events of one thread. The lock is only contended while writing the trace.
+struct ThreadBuffer {
+  std::mutex mutex;
+  int tid;
+  std::vector<Event> events;
+};
+
+// Buffers of all the threads that recorded events. They are never freed, so
+// that the events of exited threads are kept and no destructor runs at exit.
+struct Registry {
+  std::mutex mutex;
+  std::vector<ThreadBuffer*> buffers;
+};
+
+Registry& GetRegistry() {
+  static Registry* const registry = new Registry;
+  return *registry;
+}
+
+ThreadBuffer* GetThreadBuffer() {
+  thread_local ThreadBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    buffer = new ThreadBuffer;
+    buffer->tid = registry.buffers.size() + 1;
+    registry.buffers.push_back(buffer);
+  }
+  return buffer;
+}
+
+void WriteString(const char* str, std::ostream* const out) {
+  *out << '"';
+  for (; *str != '\0'; ++str) {
+    if (*str == '"' || *str == '\\') *out << '\\';
+    *out << *str;
+  }
+  *out << '"';
+}
+
+}  // namespace
+
+std::atomic<bool> Tracer::enabled_(false);
+
+void Tracer::Enable() {
+  Registry& registry = GetRegistry();
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (ThreadBuffer* const buffer : registry.buffers) {
+      std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+      buffer->events.clear();
+    }
+  }
+  NowUs();  // Starts the clock.
+  enabled_ = true;
+}
+
+void Tracer::Disable() { enabled_ = false; }
+
+int64_t Tracer::NowUs() {
+  static const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void Tracer::AddEvent(const char* name, int64_t start_us, int64_t duration_us,
+                      const char* arg_name_1, int arg_value_1,
+                      const char* arg_name_2, int arg_value_2) {
+  ThreadBuffer* const buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  buffer->events.push_back({name,
+                            start_us,
+                            duration_us,
+                            {arg_name_1, arg_name_2},
+                            {arg_value_1, arg_value_2}});
+}
+
+bool Tracer::WriteJson(const std::string& path) {
+  std::ofstream out(path);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for (ThreadBuffer* const buffer : registry.buffers) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    for (const Event& event : buffer->events) {
+      out << (first ? "\n" : ",\n") << "{\"name\":";
+      first = false;
+      WriteString(event.name, &out);
+      out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+          << ",\"ts\":" << event.start_us << ",\"dur\":" << event.duration_us;
+      if (event.arg_names[0] != nullptr) {
+        out << ",\"args\":{";
+        for (int i = 0; i < 2 && event.arg_names[i] != nullptr; ++i) {
+          if (i > 0) out << ',';
+          WriteString(event.arg_names[i], &out);
+          out << ':' << event.arg_values[i];
+        }
+        out << '}';
+      }
+      out << '}';
+    }
+  }
+  out << "\n]}\n";
+  return bool(out);
+}
+
+}  // namespace libwebp
@@ -0,0 +1,89 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_TRACER_H_
+#define THUMBNAILER_SRC_TRACER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+namespace libwebp {
+
+// Records timed events of all the threads of the process and writes them in
+// the Chrome trace event format, viewable in Perfetto or chrome://tracing.
+// While disabled, a TraceScope costs a relaxed atomic load. Thread-safe.
+class Tracer {
+ public:
+  // Drops the events recorded so far and starts recording.
+  static void Enable();
+
+  // Stops recording. The recorded events are kept.
+  static void Disable();
+
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Writes the recorded events to 'path' as trace event JSON. Returns false
+  // on error.
+  static bool WriteJson(const std::string& path);
+
+  // Returns the time elapsed since the process started, in microseconds.
+  static int64_t NowUs();
+
+  // Records a complete event. 'name' and 'arg_names' must be string literals.
+  // Arguments with a null name are not recorded.
+  static void AddEvent(const char* name, int64_t start_us, int64_t duration_us,
+                       const char* arg_name_1, int arg_value_1,
+                       const char* arg_name_2, int arg_value_2);
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// Records an event covering its lifetime, e.g.
+//   TraceScope trace("EncodeFrame", "frame", ind, "quality", quality);
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name, const char* arg_name_1 = nullptr,
+                      int arg_value_1 = 0, const char* arg_name_2 = nullptr,
+                      int arg_value_2 = 0)
+      : name_(Tracer::IsEnabled() ? name : nullptr),
+        arg_name_1_(arg_name_1),
+        arg_value_1_(arg_value_1),
+        arg_name_2_(arg_name_2),
+        arg_value_2_(arg_value_2),
+        start_us_((name_ != nullptr) ? Tracer::NowUs() : 0) {}
+
+  ~TraceScope() {
+    if (name_ == nullptr) return;
+    Tracer::AddEvent(name_, start_us_, Tracer::NowUs() - start_us_,
+                     arg_name_1_, arg_value_1_, arg_name_2_, arg_value_2_);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char* const name_;  // Null if the tracer was disabled.
+  const char* const arg_name_1_;
+  const int arg_value_1_;
+  const char* const arg_name_2_;
+  const int arg_value_2_;
+  const int64_t start_us_;
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_TRACER_H_
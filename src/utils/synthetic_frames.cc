@@ -0,0 +1,287 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "synthetic_frames.h"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+namespace libwebp {
+
+namespace {
+
+// Returns a pseudo-random value mixing the three inputs.
+uint32_t Hash(uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t h = a * 0x9e3779b1u;
+  h ^= (b + 0x7f4a7c15u) * 0x85ebca6bu;
+  h ^= (c + 0x165667b1u) * 0xc2b2ae35u;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// Only the raw output of mt19937 is specified by the standard, not the
+// distributions, hence this helper. Returns a value in [min, max].
+int Uniform(std::mt19937* const rng, int min, int max) {
+  return min + int((*rng)() % uint32_t(max - min + 1));
+}
+
+int FloorDiv(int a, int b) { return (a >= 0) ? a / b : -((b - 1 - a) / b); }
+
+int Mod(int a, int b) { return a - FloorDiv(a, b) * b; }
+
+int Clamp(int value) { return std::min(std::max(value, 0), 255); }
+
+// Folds 'position' into [0, limit], as if bouncing on both ends.
+int Reflect(int position, int limit) {
+  if (limit <= 0) return 0;
+  const int m = Mod(position, 2 * limit);
+  return (m <= limit) ? m : 2 * limit - m;
+}
+
+struct Color {
+  int r, g, b;
+};
+
+Color RandomColor(std::mt19937* const rng) {
+  return {Uniform(rng, 0, 255), Uniform(rng, 0, 255), Uniform(rng, 0, 255)};
+}
+
+struct Sprite {
+  int x, y;    // Top-left corner at the start of the scene.
+  int vx, vy;  // In pixels per frame.
+  int size;
+  bool circle;
+  Color color;
+};
+
+struct Scene {
+  Color colors[2];  // Ends of the background gradient.
+  int gradient_dx, gradient_dy;
+  int pan_vx, pan_vy;  // Camera motion in pixels per frame.
+  int texture_scale;   // Size of the coarse texture cells.
+  uint32_t texture_seed;
+  std::vector<Sprite> sprites;
+  int text_y;
+  int text_speed;
+  Color text_color, text_background;
+  uint32_t text_seed;
+};
+
+Scene MakeScene(const SyntheticOptions& options, int index) {
+  const int width = options.width;
+  const int height = options.height;
+  std::mt19937 rng(Hash(options.seed, index, 0));
+  Scene scene;
+  scene.colors[0] = RandomColor(&rng);
+  scene.colors[1] = RandomColor(&rng);
+  scene.gradient_dx = Uniform(&rng, -16, 16);
+  scene.gradient_dy = Uniform(&rng, -16, 16);
+  const int max_pan = std::max(1, width / 80);
+  scene.pan_vx = options.camera_pan ? Uniform(&rng, -max_pan, max_pan) : 0;
+  scene.pan_vy = options.camera_pan ? Uniform(&rng, -max_pan, max_pan) : 0;
+  scene.texture_scale =
+      std::max(8, std::min(width, height) / Uniform(&rng, 3, 8));
+  scene.texture_seed = rng();
+  for (int i = 0; i < options.num_sprites; ++i) {
+    Sprite sprite;
+    sprite.size = Uniform(&rng, std::max(2, height / 10),
+                          std::max(2, height / 3));
+    sprite.x = Uniform(&rng, 0, std::max(0, width - sprite.size));
+    sprite.y = Uniform(&rng, 0, std::max(0, height - sprite.size));
+    const int max_speed = std::max(1, width / 40);
+    sprite.vx = Uniform(&rng, 1, max_speed) * (Uniform(&rng, 0, 1) ? 1 : -1);
+    sprite.vy = Uniform(&rng, -max_speed, max_speed);
+    sprite.circle = Uniform(&rng, 0, 1);
+    sprite.color = RandomColor(&rng);
+    scene.sprites.push_back(sprite);
+  }
+  scene.text_y = Uniform(&rng, 0, std::max(0, height - height / 8));
+  scene.text_speed = Uniform(&rng, 1, std::max(1, width / 60));
+  scene.text_color = RandomColor(&rng);
+  scene.text_background = RandomColor(&rng);
+  scene.text_seed = rng();
+  return scene;
+}
+
+// Returns a smooth noise value in [0, 255], bilinearly interpolated between
+// random values on a grid of 'scale' pixels.
+int Texture(uint32_t seed, int scale, int x, int y) {
+  const int cx = FloorDiv(x, scale);
+  const int cy = FloorDiv(y, scale);
+  const int fx = x - cx * scale;
+  const int fy = y - cy * scale;
+  auto value = [seed, cx, cy](int i, int j) {
+    return int(Hash(seed, cx + i, cy + j) & 0xff);
+  };
+  const int top = value(0, 0) * (scale - fx) + value(1, 0) * fx;
+  const int bottom = value(0, 1) * (scale - fx) + value(1, 1) * fx;
+  return (top * (scale - fy) + bottom * fy) / (scale * scale);
+}
+
+// Draws the frame 'time' frames into 'scene' into 'rgba'.
+void DrawFrame(const SyntheticOptions& options, const Scene& scene, int time,
+               int frame_index, std::vector<uint8_t>* const rgba) {
+  const int width = options.width;
+  const int height = options.height;
+
+  // Range of the gradient projection over the frame.
+  const int corners[4] = {0, (width - 1) * scene.gradient_dx,
+                          (height - 1) * scene.gradient_dy,
+                          (width - 1) * scene.gradient_dx +
+                              (height - 1) * scene.gradient_dy};
+  const int min_proj = *std::min_element(corners, corners + 4);
+  const int max_proj = *std::max_element(corners, corners + 4);
+
+  // Background.
+  const int pan_x = scene.pan_vx * time;
+  const int pan_y = scene.pan_vy * time;
+  const int detail_scale = std::max(2, scene.texture_scale / 4);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const int proj = x * scene.gradient_dx + y * scene.gradient_dy;
+      const int t = (max_proj > min_proj)
+                        ? (proj - min_proj) * 255 / (max_proj - min_proj)
+                        : 128;
+      const int g = options.gradient ? t : 128;
+      const int texture =
+          (2 * Texture(scene.texture_seed, scene.texture_scale, x + pan_x,
+                       y + pan_y) +
+           Texture(scene.texture_seed + 1, detail_scale, x + pan_x,
+                   y + pan_y)) /
+          3;
+      const int shade = 160 + texture * 95 / 255;
+      uint8_t* const pixel = &(*rgba)[(size_t(y) * width + x) * 4];
+      pixel[0] = Clamp((scene.colors[0].r * (255 - g) + scene.colors[1].r * g) /
+                       255 * shade / 255);
+      pixel[1] = Clamp((scene.colors[0].g * (255 - g) + scene.colors[1].g * g) /
+                       255 * shade / 255);
+      pixel[2] = Clamp((scene.colors[0].b * (255 - g) + scene.colors[1].b * g) /
+                       255 * shade / 255);
+      pixel[3] = options.transparency ? 255 - t / 2 : 255;
+    }
+  }
+
+  // Sprites, drawn over each other in order.
+  for (const Sprite& sprite : scene.sprites) {
+    const int left = Reflect(sprite.x + sprite.vx * time, width - sprite.size);
+    const int top = Reflect(sprite.y + sprite.vy * time, height - sprite.size);
+    const int radius = sprite.size / 2;
+    for (int y = std::max(top, 0); y < std::min(top + sprite.size, height);
+         ++y) {
+      for (int x = std::max(left, 0); x < std::min(left + sprite.size, width);
+           ++x) {
+        const int dx = x - left - radius;
+        const int dy = y - top - radius;
+        if (sprite.circle && dx * dx + dy * dy > radius * radius) continue;
+        // Lit from the top.
+        const int light = 200 + 55 * (sprite.size - (y - top)) / sprite.size;
+        uint8_t* const pixel = &(*rgba)[(size_t(y) * width + x) * 4];
+        pixel[0] = Clamp(sprite.color.r * light / 255);
+        pixel[1] = Clamp(sprite.color.g * light / 255);
+        pixel[2] = Clamp(sprite.color.b * light / 255);
+        pixel[3] = options.transparency ? 192 : 255;
+      }
+    }
+  }
+
+  // Text band: 5x7 glyphs in 6x8 cells, scrolling to the left.
+  if (options.text) {
+    const int scale = std::max(1, height / 90);
+    const int cell_width = 6 * scale;
+    const int band_height = 10 * scale;
+    const int text_x = scene.text_speed * time;
+    for (int y = scene.text_y; y < std::min(scene.text_y + band_height, height);
+         ++y) {
+      const int gy = (y - scene.text_y) / scale - 1;
+      for (int x = 0; x < width; ++x) {
+        const int tx = x + text_x;
+        const int glyph = Hash(scene.text_seed, FloorDiv(tx, cell_width), 0) %
+                          32;  // Glyphs below 5 are spaces.
+        const int gx = Mod(tx, cell_width) / scale;
+        const bool ink = glyph >= 5 && gx < 5 && gy >= 0 && gy < 7 &&
+                         (Hash(scene.text_seed, glyph, gy * 5 + gx) & 3) != 0;
+        const Color& color = ink ? scene.text_color : scene.text_background;
+        uint8_t* const pixel = &(*rgba)[(size_t(y) * width + x) * 4];
+        pixel[0] = color.r;
+        pixel[1] = color.g;
+        pixel[2] = color.b;
+        pixel[3] = 255;
+      }
+    }
+  }
+
+  // Noise.
+  if (options.noise > 0) {
+    const uint32_t range = 2 * options.noise + 1;
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const uint32_t h = Hash(options.seed, frame_index, y * width + x);
+        uint8_t* const pixel = &(*rgba)[(size_t(y) * width + x) * 4];
+        for (int c = 0; c < 3; ++c) {
+          const int n = int(((h >> (8 * c)) & 0xff) % range) - options.noise;
+          pixel[c] = Clamp(pixel[c] + n);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+UtilsStatus GenerateSyntheticFrames(const SyntheticOptions& options,
+                                    const FrameCallback& on_frame) {
+  if (options.width <= 0 || options.height <= 0 || options.num_frames < 0 ||
+      options.frame_duration_ms <= 0 || options.num_sprites < 0 ||
+      options.scene_length < 0 || options.noise < 0 || options.noise > 127) {
+    std::cerr << "Invalid synthetic animation options." << std::endl;
+    return kGenericError;
+  }
+  std::vector<uint8_t> rgba(size_t(options.width) * options.height * 4);
+  Scene scene;
+  for (int i = 0; i < options.num_frames; ++i) {
+    const int scene_index =
+        (options.scene_length > 0) ? i / options.scene_length : 0;
+    const int scene_start = scene_index * options.scene_length;
+    if (i == scene_start) scene = MakeScene(options, scene_index);
+    DrawFrame(options, scene, i - scene_start, i, &rgba);
+
+    EnclosedWebPPicture pic(new WebPPicture, WebPPictureDelete);
+    if (!WebPPictureInit(pic.get())) return kMemoryError;
+    pic->use_argb = 1;
+    pic->width = options.width;
+    pic->height = options.height;
+    if (!WebPPictureImportRGBA(pic.get(), rgba.data(), options.width * 4)) {
+      return kMemoryError;
+    }
+    if (!on_frame({std::move(pic), (i + 1) * options.frame_duration_ms})) {
+      return kGenericError;
+    }
+  }
+  return kOk;
+}
+
+UtilsStatus GenerateSyntheticFrames(const SyntheticOptions& options,
+                                    std::vector<Frame>* const frames) {
+  return GenerateSyntheticFrames(options, [frames](Frame frame) {
+    frames->push_back(std::move(frame));
+    return true;
+  });
+}
+
+}  // namespace libwebp
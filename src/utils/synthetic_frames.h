@@ -0,0 +1,62 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_UTILS_SYNTHETIC_FRAMES_H_
+#define THUMBNAILER_SRC_UTILS_SYNTHETIC_FRAMES_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "thumbnailer_utils.h"
+
+namespace libwebp {
+
+// Content of a synthetic animation. Each scene has its own palette, layout
+// and motion, drawn from the seed: a textured background (gradient and
+// smooth noise) seen through a panning camera, moving sprites and a band of
+// scrolling text.
+struct SyntheticOptions {
+  int width = 320;
+  int height = 180;
+  int num_frames = 30;
+  int frame_duration_ms = 100;
+  uint32_t seed = 0;
+
+  bool gradient = true;    // Otherwise the background is a flat texture.
+  bool camera_pan = true;  // The background moves across the frames.
+  int num_sprites = 3;     // Bouncing circles and rectangles.
+  bool text = true;        // A band of scrolling glyphs.
+
+  // Number of frames between scene cuts, 0 for a single scene.
+  int scene_length = 0;
+
+  // Makes the background partially transparent and the sprites translucent.
+  bool transparency = false;
+
+  // Amplitude of the per-pixel noise added to the colors, like sensor noise.
+  int noise = 2;
+};
+
+// Generates the frames described by 'options', passing them one at a time to
+// 'on_frame'. The frames only depend on 'options': integer arithmetic is used
+// throughout, so that they are the same on all platforms.
+UtilsStatus GenerateSyntheticFrames(const SyntheticOptions& options,
+                                    const FrameCallback& on_frame);
+UtilsStatus GenerateSyntheticFrames(const SyntheticOptions& options,
+                                    std::vector<Frame>* const frames);
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_UTILS_SYNTHETIC_FRAMES_H_
@@ -0,0 +1,118 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sends a frame list to a thumbnailer server (see the -serve flag of the
+// thumbnailer binary) and writes the resulting animation.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "../thumbnailer_server.h"
+#include "src/thumbnailer.pb.h"
+#include "thumbnailer_utils.h"
+
+namespace {
+
+void Help() {
+  std::cout << "Usage: thumbnailer_client [options] socket frame_list.txt "
+               "output.webp\n"
+               "  -algorithm <string>  method used to generate the "
+               "animation\n"
+               "  -soft_max_size <int> desired maximum size in bytes\n"
+               "  -hard_max_size <int> hard maximum size in bytes\n"
+               "  -m <int>             effort/speed trade-off (0..6)\n"
+            << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  thumbnailer::ThumbnailerRequest request;
+  std::vector<std::string> positional_args;
+  for (int c = 1; c < argc; ++c) {
+    if (!strcmp(argv[c], "-algorithm") && c + 1 < argc) {
+      request.set_algorithm(argv[++c]);
+    } else if (!strcmp(argv[c], "-soft_max_size") && c + 1 < argc) {
+      request.mutable_option()->set_soft_max_size(atoi(argv[++c]));
+    } else if (!strcmp(argv[c], "-hard_max_size") && c + 1 < argc) {
+      request.mutable_option()->set_hard_max_size(atoi(argv[++c]));
+    } else if (!strcmp(argv[c], "-m") && c + 1 < argc) {
+      request.mutable_option()->set_webp_method(atoi(argv[++c]));
+    } else {
+      positional_args.push_back(argv[c]);
+    }
+  }
+  if (positional_args.size() != 3) {
+    Help();
+    return 1;
+  }
+  const std::string& socket_path = positional_args[0];
+  const std::string& list_filename = positional_args[1];
+  const std::string& output = positional_args[2];
+
+  // The images are sent as is and decoded by the server.
+  if (libwebp::ReadEncodedFrameList(
+          list_filename.c_str(),
+          [&request](const uint8_t* data, size_t data_size, int timestamp) {
+            thumbnailer::InputFrame* const frame = request.add_frames();
+            frame->set_data(data, data_size);
+            frame->set_timestamp_ms(timestamp);
+            return true;
+          }) != libwebp::UtilsStatus::kOk) {
+    return 1;
+  }
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address),
+                        sizeof(address)) != 0) {
+    std::cerr << "Failed to connect to " << socket_path << std::endl;
+    if (fd >= 0) close(fd);
+    return 1;
+  }
+
+  thumbnailer::ThumbnailerResponse response;
+  const bool ok = libwebp::WriteMessage(fd, request) &&
+                  libwebp::ReadMessage(fd, &response);
+  close(fd);
+  if (!ok) {
+    std::cerr << "Error communicating with the server." << std::endl;
+    return 1;
+  }
+  if (response.status() != 0) {
+    std::cerr << "Server error " << response.status() << ": "
+              << response.error() << std::endl;
+    return 1;
+  }
+  if (!ImgIoUtilWriteFile(
+          output.c_str(),
+          reinterpret_cast<const uint8_t*>(response.animation().data()),
+          response.animation().size())) {
+    return 1;
+  }
+
+  google::protobuf::ShutdownProtobufLibrary();
+  return 0;
+}
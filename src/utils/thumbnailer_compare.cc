@@ -12,104 +12,245 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <fstream>
+#include <chrono>
 #include <string>
 
+#include "../thread_pool.h"
 #include "../thumbnailer.h"
+#include "../thumbnailer_job.h"
+#include "src/thumbnailer.pb.h"
 #include "thumbnailer_utils.h"
 
+namespace {
+
+// The method whose thumbnail the others are compared to.
+const libwebp::Thumbnailer::Method kReferenceMethod =
+    libwebp::Thumbnailer::kEqualQuality;
+
+enum class OutputFormat { kText, kCSV, kJSON };
+
+struct MethodResult {
+  libwebp::Thumbnailer::Method method;
+  std::string error;  // Empty on success.
+  double wall_ms = 0.;
+  thumbnailer::ThumbnailerStats stats;
+  libwebp::ThumbnailStatsPSNR psnr;
+  libwebp::ThumbnailDiffPSNR diff;  // With respect to kReferenceMethod.
+};
+
+// Generates the thumbnail of 'frames' with 'result->method' and measures the
+// PSNR of its frames. The frame measurements go through 'rd_cache' if not
+// null.
+void RunMethod(const std::vector<libwebp::Frame>& frames,
+               libwebp::RDCache* const rd_cache, MethodResult* const result) {
+  libwebp::Thumbnailer thumbnailer;
+  if (thumbnailer.SetRDCache(rd_cache) != libwebp::Thumbnailer::Status::kOk) {
+    result->error = "Error setting the RD cache.";
+    return;
+  }
+  for (const libwebp::Frame& frame : frames) {
+    if (thumbnailer.AddFrame(*frame.pic, frame.timestamp) !=
+        libwebp::Thumbnailer::Status::kOk) {
+      result->error = "Error adding frames.";
+      return;
+    }
+  }
+
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  const auto start = std::chrono::steady_clock::now();
+  const libwebp::Thumbnailer::Status status =
+      thumbnailer.GenerateAnimation(&webp_data, result->method);
+  result->wall_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  result->stats = thumbnailer.stats();
+  if (status != libwebp::Thumbnailer::Status::kOk) {
+    result->error = "Error generating thumbnail.";
+  } else if (libwebp::AnimData2PSNR(frames, &webp_data, &result->psnr) !=
+             libwebp::UtilsStatus::kOk) {
+    result->error = "Comparison failed.";
+  }
+  WebPDataClear(&webp_data);
+}
+
+void PrintText(const std::vector<MethodResult>& results,
+               const libwebp::UtilsOption& option) {
+  for (const MethodResult& result : results) {
+    if (!option.short_output) {
+      std::cout << std::endl
+                << "----- Method " << result.method << " -----" << std::endl;
+    }
+    if (!result.error.empty()) {
+      std::cerr << result.error << std::endl;
+      continue;
+    }
+    libwebp::PrintThumbnailDiffPSNR(result.diff, option);
+    if (!option.short_output) {
+      std::cout << std::setw(14) << std::left
+                << "Size: " << result.stats.animation_size() << std::endl;
+      std::cout << std::setw(14) << std::left << "Time: " << result.wall_ms
+                << " ms (" << result.stats.encode_cpu_ms()
+                << " ms encoding CPU)" << std::endl;
+      std::cout << std::setw(14) << std::left
+                << "Encodes: " << result.stats.num_encodes() << " ("
+                << result.stats.shared_rd_cache_hits()
+                << " shared measurements)" << std::endl;
+    }
+  }
+}
+
+void PrintCSV(const std::vector<MethodResult>& results) {
+  std::cout << "method,size,wall_ms,encode_cpu_ms,encodes,shared_rd_hits,"
+               "mean_psnr,"
+               "mean_psnr_diff,median_psnr_diff,max_psnr_increase,"
+               "max_psnr_decrease,error"
+            << std::endl;
+  for (const MethodResult& result : results) {
+    std::cout << libwebp::MethodName(result.method) << ',';
+    if (result.error.empty()) {
+      std::cout << result.stats.animation_size() << ',' << result.wall_ms
+                << ',' << result.stats.encode_cpu_ms() << ','
+                << result.stats.num_encodes() << ','
+                << result.stats.shared_rd_cache_hits() << ','
+                << result.psnr.mean_psnr
+                << ',' << result.diff.mean_psnr_diff << ','
+                << result.diff.median_psnr_diff << ','
+                << result.diff.max_psnr_increase << ','
+                << result.diff.max_psnr_decrease << ',';
+    } else {
+      std::cout << ",,,,,,,,,," << result.error;
+    }
+    std::cout << std::endl;
+  }
+}
+
+void PrintJSON(const std::vector<MethodResult>& results) {
+  std::cout << '[';
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const MethodResult& result = results[i];
+    std::cout << (i == 0 ? "\n" : ",\n") << "  {\"method\": \""
+              << libwebp::MethodName(result.method) << '"';
+    if (result.error.empty()) {
+      std::cout << ", \"size\": " << result.stats.animation_size()
+                << ", \"wall_ms\": " << result.wall_ms
+                << ", \"encode_cpu_ms\": " << result.stats.encode_cpu_ms()
+                << ", \"encodes\": " << result.stats.num_encodes()
+                << ", \"shared_rd_hits\": "
+                << result.stats.shared_rd_cache_hits()
+                << ", \"mean_psnr\": " << result.psnr.mean_psnr
+                << ", \"mean_psnr_diff\": " << result.diff.mean_psnr_diff
+                << ", \"median_psnr_diff\": " << result.diff.median_psnr_diff
+                << ", \"max_psnr_increase\": "
+                << result.diff.max_psnr_increase
+                << ", \"max_psnr_decrease\": "
+                << result.diff.max_psnr_decrease;
+    } else {
+      std::cout << ", \"error\": \"" << result.error << '"';
+    }
+    std::cout << '}';
+  }
+  std::cout << "\n]" << std::endl;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   if (argc == 1) {
     return 0;
   }
   libwebp::UtilsOption option;
+  OutputFormat format = OutputFormat::kText;
+  bool serial = false;
+  bool share_rd_cache = true;
   std::string list_filename;
   for (int c = 1; c < argc; ++c) {
     if (!strcmp(argv[c], "-short")) {
       option.short_output = true;
+    } else if (!strcmp(argv[c], "-serial")) {
+      serial = true;
+    } else if (!strcmp(argv[c], "-no_shared_cache")) {
+      share_rd_cache = false;
+    } else if (!strcmp(argv[c], "-format") && c + 1 < argc) {
+      const std::string name = argv[++c];
+      if (name == "text") {
+        format = OutputFormat::kText;
+      } else if (name == "csv") {
+        format = OutputFormat::kCSV;
+      } else if (name == "json") {
+        format = OutputFormat::kJSON;
+      } else {
+        std::cerr << "Unknown output format: " << name << std::endl;
+        return 1;
+      }
     } else {
       list_filename = argv[c];
     }
   }
 
-  // Process list of images and timestamps.
+  // Process list of images and timestamps, or a single animated image.
   std::vector<libwebp::Frame> frames;
-  std::ifstream input_list(list_filename);
-  std::string frame_filename;
-  int timestamp;
-  while (input_list >> frame_filename >> timestamp) {
-    frames.push_back(
-        {EnclosedWebPPicture(new WebPPicture, libwebp::WebPPictureDelete),
-         timestamp});
-    WebPPicture* pic = frames.back().pic.get();
-    WebPPictureInit(pic);
-    if (!libwebp::ReadPicture(frame_filename.c_str(), pic)) {
-      std::cerr << "Failed to read image " << frame_filename << std::endl;
-      return 1;
-    }
+  if (libwebp::ReadFrames(list_filename.c_str(), /*frame_duration_ms=*/100,
+                          &frames) != libwebp::UtilsStatus::kOk) {
+    return 1;
   }
   if (frames.empty()) {
     std::cerr << "No input frame(s) for generating animation." << std::endl;
     return 1;
   }
 
-  // Generate reference thumbnail.
-  libwebp::Thumbnailer thumbnailer_ref;
-  for (const libwebp::Frame& frame : frames) {
-    if (thumbnailer_ref.AddFrame(*frame.pic, frame.timestamp) !=
-        libwebp::Thumbnailer::Status::kOk) {
-      std::cerr << "Error adding frames." << std::endl;
-      return 1;
+  // Generate the thumbnails. The methods share the default pool with their
+  // per-frame tasks, so their wall times are affected by each other unless
+  // -serial is given. The encoding CPU times are not.
+  std::vector<MethodResult> results;
+  for (libwebp::Thumbnailer::Method method :
+       libwebp::Thumbnailer::kMethodList) {
+    results.emplace_back();
+    results.back().method = method;
+  }
+  // The methods measure the same frames at the same qualities. Unless
+  // -no_shared_cache is given, each measurement is made once, by whichever
+  // method needs it first.
+  libwebp::RDCache rd_cache;
+  libwebp::RDCache* const shared_rd_cache =
+      share_rd_cache ? &rd_cache : nullptr;
+  if (serial) {
+    for (MethodResult& result : results) {
+      RunMethod(frames, shared_rd_cache, &result);
+    }
+  } else {
+    libwebp::TaskGroup tasks(libwebp::ThreadPool::Default());
+    for (MethodResult& result : results) {
+      tasks.Run([&frames, shared_rd_cache, &result]() {
+        RunMethod(frames, shared_rd_cache, &result);
+      });
     }
+    tasks.Wait();
   }
-  WebPData webp_data_ref;
-  WebPDataInit(&webp_data_ref);
-  if (thumbnailer_ref.GenerateAnimation(
-          &webp_data_ref, libwebp::Thumbnailer::Method::kEqualQuality) !=
-      libwebp::Thumbnailer::Status::kOk) {
+
+  // Compare to the reference thumbnail, which is the result of its method.
+  const MethodResult* reference = nullptr;
+  for (const MethodResult& result : results) {
+    if (result.method == kReferenceMethod) reference = &result;
+  }
+  if (reference == nullptr || !reference->error.empty()) {
     std::cerr << "Error generating reference thumbnail." << std::endl;
-    WebPDataClear(&webp_data_ref);
     return 1;
   }
-
-  // Generate new thumbnails and compare to the reference thumbnail.
-  for (const libwebp::Thumbnailer::Method& method :
-       libwebp::Thumbnailer::kMethodList) {
-    if (!option.short_output) {
-      std::cout << std::endl
-                << "----- Method " << method << " -----" << std::endl;
-    }
-    libwebp::Thumbnailer thumbnailer;
-
-    libwebp::Thumbnailer::Status status = libwebp::Thumbnailer::Status::kOk;
-    for (const libwebp::Frame& frame : frames) {
-      status = thumbnailer.AddFrame(*frame.pic, frame.timestamp);
-      if (status != libwebp::Thumbnailer::Status::kOk) {
-        break;
-      }
-    }
-    if (status != libwebp::Thumbnailer::Status::kOk) {
-      std::cerr << "Error adding frames." << std::endl;
-      continue;
+  for (MethodResult& result : results) {
+    if (result.error.empty() &&
+        libwebp::DiffThumbnailPSNR(reference->psnr, result.psnr,
+                                   &result.diff) != libwebp::UtilsStatus::kOk) {
+      result.error = "Comparison failed.";
     }
-
-    WebPData webp_data;
-    WebPDataInit(&webp_data);
-    if (thumbnailer.GenerateAnimation(&webp_data, method) ==
-        libwebp::Thumbnailer::Status::kOk) {
-      libwebp::ThumbnailDiffPSNR diff;
-      if (libwebp::CompareThumbnail(frames, &webp_data_ref, &webp_data,
-                                    &diff) == libwebp::UtilsStatus::kOk) {
-        libwebp::PrintThumbnailDiffPSNR(diff, option);
-      } else {
-        std::cerr << "Comparison failed." << std::endl;
-      }
-    } else {
-      std::cerr << "Error generating thumbnail." << std::endl;
-    }
-    WebPDataClear(&webp_data);
   }
 
-  WebPDataClear(&webp_data_ref);
+  if (format == OutputFormat::kCSV) {
+    PrintCSV(results);
+  } else if (format == OutputFormat::kJSON) {
+    PrintJSON(results);
+  } else {
+    PrintText(results, option);
+  }
   return 0;
 }
@@ -0,0 +1,321 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Evaluates all the methods on a corpus of frame lists, at several byte
+// budgets, and summarizes their BD-rate against kEqualQuality, their run
+// times and their encode counts.
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "../thread_pool.h"
+#include "../thumbnailer.h"
+#include "../thumbnailer_job.h"
+#include "src/thumbnailer.pb.h"
+#include "thumbnailer_utils.h"
+
+namespace {
+
+const libwebp::Thumbnailer::Method kReferenceMethod =
+    libwebp::Thumbnailer::kEqualQuality;
+
+// Generation of one clip with one method and budget.
+struct Run {
+  int clip;
+  libwebp::Thumbnailer::Method method;
+  size_t budget;
+  std::string error;  // Empty on success.
+  size_t size = 0;
+  float mean_psnr = 0.f;
+  double wall_ms = 0.;
+  double encode_cpu_ms = 0.;
+  int num_encodes = 0;
+};
+
+// Returns the sorted paths of the regular, non-hidden files of 'directory'.
+bool ListFiles(const std::string& directory,
+               std::vector<std::string>* const paths) {
+  DIR* const dir = opendir(directory.c_str());
+  if (dir == NULL) return false;
+  while (const dirent* const entry = readdir(dir)) {
+    const std::string path = directory + "/" + entry->d_name;
+    struct stat entry_stat;
+    if (entry->d_name[0] != '.' && stat(path.c_str(), &entry_stat) == 0 &&
+        S_ISREG(entry_stat.st_mode)) {
+      paths->push_back(path);
+    }
+  }
+  closedir(dir);
+  std::sort(paths->begin(), paths->end());
+  return true;
+}
+
+bool ParseBudgets(const std::string& list, std::vector<size_t>* const budgets) {
+  budgets->clear();
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    char* end;
+    const unsigned long budget = strtoul(item.c_str(), &end, 10);
+    if (item.empty() || *end != '\0' || budget == 0) return false;
+    budgets->push_back(budget);
+  }
+  return !budgets->empty();
+}
+
+void GenerateRun(const std::vector<libwebp::Frame>& frames, Run* const run) {
+  thumbnailer::ThumbnailerOption option;
+  option.set_soft_max_size(run->budget);
+  option.set_hard_max_size(run->budget);
+  libwebp::Thumbnailer thumbnailer(option);
+  for (const libwebp::Frame& frame : frames) {
+    if (thumbnailer.AddFrame(*frame.pic, frame.timestamp) !=
+        libwebp::Thumbnailer::kOk) {
+      run->error = "Error adding frames.";
+      return;
+    }
+  }
+
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  const auto start = std::chrono::steady_clock::now();
+  const libwebp::Thumbnailer::Status status =
+      thumbnailer.GenerateAnimation(&webp_data, run->method);
+  run->wall_ms = std::chrono::duration<double, std::milli>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  run->encode_cpu_ms = thumbnailer.stats().encode_cpu_ms();
+  run->num_encodes = thumbnailer.stats().num_encodes();
+  libwebp::ThumbnailStatsPSNR stats;
+  if (status != libwebp::Thumbnailer::kOk) {
+    run->error = "Error generating thumbnail.";
+  } else if (libwebp::AnimData2PSNR(frames, &webp_data, &stats) !=
+             libwebp::UtilsStatus::kOk) {
+    run->error = "Error measuring PSNR.";
+  } else {
+    run->size = webp_data.size;
+    run->mean_psnr = stats.mean_psnr;
+  }
+  WebPDataClear(&webp_data);
+}
+
+// Returns the rate-distortion curve of 'method' on 'clip'.
+std::vector<libwebp::RDPoint> GetCurve(const std::vector<Run>& runs, int clip,
+                                       libwebp::Thumbnailer::Method method) {
+  std::vector<libwebp::RDPoint> curve;
+  for (const Run& run : runs) {
+    if (run.clip == clip && run.method == method && run.error.empty()) {
+      curve.push_back({double(run.size), run.mean_psnr});
+    }
+  }
+  return curve;
+}
+
+// Returns the 'percentile'-th value of 'values' (nearest rank).
+double Percentile(std::vector<double> values, double percentile) {
+  if (values.empty()) return 0.;
+  std::sort(values.begin(), values.end());
+  const int rank = std::ceil(percentile / 100. * values.size());
+  return values[std::max(rank, 1) - 1];
+}
+
+void WriteRuns(const std::vector<std::string>& clips,
+               const std::vector<Run>& runs, std::ostream* const out) {
+  *out << "clip,method,budget,size,mean_psnr,wall_ms,encode_cpu_ms,encodes,"
+          "error\n";
+  for (const Run& run : runs) {
+    *out << clips[run.clip] << ',' << libwebp::MethodName(run.method) << ','
+         << run.budget << ',';
+    if (run.error.empty()) {
+      *out << run.size << ',' << run.mean_psnr << ',' << run.wall_ms << ','
+           << run.encode_cpu_ms << ',' << run.num_encodes << ",\n";
+    } else {
+      *out << ",,,,," << run.error << '\n';
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<size_t> budgets = {40000, 80000, 153600, 300000};
+  int max_concurrent_clips = 0;
+  bool csv = false;
+  std::string runs_filename;
+  std::string directory;
+  for (int c = 1; c < argc; ++c) {
+    if (!strcmp(argv[c], "-budgets") && c + 1 < argc) {
+      if (!ParseBudgets(argv[++c], &budgets)) {
+        std::cerr << "Invalid budget list: " << argv[c] << std::endl;
+        return 1;
+      }
+    } else if (!strcmp(argv[c], "-jobs") && c + 1 < argc) {
+      max_concurrent_clips = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-csv")) {
+      csv = true;
+    } else if (!strcmp(argv[c], "-runs") && c + 1 < argc) {
+      runs_filename = argv[++c];
+    } else {
+      directory = argv[c];
+    }
+  }
+  if (directory.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-budgets 40000,80000,...] [-jobs N] [-csv] [-runs file]"
+                 " corpus_directory"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> clips;
+  if (!ListFiles(directory, &clips) || clips.empty()) {
+    std::cerr << "No frame lists found in " << directory << std::endl;
+    return 1;
+  }
+
+  // One run per clip, method and budget.
+  std::vector<Run> runs;
+  for (std::size_t clip = 0; clip < clips.size(); ++clip) {
+    for (libwebp::Thumbnailer::Method method :
+         libwebp::Thumbnailer::kMethodList) {
+      for (size_t budget : budgets) {
+        runs.emplace_back();
+        runs.back().clip = clip;
+        runs.back().method = method;
+        runs.back().budget = budget;
+      }
+    }
+  }
+  const int runs_per_clip = runs.size() / clips.size();
+
+  // Like the batch mode, up to 'max_concurrent_clips' runners share the
+  // default pool with the per-frame tasks. The frames of a clip are read once
+  // and its runs are generated concurrently.
+  libwebp::ThreadPool* const pool = libwebp::ThreadPool::Default();
+  if (max_concurrent_clips <= 0) max_concurrent_clips = pool->num_threads();
+  const int num_runners = std::min<int>(max_concurrent_clips, clips.size());
+  std::atomic<int> next_clip(0);
+  std::mutex output_mutex;
+  {
+    libwebp::TaskGroup runners(pool);
+    for (int r = 0; r < num_runners; ++r) {
+      runners.Run([&]() {
+        for (int clip = next_clip++; clip < int(clips.size());
+             clip = next_clip++) {
+          Run* const clip_runs = &runs[clip * runs_per_clip];
+          std::vector<libwebp::Frame> frames;
+          if (libwebp::ReadFrames(clips[clip].c_str(),
+                                  /*frame_duration_ms=*/100,
+                                  &frames) != libwebp::UtilsStatus::kOk ||
+              frames.empty()) {
+            for (int i = 0; i < runs_per_clip; ++i) {
+              clip_runs[i].error = "Error reading frames.";
+            }
+          } else {
+            libwebp::TaskGroup tasks(pool);
+            for (int i = 0; i < runs_per_clip; ++i) {
+              tasks.Run([&frames, clip_runs, i]() {
+                GenerateRun(frames, &clip_runs[i]);
+              });
+            }
+            tasks.Wait();
+          }
+          std::lock_guard<std::mutex> lock(output_mutex);
+          std::cerr << "Done: " << clips[clip] << std::endl;
+        }
+      });
+    }
+    runners.Wait();
+  }
+
+  if (!runs_filename.empty()) {
+    std::ofstream out(runs_filename);
+    WriteRuns(clips, runs, &out);
+    if (!out) {
+      std::cerr << "Could not write " << runs_filename << std::endl;
+      return 1;
+    }
+  }
+
+  // Summary per method. The BD-rate is averaged over the clips for which
+  // both curves could be fitted.
+  if (csv) {
+    std::cout << "method,runs,failures,bd_rate,bd_rate_clips,mean_wall_ms,"
+                 "p95_wall_ms,mean_encode_cpu_ms,mean_encodes"
+              << std::endl;
+  } else {
+    std::cout << "method          runs  fail  BD-rate(%)  clips  mean ms   "
+                 "p95 ms    cpu ms    encodes"
+              << std::endl;
+  }
+  for (libwebp::Thumbnailer::Method method :
+       libwebp::Thumbnailer::kMethodList) {
+    int num_runs = 0;
+    int num_failures = 0;
+    std::vector<double> wall_ms;
+    double encode_cpu_ms = 0.;
+    double num_encodes = 0.;
+    for (const Run& run : runs) {
+      if (run.method != method) continue;
+      ++num_runs;
+      if (!run.error.empty()) {
+        ++num_failures;
+        continue;
+      }
+      wall_ms.push_back(run.wall_ms);
+      encode_cpu_ms += run.encode_cpu_ms;
+      num_encodes += run.num_encodes;
+    }
+    double bd_rate_sum = 0.;
+    int num_bd_rates = 0;
+    for (std::size_t clip = 0; clip < clips.size(); ++clip) {
+      double bd_rate;
+      if (libwebp::BDRate(GetCurve(runs, clip, kReferenceMethod),
+                          GetCurve(runs, clip, method),
+                          &bd_rate) == libwebp::UtilsStatus::kOk) {
+        bd_rate_sum += bd_rate;
+        ++num_bd_rates;
+      }
+    }
+    const int num_ok = std::max<int>(wall_ms.size(), 1);
+    const double mean_wall_ms =
+        std::accumulate(wall_ms.begin(), wall_ms.end(), 0.) / num_ok;
+    const double bd_rate = (num_bd_rates > 0) ? bd_rate_sum / num_bd_rates : 0.;
+
+    if (csv) {
+      std::cout << libwebp::MethodName(method) << ',' << num_runs << ','
+                << num_failures << ',' << bd_rate << ',' << num_bd_rates << ','
+                << mean_wall_ms << ',' << Percentile(wall_ms, 95.) << ','
+                << encode_cpu_ms / num_ok << ',' << num_encodes / num_ok
+                << std::endl;
+    } else {
+      std::cout << std::fixed << std::setprecision(1) << std::left
+                << std::setw(16) << libwebp::MethodName(method) << std::right
+                << std::setw(4) << num_runs << std::setw(6) << num_failures
+                << std::setw(12) << std::showpos << bd_rate << std::noshowpos
+                << std::setw(7) << num_bd_rates << std::setw(10)
+                << mean_wall_ms << std::setw(10) << Percentile(wall_ms, 95.)
+                << std::setw(10) << encode_cpu_ms / num_ok << std::setw(11)
+                << num_encodes / num_ok << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Writes a synthetic animation (see synthetic_frames.h) as a lossless WebP,
+// e.g. to build a corpus for thumbnailer_eval.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "../animation_writer.h"
+#include "synthetic_frames.h"
+
+namespace {
+
+// Encodes 'frames' losslessly and writes them to 'fd', one at a time.
+class SynthWriter {
+ public:
+  explicit SynthWriter(int fd) : writer_(fd) {}
+
+  bool Start(const libwebp::SyntheticOptions& options) {
+    if (!WebPConfigInit(&config_)) return false;
+    config_.lossless = 1;
+    config_.exact = 1;  // Keeps the color of the transparent pixels.
+    config_.method = 1;
+    return writer_.Start(options.width, options.height, options.transparency,
+                         /*loop_count=*/0, /*bgcolor=*/0xffffffff,
+                         /*riff_size=*/0);
+  }
+
+  bool AddFrame(const libwebp::Frame& frame) {
+    WebPMemoryWriter memory_writer;
+    WebPMemoryWriterInit(&memory_writer);
+    frame.pic->writer = WebPMemoryWrite;
+    frame.pic->custom_ptr = &memory_writer;
+    const bool ok =
+        WebPEncode(&config_, frame.pic.get()) &&
+        writer_.AddFrame(memory_writer.mem, memory_writer.size,
+                         frame.timestamp - prev_timestamp_);
+    WebPMemoryWriterClear(&memory_writer);
+    prev_timestamp_ = frame.timestamp;
+    return ok;
+  }
+
+  bool Finish() { return writer_.Finish(); }
+
+ private:
+  libwebp::AnimationWriter writer_;
+  WebPConfig config_;
+  int prev_timestamp_ = 0;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  libwebp::SyntheticOptions options;
+  std::string output;
+  for (int c = 1; c < argc; ++c) {
+    if (!strcmp(argv[c], "-width") && c + 1 < argc) {
+      options.width = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-height") && c + 1 < argc) {
+      options.height = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-frames") && c + 1 < argc) {
+      options.num_frames = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-duration") && c + 1 < argc) {
+      options.frame_duration_ms = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-seed") && c + 1 < argc) {
+      options.seed = strtoul(argv[++c], NULL, 10);
+    } else if (!strcmp(argv[c], "-sprites") && c + 1 < argc) {
+      options.num_sprites = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-scene_length") && c + 1 < argc) {
+      options.scene_length = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-noise") && c + 1 < argc) {
+      options.noise = atoi(argv[++c]);
+    } else if (!strcmp(argv[c], "-no_gradient")) {
+      options.gradient = false;
+    } else if (!strcmp(argv[c], "-no_pan")) {
+      options.camera_pan = false;
+    } else if (!strcmp(argv[c], "-no_text")) {
+      options.text = false;
+    } else if (!strcmp(argv[c], "-transparency")) {
+      options.transparency = true;
+    } else if (!strcmp(argv[c], "-o") && c + 1 < argc) {
+      output = argv[++c];
+    } else {
+      std::cerr << "Unknown option: " << argv[c] << std::endl;
+      output.clear();
+      break;
+    }
+  }
+  if (output.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-width 320] [-height 180] [-frames 30] [-duration 100]"
+                 " [-seed 0] [-sprites 3] [-scene_length 0] [-noise 2]"
+                 " [-no_gradient] [-no_pan] [-no_text] [-transparency]"
+                 " -o output.webp"
+              << std::endl;
+    return 1;
+  }
+
+  // The RIFF size is patched at the end, hence a regular file.
+  const int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Could not open " << output << std::endl;
+    return 1;
+  }
+  SynthWriter writer(fd);
+  bool ok = writer.Start(options);
+  ok = ok && libwebp::GenerateSyntheticFrames(
+                 options, [&writer](libwebp::Frame frame) {
+                   return writer.AddFrame(frame);
+                 }) == libwebp::UtilsStatus::kOk;
+  ok = ok && writer.Finish();
+  if (close(fd) != 0) ok = false;
+  if (!ok) {
+    std::cerr << "Error writing " << output << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -14,6 +14,9 @@
 
 #include "thumbnailer_utils.h"
 
+#include <fstream>
+#include <string>
+
 namespace libwebp {
 
 // Returns true on success and false on failure.
@@ -41,7 +44,7 @@ void WebPDataDelete(WebPData* webp_data) {
 }
 
 UtilsStatus AnimData2Frames(WebPData* const webp_data,
-                            std::vector<Frame>* const frames) {
+                            const FrameCallback& on_frame) {
   std::unique_ptr<WebPAnimDecoder, void (*)(WebPAnimDecoder*)> dec(
       WebPAnimDecoderNew(webp_data, NULL), WebPAnimDecoderDelete);
   if (dec == NULL) {
@@ -65,9 +68,9 @@ UtilsStatus AnimData2Frames(WebPData* const webp_data,
       std::cerr << "Error decoding frame." << std::endl;
       return kMemoryError;
     }
-    frames->push_back(
-        {EnclosedWebPPicture(new WebPPicture, WebPPictureFree), timestamp});
-    WebPPicture* pic = frames->back().pic.get();
+    Frame frame = {EnclosedWebPPicture(new WebPPicture, WebPPictureDelete),
+                   timestamp};
+    WebPPicture* pic = frame.pic.get();
     if (!WebPPictureInit(pic)) return kMemoryError;
     pic->use_argb = 1;
     pic->width = width;
@@ -75,6 +78,171 @@ UtilsStatus AnimData2Frames(WebPData* const webp_data,
     if (!WebPPictureImportRGBA(pic, frame_rgba, width * 4)) {
       return kMemoryError;
     }
+    if (!on_frame(std::move(frame))) return kGenericError;
+  }
+  return kOk;
+}
+
+UtilsStatus AnimData2Frames(WebPData* const webp_data,
+                            std::vector<Frame>* const frames) {
+  return AnimData2Frames(webp_data, [frames](Frame frame) {
+    frames->push_back(std::move(frame));
+    return true;
+  });
+}
+
+UtilsStatus ReadFrameList(const char* const list_filename,
+                          const FrameCallback& on_frame) {
+  std::ifstream input_list(list_filename);
+  if (!input_list.is_open()) {
+    std::cerr << "Failed to open frame list " << list_filename << std::endl;
+    return kGenericError;
+  }
+
+  std::string filename;
+  int timestamp;
+  while (input_list >> filename >> timestamp) {
+    Frame frame = {EnclosedWebPPicture(new WebPPicture, WebPPictureDelete),
+                   timestamp};
+    WebPPicture* pic = frame.pic.get();
+    if (!WebPPictureInit(pic)) return kMemoryError;
+    if (!ReadPicture(filename.c_str(), pic)) {
+      std::cerr << "Failed to read image " << filename << std::endl;
+      return kGenericError;
+    }
+    if (!on_frame(std::move(frame))) return kGenericError;
+  }
+  return kOk;
+}
+
+UtilsStatus ReadEncodedFrameList(
+    const char* const list_filename,
+    const std::function<bool(const uint8_t* data, size_t data_size,
+                             int timestamp)>& on_frame) {
+  std::ifstream input_list(list_filename);
+  if (!input_list.is_open()) {
+    std::cerr << "Failed to open frame list " << list_filename << std::endl;
+    return kGenericError;
+  }
+
+  std::string filename;
+  int timestamp;
+  while (input_list >> filename >> timestamp) {
+    const uint8_t* data = NULL;
+    size_t data_size = 0;
+    if (!ImgIoUtilReadFile(filename.c_str(), &data, &data_size)) {
+      std::cerr << "Failed to read image " << filename << std::endl;
+      return kGenericError;
+    }
+    const bool ok = on_frame(data, data_size, timestamp);
+    free((void*)data);
+    if (!ok) return kGenericError;
+  }
+  return kOk;
+}
+
+namespace {
+
+struct TIFFPagesParams {
+  const FrameCallback* on_frame;
+  int frame_duration_ms;
+  bool frame_rejected;  // Set if 'on_frame' returned false.
+};
+
+int AddTIFFPage(WebPPicture* const pic, int page, void* const user_data) {
+  TIFFPagesParams* const params = static_cast<TIFFPagesParams*>(user_data);
+  // Take ownership of the decoded pixels.
+  Frame frame = {EnclosedWebPPicture(new WebPPicture(*pic), WebPPictureDelete),
+                 (page + 1) * params->frame_duration_ms};
+  params->frame_rejected = !(*params->on_frame)(std::move(frame));
+  return !params->frame_rejected;
+}
+
+}  // namespace
+
+UtilsStatus ReadAnimatedImage(const char* const filename,
+                              int frame_duration_ms,
+                              const FrameCallback& on_frame) {
+  const uint8_t* data = NULL;
+  size_t data_size = 0;
+  if (!ImgIoUtilReadFile(filename, &data, &data_size)) return kGenericError;
+  std::unique_ptr<const uint8_t, void (*)(const uint8_t*)> data_holder(
+      data, [](const uint8_t* ptr) { free((void*)ptr); });
+
+  switch (WebPGuessImageType(data, data_size)) {
+    case WEBP_WEBP_FORMAT: {
+      WebPData webp_data = {data, data_size};
+      return AnimData2Frames(&webp_data, on_frame);
+    }
+    case WEBP_TIFF_FORMAT: {
+      TIFFPagesParams params = {&on_frame, frame_duration_ms,
+                                /*frame_rejected=*/false};
+      if (ReadTIFFPages(data, data_size, /*keep_alpha=*/1, AddTIFFPage,
+                        &params) < 0 ||
+          params.frame_rejected) {
+        std::cerr << "Failed to read TIFF pages from " << filename
+                  << std::endl;
+        return kGenericError;
+      }
+      return kOk;
+    }
+    default:
+      std::cerr << "Unsupported frame source " << filename << std::endl;
+      return kGenericError;
+  }
+}
+
+UtilsStatus ReadFrames(const char* const filename, int frame_duration_ms,
+                       const FrameCallback& on_frame) {
+  // Only the magic bytes are needed to tell a frame list from an image.
+  uint8_t header[12];
+  std::ifstream input(filename, std::ios::binary);
+  if (!input.is_open()) {
+    std::cerr << "Failed to open " << filename << std::endl;
+    return kGenericError;
+  }
+  input.read(reinterpret_cast<char*>(header), sizeof(header));
+  const WebPInputFileFormat format =
+      WebPGuessImageType(header, input.gcount());
+  input.close();
+
+  if (format == WEBP_WEBP_FORMAT || format == WEBP_TIFF_FORMAT) {
+    return ReadAnimatedImage(filename, frame_duration_ms, on_frame);
+  }
+  return ReadFrameList(filename, on_frame);
+}
+
+UtilsStatus ReadFrames(const char* const filename, int frame_duration_ms,
+                       std::vector<Frame>* const frames) {
+  return ReadFrames(filename, frame_duration_ms, [frames](Frame frame) {
+    frames->push_back(std::move(frame));
+    return true;
+  });
+}
+
+UtilsStatus ReadPNMStream(int fd, int frame_duration_ms,
+                          const FrameCallback& on_frame) {
+  // 1 MB is enough for a header or a row of any supported PNM image.
+  static const size_t kPNMStreamBufferSize = 1 << 20;
+  std::unique_ptr<PNMStream, void (*)(PNMStream*)> stream(
+      PNMStreamNew(fd, kPNMStreamBufferSize), PNMStreamDelete);
+  if (stream == nullptr) return kMemoryError;
+
+  for (int num_frames = 0;; ++num_frames) {
+    Frame frame = {EnclosedWebPPicture(new WebPPicture, WebPPictureDelete),
+                   (num_frames + 1) * frame_duration_ms};
+    if (!WebPPictureInit(frame.pic.get())) return kMemoryError;
+    frame.pic->use_argb = 1;
+
+    const int status =
+        PNMStreamReadNext(stream.get(), frame.pic.get(), /*keep_alpha=*/1);
+    if (status == 0) break;  // End of stream.
+    if (status < 0) {
+      std::cerr << "Failed to read frame " << num_frames
+                << " from PNM stream." << std::endl;
+      return kGenericError;
+    }
+    if (!on_frame(std::move(frame))) return kGenericError;
   }
   return kOk;
 }
@@ -147,8 +315,20 @@ UtilsStatus CompareThumbnail(const std::vector<Frame>& original_frames,
   ThumbnailStatsPSNR stats_1, stats_2;
   CHECK_UTILS_STATUS(AnimData2PSNR(original_frames, webp_data_1, &stats_1));
   CHECK_UTILS_STATUS(AnimData2PSNR(original_frames, webp_data_2, &stats_2));
+  return DiffThumbnailPSNR(stats_1, stats_2, diff);
+}
+
+UtilsStatus DiffThumbnailPSNR(const ThumbnailStatsPSNR& stats_1,
+                              const ThumbnailStatsPSNR& stats_2,
+                              ThumbnailDiffPSNR* const diff) {
+  if (diff == nullptr) return kMemoryError;
+  if (stats_1.psnr.empty() || stats_1.psnr.size() != stats_2.psnr.size()) {
+    std::cerr << "Thumbnails have different frame counts." << std::endl;
+    return kGenericError;
+  }
 
-  const int frame_count = original_frames.size();
+  const int frame_count = stats_1.psnr.size();
+  diff->psnr_diff.clear();
   for (int i = 0; i < frame_count; ++i) {
     diff->psnr_diff.push_back(stats_2.psnr[i] - stats_1.psnr[i]);
   }
@@ -166,6 +346,85 @@ UtilsStatus CompareThumbnail(const std::vector<Frame>& original_frames,
   return kOk;
 }
 
+namespace {
+
+// Fits log(size) as a polynomial of PSNR by least squares. Returns false if
+// there are less than two distinct PSNR values.
+bool FitLogSize(std::vector<RDPoint> points, std::vector<double>* const coeffs,
+                double* const min_psnr, double* const max_psnr) {
+  std::sort(points.begin(), points.end(),
+            [](const RDPoint& a, const RDPoint& b) { return a.psnr < b.psnr; });
+  int num_distinct = 0;
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    if (points[i].size <= 0) return false;
+    if (i == 0 || points[i].psnr != points[i - 1].psnr) ++num_distinct;
+  }
+  if (num_distinct < 2) return false;
+  *min_psnr = points.front().psnr;
+  *max_psnr = points.back().psnr;
+
+  // Normal equations of the least squares problem, solved by Gaussian
+  // elimination with partial pivoting.
+  const int n = std::min(num_distinct - 1, 3) + 1;
+  std::vector<std::vector<double>> m(n, std::vector<double>(n + 1, 0.));
+  for (const RDPoint& point : points) {
+    std::vector<double> powers(2 * n - 1, 1.);
+    for (int k = 1; k < 2 * n - 1; ++k) powers[k] = powers[k - 1] * point.psnr;
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) m[i][j] += powers[i + j];
+      m[i][n] += powers[i] * std::log(point.size);
+    }
+  }
+  for (int col = 0; col < n; ++col) {
+    int pivot = col;
+    for (int row = col + 1; row < n; ++row) {
+      if (std::fabs(m[row][col]) > std::fabs(m[pivot][col])) pivot = row;
+    }
+    if (m[pivot][col] == 0.) return false;
+    std::swap(m[col], m[pivot]);
+    for (int row = 0; row < n; ++row) {
+      if (row == col) continue;
+      const double factor = m[row][col] / m[col][col];
+      for (int k = col; k <= n; ++k) m[row][k] -= factor * m[col][k];
+    }
+  }
+  coeffs->resize(n);
+  for (int i = 0; i < n; ++i) (*coeffs)[i] = m[i][n] / m[i][i];
+  return true;
+}
+
+// Returns the integral of the polynomial 'coeffs' over [low, high].
+double Integrate(const std::vector<double>& coeffs, double low, double high) {
+  double integral = 0.;
+  for (std::size_t k = 0; k < coeffs.size(); ++k) {
+    integral += coeffs[k] * (std::pow(high, k + 1) - std::pow(low, k + 1)) /
+                (k + 1);
+  }
+  return integral;
+}
+
+}  // namespace
+
+UtilsStatus BDRate(const std::vector<RDPoint>& reference,
+                   const std::vector<RDPoint>& test, double* const bd_rate) {
+  if (bd_rate == nullptr) return kMemoryError;
+  std::vector<double> ref_coeffs, test_coeffs;
+  double ref_min, ref_max, test_min, test_max;
+  if (!FitLogSize(reference, &ref_coeffs, &ref_min, &ref_max) ||
+      !FitLogSize(test, &test_coeffs, &test_min, &test_max)) {
+    return kGenericError;
+  }
+  const double low = std::max(ref_min, test_min);
+  const double high = std::min(ref_max, test_max);
+  if (high <= low) return kGenericError;
+
+  const double mean_log_diff = (Integrate(test_coeffs, low, high) -
+                                Integrate(ref_coeffs, low, high)) /
+                               (high - low);
+  *bd_rate = (std::exp(mean_log_diff) - 1.) * 100.;
+  return kOk;
+}
+
 void PrintThumbnailStatsPSNR(const ThumbnailStatsPSNR& stats,
                              const UtilsOption& option) {
   if (stats.psnr.empty()) return;
@@ -21,6 +21,7 @@
 #include <string.h>
 
 #include <algorithm>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
@@ -60,6 +61,10 @@ struct Frame {
   int timestamp;  // Ending timestamp in milliseconds.
 };
 
+// Receives the frames one at a time as they are read, which lets the caller
+// decide whether to keep them. Returning false stops reading with an error.
+typedef std::function<bool(Frame frame)> FrameCallback;
+
 // Stores the PSNR values for a thumbnail with various statistics.
 struct ThumbnailStatsPSNR {
   std::vector<float> psnr;
@@ -76,6 +81,12 @@ struct ThumbnailDiffPSNR {
   float median_psnr_diff;
 };
 
+// A rate-distortion point: the size of a thumbnail and its mean PSNR.
+struct RDPoint {
+  double size;  // In bytes.
+  double psnr;
+};
+
 // Reads file into WebPPicture. Returns true on success and false on failure.
 bool ReadPicture(const char* const filename, WebPPicture* const pic);
 
@@ -84,9 +95,43 @@ void WebPPictureDelete(WebPPicture* picture);
 void WebPDataDelete(WebPData* webp_data);
 
 // Converts WebPData (animation) into Frame(s).
+UtilsStatus AnimData2Frames(WebPData* const webp_data,
+                            const FrameCallback& on_frame);
 UtilsStatus AnimData2Frames(WebPData* const webp_data,
                             std::vector<Frame>* const pics);
 
+// Reads the frames described in 'list_filename'. Each line of the list
+// contains the frame's filename and its ending timestamp in milliseconds.
+UtilsStatus ReadFrameList(const char* const list_filename,
+                          const FrameCallback& on_frame);
+
+// Reads the files listed in 'list_filename' (see ReadFrameList()) without
+// decoding them, passing their content and timestamp to 'on_frame'.
+UtilsStatus ReadEncodedFrameList(
+    const char* const list_filename,
+    const std::function<bool(const uint8_t* data, size_t data_size,
+                             int timestamp)>& on_frame);
+
+// Reads all the frames of a single animated WebP or multi-page TIFF file.
+// WebP frames keep the timestamps stored in the container. TIFF has no timing
+// information, so its pages are spaced 'frame_duration_ms' apart.
+UtilsStatus ReadAnimatedImage(const char* const filename,
+                              int frame_duration_ms,
+                              const FrameCallback& on_frame);
+
+// Reads frames from 'filename', which is either a frame list or a WebP/TIFF
+// file used as the complete frame source (see ReadAnimatedImage()).
+UtilsStatus ReadFrames(const char* const filename, int frame_duration_ms,
+                       const FrameCallback& on_frame);
+UtilsStatus ReadFrames(const char* const filename, int frame_duration_ms,
+                       std::vector<Frame>* const frames);
+
+// Reads concatenated PNM images from the file descriptor 'fd', e.g. the
+// 'image2pipe' output of ffmpeg, spacing them 'frame_duration_ms' apart. Each
+// frame is passed to 'on_frame' as soon as it is decoded.
+UtilsStatus ReadPNMStream(int fd, int frame_duration_ms,
+                          const FrameCallback& on_frame);
+
 // Takes WebPData having original_frames as source, calls AnimData2Frames.
 // Records PSNR values for every WebPPicture and various PSNR stats.
 UtilsStatus AnimData2PSNR(const std::vector<Frame>& original_frames,
@@ -101,6 +146,21 @@ UtilsStatus CompareThumbnail(const std::vector<Frame>& original_frames,
                              WebPData* const webp_data_2,
                              ThumbnailDiffPSNR* const stats);
 
+// Same as above, from the PSNR values of the two thumbnails, so that a
+// thumbnail compared to several others is only decoded once.
+UtilsStatus DiffThumbnailPSNR(const ThumbnailStatsPSNR& stats_1,
+                              const ThumbnailStatsPSNR& stats_2,
+                              ThumbnailDiffPSNR* const diff);
+
+// Computes the Bjontegaard delta rate of 'test' with respect to 'reference':
+// the mean size difference in percent at equal PSNR, over the PSNR range
+// covered by both curves. The logarithm of the size is fitted as a polynomial
+// of the PSNR, cubic if there are at least four points of distinct PSNR.
+// Returns kGenericError if a curve has less than two such points or if the
+// curves do not overlap.
+UtilsStatus BDRate(const std::vector<RDPoint>& reference,
+                   const std::vector<RDPoint>& test, double* const bd_rate);
+
 void PrintThumbnailStatsPSNR(const ThumbnailStatsPSNR& stats,
                              const UtilsOption& option);
 
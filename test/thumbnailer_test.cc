@@ -14,8 +14,23 @@
 
 #include "../src/thumbnailer.h"
 
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fstream>
 #include <random>
+#include <thread>
 
+#include "../imageio/pnmdec.h"
+#include "../imageio/tiffdec.h"
+#include "../src/picture_cache.h"
+#include "../src/thumbnailer_batch.h"
+#include "../src/thumbnailer_server.h"
+#include "../src/tracer.h"
+#include "../src/utils/synthetic_frames.h"
 #include "../src/utils/thumbnailer_utils.h"
 #include "gtest/gtest.h"
 
@@ -93,6 +108,41 @@ class WebPTestGenerator {
   }
 };
 
+// Adds the first 'count' pictures of 'pics' to 'thumbnailer', 500 ms apart
+// starting at 'first_timestamp_ms'. The pictures are borrowed, so 'pics' must
+// outlive 'thumbnailer'.
+libwebp::Thumbnailer::Status AddTestFrames(
+    libwebp::Thumbnailer* const thumbnailer,
+    const std::vector<EnclosedWebPPicture>& pics, int count,
+    int first_timestamp_ms = 0) {
+  for (int i = 0; i < count; ++i) {
+    const libwebp::Thumbnailer::Status status =
+        thumbnailer->AddFrame(*pics[i], first_timestamp_ms + i * 500);
+    if (status != libwebp::Thumbnailer::kOk) return status;
+  }
+  return libwebp::Thumbnailer::kOk;
+}
+
+// WebPData cleared when going out of scope.
+class ScopedWebPData {
+ public:
+  ScopedWebPData() { WebPDataInit(&data_); }
+  ScopedWebPData(const ScopedWebPData&) = delete;
+  ScopedWebPData& operator=(const ScopedWebPData&) = delete;
+  ~ScopedWebPData() { WebPDataClear(&data_); }
+
+  WebPData* get() { return &data_; }
+  WebPData* operator->() { return &data_; }
+  const WebPData* operator->() const { return &data_; }
+
+  std::vector<uint8_t> bytes() const {
+    return std::vector<uint8_t>(data_.bytes, data_.bytes + data_.size);
+  }
+
+ private:
+  WebPData data_;
+};
+
 class GenerateAnimationTest
     : public ::testing::TestWithParam<
           std::tuple<int, uint8_t, bool, libwebp::Thumbnailer::Method>> {};
@@ -127,6 +177,1230 @@ INSTANTIATE_TEST_CASE_P(
                        ::testing::Values(false, true),
                        ::testing::ValuesIn(libwebp::Thumbnailer::kMethodList)));
 
+TEST(ThumbnailerTest, EncodedFramesWithMemoryLimit) {
+  const int pic_count = 10;
+  thumbnailer::ThumbnailerOption option;
+  // Room for about two decoded frames.
+  option.set_memory_limit(2 * kDefaultWidth * kDefaultHeight * 4);
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, true).GeneratePics();
+  for (int i = 0; i < pic_count; ++i) {
+    WebPConfig config;
+    ASSERT_TRUE(WebPConfigInit(&config));
+    config.lossless = 1;
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    pics[i]->writer = WebPMemoryWrite;
+    pics[i]->custom_ptr = &writer;
+    ASSERT_TRUE(WebPEncode(&config, pics[i].get()));
+    EXPECT_EQ(thumbnailer.AddEncodedFrame(writer.mem, writer.size, i * 500),
+              libwebp::Thumbnailer::kOk);
+    WebPMemoryWriterClear(&writer);
+  }
+  // The thumbnailer does not need the pictures anymore.
+  pics.clear();
+
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_LE(webp_data->size, kDefaultBudget);
+  EXPECT_GT(webp_data->size, 0);
+}
+
+TEST(ThumbnailerTest, PictureCacheBoundWithoutLimit) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/6, 0xff, true).GeneratePics();
+  libwebp::PictureCache cache;  // No memory limit.
+  std::vector<int> ids;
+  for (const EnclosedWebPPicture& pic : pics) {
+    ids.push_back(cache.AddCompressed(*pic));
+    ASSERT_GE(ids.back(), 0);
+  }
+  // A handle keeps its picture valid after eviction.
+  const libwebp::PictureCache::Handle first = cache.Get(ids[0]);
+  ASSERT_NE(first, nullptr);
+  for (int i = 1; i < 6; ++i) ASSERT_NE(cache.Get(ids[i]), nullptr);
+  EXPECT_EQ(cache.stats().num_decodes, 6);
+  EXPECT_EQ(cache.stats().num_hits, 0);
+
+  // The most recent pictures are still decoded, the oldest ones are not.
+  ASSERT_NE(cache.Get(ids[5]), nullptr);
+  ASSERT_NE(cache.Get(ids[4]), nullptr);
+  EXPECT_EQ(cache.stats().num_hits, 2);
+  EXPECT_EQ(cache.stats().num_decodes, 6);
+  ASSERT_NE(cache.Get(ids[0]), nullptr);
+  EXPECT_EQ(cache.stats().num_decodes, 7);
+  EXPECT_EQ(first->width, kDefaultWidth);
+
+  // Borrowed pictures are neither decoded nor evicted.
+  const int borrowed_id = cache.AddBorrowed(*pics[0]);
+  EXPECT_EQ(cache.Get(borrowed_id).get(), pics[0].get());
+  EXPECT_EQ(cache.stats().num_decodes, 7);
+}
+
+TEST(ThumbnailerTest, OutputCacheHit) {
+  const std::string cache_dir =
+      ::testing::TempDir() + "thumbnailer_test_cache_" +
+      std::to_string(getpid());
+  libwebp::OutputCache output_cache(cache_dir, /*max_size=*/1 << 20);
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+
+  std::vector<std::vector<uint8_t>> animations;
+  for (int run = 0; run < 2; ++run) {
+    libwebp::Thumbnailer thumbnailer;
+    ASSERT_EQ(thumbnailer.SetOutputCache(&output_cache),
+              libwebp::Thumbnailer::kOk);
+    ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+    ScopedWebPData webp_data;
+    ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+    animations.push_back(webp_data.bytes());
+    EXPECT_EQ(thumbnailer.stats().output_cache_hit(), run == 1);
+  }
+  // The second run is answered by the cache.
+  EXPECT_EQ(animations[0], animations[1]);
+}
+
+TEST(ThumbnailerTest, OutputCacheKeyIgnoresEdits) {
+  const std::string cache_dir =
+      ::testing::TempDir() + "thumbnailer_test_edit_cache_" +
+      std::to_string(getpid());
+  libwebp::OutputCache output_cache(cache_dir, /*max_size=*/1 << 20);
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(thumbnailer.SetOutputCache(&output_cache),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  const std::vector<uint8_t> animation = webp_data.bytes();
+
+  // The same frames, added in another order and after edits, hit the cache.
+  libwebp::Thumbnailer edited;
+  ASSERT_EQ(edited.SetOutputCache(&output_cache), libwebp::Thumbnailer::kOk);
+  for (int i = 4; i >= 1; --i) {
+    ASSERT_EQ(edited.AddFrame(*pics[i], i * 500), libwebp::Thumbnailer::kOk);
+  }
+  ASSERT_EQ(edited.AddFrame(*pics[1], 0), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(edited.AddFrame(*pics[2], 3000), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(edited.RemoveFrame(3000), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(edited.ReplaceFrame(*pics[0], 0), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(edited.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_TRUE(edited.stats().output_cache_hit());
+  EXPECT_EQ(webp_data.bytes(), animation);
+
+  // An incremental regeneration neither looks up nor stores its result.
+  ASSERT_EQ(thumbnailer.RemoveFrame(2000), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(thumbnailer.RegenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_FALSE(thumbnailer.stats().output_cache_hit());
+  libwebp::Thumbnailer fresh;
+  ASSERT_EQ(fresh.SetOutputCache(&output_cache), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(AddTestFrames(&fresh, pics, 4), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(fresh.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_FALSE(fresh.stats().output_cache_hit());
+}
+
+TEST(ThumbnailerTest, OutputCacheKeyCoversFirstDuration) {
+  const std::string cache_dir =
+      ::testing::TempDir() + "thumbnailer_test_window_cache_" +
+      std::to_string(getpid());
+  libwebp::OutputCache output_cache(cache_dir, /*max_size=*/1 << 20);
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/4, 0xff, true).GeneratePics();
+  thumbnailer::ThumbnailerOption option;
+  option.set_window_ms(1000);
+
+  // Both windows keep the same frames, ending at 1500 and 2000 ms, but the
+  // first one starts at 1000 ms and the second one at 200 ms.
+  const std::vector<int> evicted_timestamps[2] = {{500, 1000}, {200}};
+  std::vector<std::vector<uint8_t>> animations;
+  for (int run = 0; run < 2; ++run) {
+    libwebp::Thumbnailer thumbnailer(option);
+    ASSERT_EQ(thumbnailer.SetOutputCache(&output_cache),
+              libwebp::Thumbnailer::kOk);
+    for (int timestamp_ms : evicted_timestamps[run]) {
+      ASSERT_EQ(thumbnailer.AddFrame(*pics[0], timestamp_ms),
+                libwebp::Thumbnailer::kOk);
+    }
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[2], 1500), libwebp::Thumbnailer::kOk);
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[3], 2000), libwebp::Thumbnailer::kOk);
+    ScopedWebPData webp_data;
+    ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_FALSE(thumbnailer.stats().output_cache_hit());
+    animations.push_back(webp_data.bytes());
+  }
+
+  // The first frame lasts from the start of the window.
+  WebPData animation = {animations[1].data(), animations[1].size()};
+  std::vector<libwebp::Frame> frames;
+  ASSERT_EQ(libwebp::AnimData2Frames(&animation, &frames), libwebp::kOk);
+  ASSERT_EQ(frames.size(), 2u);
+  EXPECT_EQ(frames[0].timestamp, 1500 - 200);
+}
+
+TEST(ThumbnailerTest, OutputCacheDeletesStaleTempFiles) {
+  const std::string cache_dir =
+      ::testing::TempDir() + "thumbnailer_test_temp_cache_" +
+      std::to_string(getpid());
+  ASSERT_EQ(mkdir(cache_dir.c_str(), 0755), 0);
+  // Left by writers that crashed long ago and just now.
+  const std::string stale_path = cache_dir + "/stale.webp.tmp1_1";
+  const std::string recent_path = cache_dir + "/recent.webp.tmp1_2";
+  std::ofstream(stale_path) << std::string(100, 'x');
+  std::ofstream(recent_path) << std::string(100, 'x');
+  const struct timespec old_times[2] = {{1000, 0}, {1000, 0}};
+  ASSERT_EQ(utimensat(AT_FDCWD, stale_path.c_str(), old_times, 0), 0);
+
+  libwebp::OutputCache output_cache(cache_dir, /*max_size=*/150);
+  EXPECT_NE(access(stale_path.c_str(), F_OK), 0);
+  EXPECT_EQ(access(recent_path.c_str(), F_OK), 0);
+
+  // The recent temporary file counts towards the limit, so the new entry
+  // is evicted right away.
+  const std::vector<uint8_t> data(60, 1);
+  ASSERT_TRUE(output_cache.Store("entry", data.data(), data.size()));
+  std::vector<uint8_t> stored;
+  EXPECT_FALSE(output_cache.Lookup("entry", &stored));
+}
+
+TEST(ThumbnailerTest, WriteAnimation) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xaf, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5, /*first_timestamp_ms=*/500),
+            libwebp::Thumbnailer::kOk);
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get(),
+                                          libwebp::Thumbnailer::kEqualPSNR),
+            libwebp::Thumbnailer::kOk);
+
+  // To a regular file, the RIFF size being patched at the end.
+  const std::string path = ::testing::TempDir() + "thumbnailer_test_stream_" +
+                           std::to_string(getpid()) + ".webp";
+  const int file_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(file_fd, 0);
+  EXPECT_EQ(thumbnailer.WriteAnimation(file_fd), libwebp::Thumbnailer::kOk);
+  std::vector<uint8_t> file_bytes(webp_data->size + 1);
+  EXPECT_EQ(pread(file_fd, file_bytes.data(), file_bytes.size(), 0),
+            ssize_t(webp_data->size));
+  file_bytes.resize(webp_data->size);
+  close(file_fd);
+  remove(path.c_str());
+  EXPECT_EQ(file_bytes, webp_data.bytes());
+
+  // To a pipe, the RIFF size being computed up front.
+  int pipe_fds[2];
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  std::vector<uint8_t> pipe_bytes;
+  std::thread reader([&pipe_bytes, &pipe_fds]() {
+    uint8_t buffer[4096];
+    ssize_t size;
+    while ((size = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) {
+      pipe_bytes.insert(pipe_bytes.end(), buffer, buffer + size);
+    }
+  });
+  EXPECT_EQ(thumbnailer.WriteAnimation(pipe_fds[1]),
+            libwebp::Thumbnailer::kOk);
+  close(pipe_fds[1]);
+  reader.join();
+  close(pipe_fds[0]);
+  EXPECT_EQ(pipe_bytes, webp_data.bytes());
+
+  WebPData streamed = {pipe_bytes.data(), pipe_bytes.size()};
+  std::vector<libwebp::Frame> frames;
+  ASSERT_EQ(libwebp::AnimData2Frames(&streamed, &frames), libwebp::kOk);
+  ASSERT_EQ(frames.size(), 5u);
+  for (int i = 0; i < 5; ++i) EXPECT_EQ(frames[i].timestamp, (i + 1) * 500);
+
+  // Without assembling the animation in memory, only its size is returned,
+  // and the same animation is streamed.
+  libwebp::Thumbnailer streaming;
+  streaming.SetStreamOutput(true);
+  ASSERT_EQ(AddTestFrames(&streaming, pics, 5, /*first_timestamp_ms=*/500),
+            libwebp::Thumbnailer::kOk);
+  ScopedWebPData sized_data;
+  ASSERT_EQ(streaming.GenerateAnimation(sized_data.get(),
+                                        libwebp::Thumbnailer::kEqualPSNR),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(sized_data->bytes, nullptr);
+  EXPECT_EQ(sized_data->size, webp_data->size);
+  const int streaming_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(streaming_fd, 0);
+  EXPECT_EQ(streaming.WriteAnimation(streaming_fd), libwebp::Thumbnailer::kOk);
+  file_bytes.assign(webp_data->size + 1, 0);
+  EXPECT_EQ(pread(streaming_fd, file_bytes.data(), file_bytes.size(), 0),
+            ssize_t(webp_data->size));
+  file_bytes.resize(webp_data->size);
+  close(streaming_fd);
+  remove(path.c_str());
+  EXPECT_EQ(file_bytes, webp_data.bytes());
+
+  // A new frame has no encoding from the search.
+  ASSERT_EQ(thumbnailer.AddFrame(*pics[0], 3000), libwebp::Thumbnailer::kOk);
+  const int null_fd = open("/dev/null", O_WRONLY);
+  ASSERT_GE(null_fd, 0);
+  EXPECT_EQ(thumbnailer.WriteAnimation(null_fd),
+            libwebp::Thumbnailer::kGenericError);
+  close(null_fd);
+}
+
+TEST(ThumbnailerTest, Stats) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5, /*first_timestamp_ms=*/500),
+            libwebp::Thumbnailer::kOk);
+  ScopedWebPData webp_data;
+  // Other work of the process, such as these threads, is not counted in the
+  // CPU times of the job.
+  std::atomic<bool> done(false);
+  std::vector<std::thread> busy_threads;
+  for (int i = 0; i < 2; ++i) {
+    busy_threads.emplace_back([&done]() {
+      while (!done) {
+      }
+    });
+  }
+  const libwebp::Thumbnailer::Status status = thumbnailer.GenerateAnimation(
+      webp_data.get(), libwebp::Thumbnailer::kEqualPSNR);
+  done = true;
+  for (std::thread& thread : busy_threads) thread.join();
+  ASSERT_EQ(status, libwebp::Thumbnailer::kOk);
+
+  const thumbnailer::ThumbnailerStats& stats = thumbnailer.stats();
+  // The calling thread accounts for at most the wall time, the workers for
+  // the encodings.
+  double wall_ms = 0., cpu_ms = 0.;
+  for (const auto& phase : stats.phases()) {
+    if (phase.name() == "decode" || phase.name() == "assembly") continue;
+    wall_ms += phase.wall_ms();
+    cpu_ms += phase.cpu_ms();
+  }
+  EXPECT_LE(cpu_ms, wall_ms + stats.encode_cpu_ms() + 1.);
+  EXPECT_GT(stats.num_encodes(), 0);
+  EXPECT_GT(stats.num_assemblies(), 0);
+  EXPECT_GT(stats.rd_cache_misses(), 0);
+  EXPECT_FALSE(stats.output_cache_hit());
+  EXPECT_EQ(stats.animation_size(), webp_data->size);
+  std::vector<std::string> phases;
+  for (const auto& phase : stats.phases()) phases.push_back(phase.name());
+  EXPECT_NE(std::find(phases.begin(), phases.end(), "equal_psnr"),
+            phases.end());
+  ASSERT_EQ(stats.frames_size(), 5);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(stats.frames(i).timestamp_ms(), (i + 1) * 500);
+    EXPECT_GT(stats.frames(i).size(), 0u);
+  }
+}
+
+TEST(ThumbnailerTest, SharedRDCache) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  const int num_methods = 5;
+  libwebp::RDCache rd_cache;
+  std::vector<std::vector<uint8_t>> animations[2];
+  int num_measures[2] = {0, 0};
+  int num_shared_hits = 0;
+  // One thumbnailer per method, first on their own, then concurrently with
+  // the shared cache.
+  for (int shared = 0; shared < 2; ++shared) {
+    animations[shared].resize(num_methods);
+    std::vector<thumbnailer::ThumbnailerStats> stats(num_methods);
+    std::vector<std::thread> threads;
+    for (int m = 0; m < num_methods; ++m) {
+      auto run = [&, shared, m]() {
+        libwebp::Thumbnailer thumbnailer;
+        if (shared) {
+          ASSERT_EQ(thumbnailer.SetRDCache(&rd_cache),
+                    libwebp::Thumbnailer::kOk);
+        }
+        ASSERT_EQ(
+            AddTestFrames(&thumbnailer, pics, 5, /*first_timestamp_ms=*/500),
+            libwebp::Thumbnailer::kOk);
+        ScopedWebPData webp_data;
+        ASSERT_EQ(thumbnailer.GenerateAnimation(
+                      webp_data.get(), libwebp::Thumbnailer::kMethodList[m]),
+                  libwebp::Thumbnailer::kOk);
+        animations[shared][m] = webp_data.bytes();
+        stats[m] = thumbnailer.stats();
+      };
+      if (shared) {
+        threads.emplace_back(run);
+      } else {
+        run();
+      }
+    }
+    for (std::thread& thread : threads) thread.join();
+    for (const thumbnailer::ThumbnailerStats& s : stats) {
+      num_measures[shared] += s.rd_cache_misses();
+      if (shared) num_shared_hits += s.shared_rd_cache_hits();
+    }
+  }
+  // Sharing the measurements does not change the animations.
+  for (int m = 0; m < num_methods; ++m) {
+    EXPECT_EQ(animations[0][m], animations[1][m]);
+  }
+  EXPECT_GT(num_shared_hits, 0);
+  EXPECT_LT(num_measures[1], num_measures[0]);
+  EXPECT_GT(rd_cache.size(), 0u);
+}
+
+TEST(ThumbnailerTest, RDCacheEviction) {
+  libwebp::RDCache rd_cache(/*max_points=*/2);
+  libwebp::RDCache::Point point;
+  for (const char* const key : {"a", "b"}) {
+    ASSERT_FALSE(rd_cache.Lookup(key, &point));
+    rd_cache.Insert(key, {1, 30.f});
+  }
+  // "a" becomes the most recently used point, so "b" is evicted.
+  EXPECT_TRUE(rd_cache.Lookup("a", &point));
+  ASSERT_FALSE(rd_cache.Lookup("c", &point));
+  rd_cache.Insert("c", {3, 40.f});
+  EXPECT_EQ(rd_cache.size(), 2u);
+  EXPECT_TRUE(rd_cache.Lookup("a", &point));
+  EXPECT_TRUE(rd_cache.Lookup("c", &point));
+  EXPECT_EQ(point.size, 3u);
+  EXPECT_FALSE(rd_cache.Lookup("b", &point));
+  rd_cache.Abandon("b");
+  EXPECT_EQ(rd_cache.size(), 2u);
+}
+
+// Upper bounds on the work done by a method, derived from its search loops
+// (e.g. a binary search over [0, 100] takes at most 7 probes). Encodes are
+// given per frame.
+struct EncodeBounds {
+  libwebp::Thumbnailer::Method method;
+  int encodes_per_frame;
+  int assemblies;
+};
+
+// kEqualQuality: 7 probes, the encoding of the final quality and the PSNR
+// measures, with 7 + 1 assemblies.
+// kEqualPSNR: kEqualQuality, then a single PSNR target since all frames are
+// identical: qualities 0 and 100, 7 probes and one assembly.
+// kNearllEqual: kEqualQuality, near-lossless 0, its assembly, 3 probes over
+// the preprocessing values and the final assembly.
+// kNearllDiff: kEqualQuality, near-lossless 0 and 3 probes per frame, one
+// assembly.
+// kSlopeOptim: median slope (1 + 7), 7 probes of 2 slope measures and an
+// assembly, kNearllEqual's pass, 5 passes of 5 probes and an assembly, then
+// 7 probes of kEqualQuality and the PSNR measures.
+const EncodeBounds kEncodeBounds[] = {
+    {libwebp::Thumbnailer::kEqualQuality, 9, 8},
+    {libwebp::Thumbnailer::kEqualPSNR, 19, 9},
+    {libwebp::Thumbnailer::kNearllEqual, 15, 10},
+    {libwebp::Thumbnailer::kNearllDiff, 14, 9},
+    {libwebp::Thumbnailer::kSlopeOptim, 73, 21},
+};
+
+class EncodeCountTest
+    : public ::testing::TestWithParam<libwebp::Thumbnailer::Method> {};
+
+// Extra encodes rarely change the output, so they are caught by counting.
+TEST_P(EncodeCountTest, IsBounded) {
+  const libwebp::Thumbnailer::Method method = GetParam();
+  const EncodeBounds* bounds = nullptr;
+  for (const EncodeBounds& b : kEncodeBounds) {
+    if (b.method == method) bounds = &b;
+  }
+  ASSERT_NE(bounds, nullptr);
+
+  // The same picture for all frames, so that the frames share a PSNR.
+  const int pic_count = 5;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/1, 0xff, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[0], (i + 1) * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get(), method),
+            libwebp::Thumbnailer::kOk);
+
+  const thumbnailer::ThumbnailerStats& stats = thumbnailer.stats();
+  EXPECT_GT(stats.num_encodes(), 0);
+  EXPECT_LE(stats.num_encodes(), bounds->encodes_per_frame * pic_count);
+  EXPECT_GT(stats.num_assemblies(), 0);
+  EXPECT_LE(stats.num_assemblies(), bounds->assemblies);
+}
+
+INSTANTIATE_TEST_CASE_P(
+    ThumbnailerTest, EncodeCountTest,
+    ::testing::ValuesIn(libwebp::Thumbnailer::kMethodList));
+
+TEST(ThumbnailerTest, Trace) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/3, 0xff, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 3, /*first_timestamp_ms=*/500),
+            libwebp::Thumbnailer::kOk);
+  ScopedWebPData webp_data;
+  libwebp::Tracer::Enable();
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get(),
+                                          libwebp::Thumbnailer::kSlopeOptim),
+            libwebp::Thumbnailer::kOk);
+  libwebp::Tracer::Disable();
+
+  const std::string path = ::testing::TempDir() + "thumbnailer_test_trace_" +
+                           std::to_string(getpid()) + ".json";
+  ASSERT_TRUE(libwebp::Tracer::WriteJson(path));
+  std::ifstream file(path);
+  const std::string trace((std::istreambuf_iterator<char>(file)),
+                          std::istreambuf_iterator<char>());
+  for (const char* name : {"\"traceEvents\"", "\"FindMedianSlope\"",
+                           "\"EncodeFrame\"", "\"AssembleAnimation\""}) {
+    EXPECT_NE(trace.find(name), std::string::npos) << name;
+  }
+  remove(path.c_str());
+}
+
+TEST(ThumbnailerTest, ResetReusesThumbnailer) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  std::vector<std::vector<uint8_t>> animations;
+  for (int run = 0; run < 2; ++run) {
+    // The second run has fewer frames than the first one.
+    thumbnailer.Reset();
+    ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5 - 2 * run),
+              libwebp::Thumbnailer::kOk);
+    ScopedWebPData webp_data;
+    ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+    animations.push_back(webp_data.bytes());
+  }
+
+  // A fresh thumbnailer gives the same animation as the reset one.
+  libwebp::Thumbnailer fresh_thumbnailer;
+  ASSERT_EQ(AddTestFrames(&fresh_thumbnailer, pics, 3),
+            libwebp::Thumbnailer::kOk);
+  ScopedWebPData webp_data;
+  ASSERT_EQ(fresh_thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(animations[1], webp_data.bytes());
+}
+
+TEST(ThumbnailerTest, ResetDoesNotAllocate) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  // Options serialized beyond the small string buffer, as the server and
+  // batch modes reset the thumbnailer with the options of each job.
+  thumbnailer::ThumbnailerOption option;
+  option.set_soft_max_size(kDefaultBudget);
+  option.set_hard_max_size(kDefaultBudget);
+  option.set_slope_dpsnr(1.5f);
+  option.set_loop_count(1);
+  option.set_min_lossy_quality(10);
+  libwebp::Thumbnailer thumbnailer;
+  auto run_job = [&thumbnailer, &pics, &option](bool with_options) {
+    if (with_options) {
+      thumbnailer.Reset(option);
+    } else {
+      thumbnailer.Reset();
+    }
+    ScopedWebPData webp_data;
+    return AddTestFrames(&thumbnailer, pics, 5) == libwebp::Thumbnailer::kOk &&
+           thumbnailer.GenerateAnimation(webp_data.get()) ==
+               libwebp::Thumbnailer::kOk;
+  };
+  // The first job sizes the buffers, and the first Reset() of a used
+  // thumbnailer keeps its frame records.
+  ASSERT_TRUE(run_job(/*with_options=*/true));
+  ASSERT_TRUE(run_job(/*with_options=*/true));
+
+  // The same job again makes no C++ allocation, with or without new options.
+  // Those of libwebp are only counted by builds tracking malloc().
+  libwebp::AllocScope alloc_scope;
+  for (bool with_options : {false, true}) {
+    alloc_scope.Start();
+    bool ok;
+    {
+      libwebp::ScopedAllocScope scoped_alloc(&alloc_scope);
+      ok = run_job(with_options);
+    }
+    ASSERT_TRUE(ok);
+    if (!libwebp::AllocTracker::TracksMalloc()) {
+      EXPECT_EQ(alloc_scope.counters().num_allocations, 0) << with_options;
+    }
+  }
+
+  // The scope does count, i.e. this test links the allocation hooks. Unlike
+  // new-expressions, direct calls cannot be optimized out.
+  {
+    libwebp::ScopedAllocScope scoped_alloc(&alloc_scope);
+    ::operator delete(::operator new(64));
+  }
+  EXPECT_EQ(alloc_scope.counters().num_allocations, 1);
+  EXPECT_EQ(alloc_scope.counters().current_bytes, 0);
+}
+
+TEST(ThumbnailerTest, ProgressAndCancellation) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  libwebp::CancellationToken token;
+  thumbnailer.SetCancellationToken(&token);
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+
+  // Cancel as soon as a first candidate animation is built.
+  libwebp::Thumbnailer::Progress last_progress = {"", 0, 0, 0.f};
+  thumbnailer.SetProgressCallback(
+      [&](const libwebp::Thumbnailer::Progress& progress) {
+        last_progress = progress;
+        if (progress.best_size > 0) token.Cancel();
+      });
+  ScopedWebPData webp_data;
+  EXPECT_EQ(thumbnailer.GenerateAnimation(webp_data.get(),
+                                          libwebp::Thumbnailer::kEqualPSNR),
+            libwebp::Thumbnailer::kCancelled);
+  EXPECT_GT(last_progress.num_probes, 0);
+  EXPECT_GT(last_progress.best_size, 0);
+}
+
+TEST(ThumbnailerTest, BudgetLadder) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  const std::vector<size_t> budgets = {150000, 30000, 60000};
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+  std::vector<WebPData> animations;
+  ASSERT_EQ(thumbnailer.GenerateAnimationLadder(budgets, &animations),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(animations.size(), budgets.size());
+
+  // Each rung matches an independent run with the same budget.
+  for (std::size_t i = 0; i < budgets.size(); ++i) {
+    EXPECT_LE(animations[i].size, budgets[i]);
+    thumbnailer::ThumbnailerOption option;
+    option.set_soft_max_size(budgets[i]);
+    libwebp::Thumbnailer single_thumbnailer(option);
+    ASSERT_EQ(AddTestFrames(&single_thumbnailer, pics, 5),
+              libwebp::Thumbnailer::kOk);
+    ScopedWebPData webp_data;
+    ASSERT_EQ(single_thumbnailer.GenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_EQ(webp_data->size, animations[i].size);
+    WebPDataClear(&animations[i]);
+  }
+}
+
+TEST(ThumbnailerTest, IncrementalEdits) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  std::vector<EnclosedWebPPicture> solid_pics =
+      WebPTestGenerator(/*pic_count=*/1, 0xff, false).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+
+  EXPECT_EQ(thumbnailer.RemoveFrame(/*timestamp_ms=*/42),
+            libwebp::Thumbnailer::kGenericError);
+  ASSERT_EQ(thumbnailer.RemoveFrame(1500), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(thumbnailer.ReplaceFrame(*solid_pics[0], 500),
+            libwebp::Thumbnailer::kOk);
+
+  // The smaller animation still fits with the previous configurations, so
+  // only the replaced frame is encoded.
+  int num_probes = -1;
+  thumbnailer.SetProgressCallback(
+      [&](const libwebp::Thumbnailer::Progress& progress) {
+        num_probes = progress.num_probes;
+      });
+  const size_t previous_size = webp_data->size;
+  ASSERT_EQ(thumbnailer.RegenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(num_probes, 1);
+  EXPECT_LT(webp_data->size, previous_size);
+}
+
+TEST(ThumbnailerTest, SlidingWindow) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/8, 0xff, false).GeneratePics();
+  thumbnailer::ThumbnailerOption option;
+  option.set_window_ms(2000);
+  libwebp::Thumbnailer thumbnailer(option);
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 6, /*first_timestamp_ms=*/500),
+            libwebp::Thumbnailer::kOk);
+  // Only the frames ending after 1000 ms are kept.
+  EXPECT_EQ(thumbnailer.RemoveFrame(1000),
+            libwebp::Thumbnailer::kGenericError);
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+
+  // Each refresh only encodes the frames pushed since the previous one.
+  int num_probes = -1;
+  thumbnailer.SetProgressCallback(
+      [&](const libwebp::Thumbnailer::Progress& progress) {
+        num_probes = progress.num_probes;
+      });
+  for (int i = 6; i < 8; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 500),
+              libwebp::Thumbnailer::kOk);
+    ASSERT_EQ(thumbnailer.RegenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_EQ(num_probes, 1);
+  }
+  EXPECT_EQ(thumbnailer.RemoveFrame(2000),
+            libwebp::Thumbnailer::kGenericError);
+  EXPECT_EQ(thumbnailer.RemoveFrame(2500), libwebp::Thumbnailer::kOk);
+}
+
+TEST(ThumbnailerTest, ResolutionLadder) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+  const std::vector<std::pair<int, int>> dimensions = {
+      {kDefaultWidth / 4, 0}, {kDefaultWidth / 2, kDefaultHeight / 2}};
+  std::vector<WebPData> animations;
+  ASSERT_EQ(thumbnailer.GenerateAnimationResolutions(dimensions, &animations),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(animations.size(), dimensions.size());
+  for (std::size_t i = 0; i < dimensions.size(); ++i) {
+    WebPBitstreamFeatures features;
+    ASSERT_EQ(WebPGetFeatures(animations[i].bytes, animations[i].size,
+                              &features),
+              VP8_STATUS_OK);
+    EXPECT_EQ(features.width, dimensions[i].first);
+    EXPECT_EQ(features.height, int(kDefaultHeight * (i + 1) / 4));
+  }
+  // The statistics add up the work of both resolutions, but the frames and
+  // the animation size describe the largest one.
+  const thumbnailer::ThumbnailerStats& stats = thumbnailer.stats();
+  EXPECT_EQ(stats.animation_size(), animations[1].size);
+  EXPECT_EQ(stats.frames_size(), 5);
+  EXPECT_GE(stats.num_encodes(), 2 * 5);
+  EXPECT_GE(stats.num_assemblies(), 2);
+  bool has_rescale_phase = false;
+  for (const thumbnailer::ThumbnailerStats::Phase& phase : stats.phases()) {
+    has_rescale_phase |= (phase.name() == "rescale");
+  }
+  EXPECT_TRUE(has_rescale_phase);
+  for (WebPData& animation : animations) WebPDataClear(&animation);
+
+  // The tall rung does not fit in the wide one despite its larger area, so
+  // both are downscaled from the source.
+  const std::vector<std::pair<int, int>> crossed_dimensions = {
+      {kDefaultWidth, kDefaultHeight / 4}, {kDefaultWidth / 4, kDefaultHeight}};
+  ASSERT_EQ(thumbnailer.GenerateAnimationResolutions(crossed_dimensions,
+                                                     &animations),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(animations.size(), crossed_dimensions.size());
+  for (std::size_t i = 0; i < crossed_dimensions.size(); ++i) {
+    WebPBitstreamFeatures features;
+    ASSERT_EQ(WebPGetFeatures(animations[i].bytes, animations[i].size,
+                              &features),
+              VP8_STATUS_OK);
+    EXPECT_EQ(features.width, crossed_dimensions[i].first);
+    EXPECT_EQ(features.height, crossed_dimensions[i].second);
+    WebPDataClear(&animations[i]);
+  }
+
+  // Upscaling is rejected.
+  EXPECT_EQ(thumbnailer.GenerateAnimationResolutions(
+                {{kDefaultWidth * 2, kDefaultHeight * 2}}, &animations),
+            libwebp::Thumbnailer::kImageFormatError);
+}
+
+TEST(ThumbnailerTest, ResolutionLadderUsesCaches) {
+  const std::string cache_dir =
+      ::testing::TempDir() + "thumbnailer_test_resolutions_cache_" +
+      std::to_string(getpid());
+  libwebp::OutputCache output_cache(cache_dir, /*max_size=*/1 << 20);
+  libwebp::RDCache rd_cache;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  const std::vector<std::pair<int, int>> dimensions = {
+      {kDefaultWidth / 4, 0}, {kDefaultWidth / 2, 0}};
+
+  for (int run = 0; run < 2; ++run) {
+    libwebp::Thumbnailer thumbnailer;
+    ASSERT_EQ(thumbnailer.SetOutputCache(&output_cache),
+              libwebp::Thumbnailer::kOk);
+    ASSERT_EQ(thumbnailer.SetRDCache(&rd_cache), libwebp::Thumbnailer::kOk);
+    int num_reports = 0;
+    thumbnailer.SetProgressCallback(
+        [&num_reports](const libwebp::Thumbnailer::Progress&) {
+          ++num_reports;
+        });
+    ASSERT_EQ(AddTestFrames(&thumbnailer, pics, 5), libwebp::Thumbnailer::kOk);
+    std::vector<WebPData> animations;
+    ASSERT_EQ(thumbnailer.GenerateAnimationResolutions(dimensions, &animations),
+              libwebp::Thumbnailer::kOk);
+    for (WebPData& animation : animations) WebPDataClear(&animation);
+    EXPECT_GT(num_reports, 0);
+    // The second run is answered by the output cache for both resolutions.
+    EXPECT_EQ(thumbnailer.stats().output_cache_hit(), run == 1);
+  }
+  // The measurements of both resolutions went through the shared RD cache.
+  EXPECT_GT(rd_cache.size(), 0u);
+}
+
+// Returns a socket connected to the server listening on 'socket_path', or -1.
+int ConnectToServer(const std::string& socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+TEST(ThumbnailerTest, ServerRoundTrip) {
+  const std::string socket_path =
+      "/tmp/thumbnailer_test_" + std::to_string(getpid()) + ".sock";
+  libwebp::ThumbnailerServer server(socket_path, /*num_threads=*/2);
+  ASSERT_TRUE(server.Start());
+  std::thread server_thread([&server]() { server.Serve(); });
+
+  thumbnailer::ThumbnailerRequest request;
+  request.set_algorithm("equal_psnr");
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, true).GeneratePics();
+  for (int i = 0; i < 5; ++i) {
+    WebPConfig config;
+    ASSERT_TRUE(WebPConfigInit(&config));
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    pics[i]->writer = WebPMemoryWrite;
+    pics[i]->custom_ptr = &writer;
+    ASSERT_TRUE(WebPEncode(&config, pics[i].get()));
+    thumbnailer::InputFrame* const frame = request.add_frames();
+    frame->set_data(writer.mem, writer.size);
+    frame->set_timestamp_ms(i * 500);
+    WebPMemoryWriterClear(&writer);
+  }
+
+  // Two requests over the same connection, then one over another connection.
+  // The frames are measured once, whatever the connection.
+  size_t rd_cache_size = 0;
+  for (int c = 0; c < 2; ++c) {
+    const int fd = ConnectToServer(socket_path);
+    ASSERT_GE(fd, 0);
+    for (int i = 0; i < 2 - c; ++i) {
+      thumbnailer::ThumbnailerResponse response;
+      ASSERT_TRUE(libwebp::WriteMessage(fd, request));
+      ASSERT_TRUE(libwebp::ReadMessage(fd, &response));
+      EXPECT_EQ(response.status(), libwebp::Thumbnailer::kOk);
+      EXPECT_GT(response.animation().size(), 0);
+      EXPECT_LE(response.animation().size(), kDefaultBudget);
+    }
+    close(fd);
+    if (c == 0) rd_cache_size = server.rd_cache().size();
+    EXPECT_GT(rd_cache_size, 0);
+    EXPECT_EQ(server.rd_cache().size(), rd_cache_size);
+  }
+
+  server.Stop();
+  server_thread.join();
+}
+
+TEST(ThumbnailerTest, ServerLimits) {
+  const std::string socket_path =
+      "/tmp/thumbnailer_test_limits_" + std::to_string(getpid()) + ".sock";
+  libwebp::ThumbnailerServer server(socket_path, /*num_threads=*/1,
+                                    /*output_cache=*/nullptr,
+                                    /*max_request_size=*/1024);
+  ASSERT_TRUE(server.Start());
+  std::thread server_thread([&server]() { server.Serve(); });
+
+  // An idle client and a client sending half of a request do not hold the
+  // only worker.
+  const int idle_fd = ConnectToServer(socket_path);
+  ASSERT_GE(idle_fd, 0);
+  const int partial_fd = ConnectToServer(socket_path);
+  ASSERT_GE(partial_fd, 0);
+  const uint8_t partial_request[] = {100, 0, 0, 0, 1, 2};
+  ASSERT_EQ(send(partial_fd, partial_request, sizeof(partial_request), 0),
+            ssize_t(sizeof(partial_request)));
+
+  // A request announcing more than the limit closes the connection, before
+  // its bytes are sent.
+  const int oversized_fd = ConnectToServer(socket_path);
+  ASSERT_GE(oversized_fd, 0);
+  const uint8_t oversized_prefix[] = {0, 0, 0x10, 0};  // 1 MiB.
+  ASSERT_EQ(send(oversized_fd, oversized_prefix, sizeof(oversized_prefix), 0),
+            ssize_t(sizeof(oversized_prefix)));
+  thumbnailer::ThumbnailerResponse response;
+  EXPECT_FALSE(libwebp::ReadMessage(oversized_fd, &response));
+  close(oversized_fd);
+
+  // A request without frames is still answered.
+  const int fd = ConnectToServer(socket_path);
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(libwebp::WriteMessage(fd, thumbnailer::ThumbnailerRequest()));
+  ASSERT_TRUE(libwebp::ReadMessage(fd, &response));
+  close(fd);
+  close(partial_fd);
+  close(idle_fd);
+
+  server.Stop();
+  server_thread.join();
+}
+
+TEST(ThumbnailerTest, BDRate) {
+  const std::vector<libwebp::RDPoint> reference = {
+      {10000, 30.}, {20000, 33.}, {40000, 36.}, {80000, 40.}};
+  std::vector<libwebp::RDPoint> test = reference;
+  for (libwebp::RDPoint& point : test) point.size *= 0.9;
+  double bd_rate;
+  ASSERT_EQ(libwebp::BDRate(reference, test, &bd_rate), libwebp::kOk);
+  EXPECT_NEAR(bd_rate, -10., 1e-6);
+  ASSERT_EQ(libwebp::BDRate(reference, reference, &bd_rate), libwebp::kOk);
+  EXPECT_NEAR(bd_rate, 0., 1e-6);
+
+  // No overlap in PSNR.
+  EXPECT_NE(libwebp::BDRate(reference, {{1000, 20.}, {2000, 25.}}, &bd_rate),
+            libwebp::kOk);
+}
+
+// Returns true if the ARGB samples of 'a' and 'b' are the same.
+bool SamePixels(const WebPPicture& a, const WebPPicture& b) {
+  if (a.width != b.width || a.height != b.height) return false;
+  for (int y = 0; y < a.height; ++y) {
+    if (memcmp(a.argb + y * a.argb_stride, b.argb + y * b.argb_stride,
+               a.width * sizeof(*a.argb)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST(ThumbnailerTest, SyntheticFrames) {
+  libwebp::SyntheticOptions options;
+  options.width = 96;
+  options.height = 54;
+  options.num_frames = 4;
+  options.scene_length = 2;
+  options.transparency = true;
+  std::vector<libwebp::Frame> frames, same_frames, other_frames;
+  ASSERT_EQ(libwebp::GenerateSyntheticFrames(options, &frames), libwebp::kOk);
+  ASSERT_EQ(libwebp::GenerateSyntheticFrames(options, &same_frames),
+            libwebp::kOk);
+  options.seed = 1;
+  ASSERT_EQ(libwebp::GenerateSyntheticFrames(options, &other_frames),
+            libwebp::kOk);
+  ASSERT_EQ(frames.size(), 4u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(frames[i].timestamp, (i + 1) * options.frame_duration_ms);
+    EXPECT_TRUE(SamePixels(*frames[i].pic, *same_frames[i].pic));
+    EXPECT_FALSE(SamePixels(*frames[i].pic, *other_frames[i].pic));
+  }
+  EXPECT_TRUE(WebPPictureHasTransparency(frames[0].pic.get()));
+
+  // Without motion nor noise, the frames only change at the scene cut.
+  options.camera_pan = false;
+  options.num_sprites = 0;
+  options.text = false;
+  options.noise = 0;
+  std::vector<libwebp::Frame> still_frames;
+  ASSERT_EQ(libwebp::GenerateSyntheticFrames(options, &still_frames),
+            libwebp::kOk);
+  EXPECT_TRUE(SamePixels(*still_frames[0].pic, *still_frames[1].pic));
+  EXPECT_FALSE(SamePixels(*still_frames[1].pic, *still_frames[2].pic));
+
+  libwebp::Thumbnailer thumbnailer;
+  for (const libwebp::Frame& frame : frames) {
+    ASSERT_EQ(thumbnailer.AddFrame(*frame.pic, frame.timestamp),
+              libwebp::Thumbnailer::kOk);
+  }
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+}
+
+// Returns a PNM image after 'header' whose 'size' samples are all 'value'.
+std::string PNMImage(const std::string& header, size_t size, char value) {
+  return header + std::string(size, value);
+}
+
+// Feeds 'data' to PNMStreamReadNext() through a pipe, a few bytes at a time
+// so that headers and rows arrive in pieces. Appends the decoded pictures to
+// 'pics' and returns the result of the last PNMStreamReadNext() call.
+int ReadPNMStreamPipe(const std::string& data,
+                      std::vector<EnclosedWebPPicture>* const pics) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) return -1;
+  std::thread writer([&data, &pipe_fds]() {
+    for (size_t offset = 0; offset < data.size(); offset += 7) {
+      const size_t size = std::min<size_t>(7, data.size() - offset);
+      if (write(pipe_fds[1], data.data() + offset, size) != ssize_t(size)) {
+        break;
+      }
+    }
+    close(pipe_fds[1]);
+  });
+  PNMStream* const stream = PNMStreamNew(pipe_fds[0], /*buffer_size=*/0);
+  int result = -1;
+  while (stream != nullptr) {
+    EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pic.get());
+    pic->use_argb = 1;
+    result = PNMStreamReadNext(stream, pic.get(), /*keep_alpha=*/1);
+    if (result != 1) break;
+    pics->push_back(std::move(pic));
+  }
+  PNMStreamDelete(stream);
+  writer.join();
+  close(pipe_fds[0]);
+  return result;
+}
+
+TEST(ThumbnailerTest, PNMStream) {
+  const std::string stream =
+      PNMImage("P6\n# comment\n4 3\n255\n", 4 * 3 * 3, 10) +
+      PNMImage("P6 320 240 255\n", 320 * 240 * 3, 20) +
+      PNMImage("P7\nWIDTH 5\nHEIGHT 2\nDEPTH 4\nMAXVAL 255\n"
+               "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+               5 * 2 * 4, 30) +
+      PNMImage("P6\n2 # comment\n 2\n255\n", 2 * 2 * 3, 40);
+  const int widths[] = {4, 320, 5, 2};
+  const int heights[] = {3, 240, 2, 2};
+  const uint32_t colors[] = {0xff0a0a0a, 0xff141414, 0x1e1e1e1e, 0xff282828};
+
+  std::vector<EnclosedWebPPicture> pics;
+  EXPECT_EQ(ReadPNMStreamPipe(stream, &pics), 0);
+  ASSERT_EQ(pics.size(), 4u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(pics[i]->width, widths[i]);
+    EXPECT_EQ(pics[i]->height, heights[i]);
+    EXPECT_EQ(pics[i]->argb[0], colors[i]);
+  }
+
+  // A truncated header or image fails after the complete images.
+  for (const std::string& truncated :
+       {stream + "P6 4 3", stream + PNMImage("P6 4 3 255\n", 35, 0)}) {
+    pics.clear();
+    EXPECT_EQ(ReadPNMStreamPipe(truncated, &pics), -1);
+    EXPECT_EQ(pics.size(), 4u);
+  }
+}
+
+// Returns an uncompressed little-endian RGB TIFF with one 'width' x 'height'
+// page per color (0xRRGGBB) of 'colors', each page filled with its color.
+std::string MultiPageTIFF(int width, int height,
+                          const std::vector<uint32_t>& colors) {
+  std::string tiff = "II*";
+  tiff.push_back('\0');
+  auto put16 = [&tiff](uint32_t value) {
+    tiff.push_back(value & 0xff);
+    tiff.push_back((value >> 8) & 0xff);
+  };
+  auto put32 = [&put16](uint32_t value) {
+    put16(value & 0xffff);
+    put16(value >> 16);
+  };
+  size_t next_ifd_offset = tiff.size();
+  put32(0);
+  for (uint32_t color : colors) {
+    const uint32_t strip_offset = tiff.size();
+    for (int i = 0; i < width * height; ++i) {
+      tiff.push_back((color >> 16) & 0xff);
+      tiff.push_back((color >> 8) & 0xff);
+      tiff.push_back(color & 0xff);
+    }
+    if (tiff.size() & 1) tiff.push_back('\0');  // Values are word-aligned.
+    const uint32_t bits_offset = tiff.size();
+    for (int i = 0; i < 3; ++i) put16(8);
+
+    // Links the previous IFD (or the header) to this one.
+    const uint32_t ifd_offset = tiff.size();
+    for (int i = 0; i < 4; ++i) {
+      tiff[next_ifd_offset + i] = (ifd_offset >> (8 * i)) & 0xff;
+    }
+    const uint16_t kShort = 3, kLong = 4;
+    const struct {
+      uint16_t tag, type;
+      uint32_t count, value;  // Left-justified if it fits, offset otherwise.
+    } entries[] = {
+        {256, kShort, 1, uint32_t(width)},   // ImageWidth
+        {257, kShort, 1, uint32_t(height)},  // ImageLength
+        {258, kShort, 3, bits_offset},       // BitsPerSample
+        {259, kShort, 1, 1},                 // Compression: none
+        {262, kShort, 1, 2},                 // PhotometricInterpretation: RGB
+        {273, kLong, 1, strip_offset},       // StripOffsets
+        {277, kShort, 1, 3},                 // SamplesPerPixel
+        {278, kShort, 1, uint32_t(height)},  // RowsPerStrip
+        {279, kLong, 1, uint32_t(width * height * 3)},  // StripByteCounts
+        {284, kShort, 1, 1},                 // PlanarConfiguration: chunky
+    };
+    put16(sizeof(entries) / sizeof(entries[0]));
+    for (const auto& entry : entries) {
+      put16(entry.tag);
+      put16(entry.type);
+      put32(entry.count);
+      put32(entry.value);
+    }
+    next_ifd_offset = tiff.size();
+    put32(0);
+  }
+  return tiff;
+}
+
+// Writes 'data' to a new temporary file and returns its path.
+std::string WriteTempFile(const std::string& name, const std::string& data) {
+  const std::string path =
+      ::testing::TempDir() + name + "_" + std::to_string(getpid());
+  std::ofstream(path, std::ios::binary) << data;
+  return path;
+}
+
+TEST(ThumbnailerTest, ReadTIFFPages) {
+  const std::vector<uint32_t> colors = {0x0a141e, 0x28323c, 0x46505a};
+  const std::string tiff = MultiPageTIFF(/*width=*/6, /*height=*/5, colors);
+
+  std::vector<EnclosedWebPPicture> pics;
+  auto add_page = [](WebPPicture* const pic, int page, void* const user_data) {
+    auto* const pics =
+        static_cast<std::vector<EnclosedWebPPicture>*>(user_data);
+    EXPECT_EQ(page, int(pics->size()));
+    pics->emplace_back(new WebPPicture(*pic), libwebp::WebPPictureDelete);
+    return 1;
+  };
+  EXPECT_EQ(ReadTIFFPages(reinterpret_cast<const uint8_t*>(tiff.data()),
+                          tiff.size(), /*keep_alpha=*/1, add_page, &pics),
+            3);
+  ASSERT_EQ(pics.size(), 3u);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(pics[i]->width, 6);
+    EXPECT_EQ(pics[i]->height, 5);
+    EXPECT_EQ(pics[i]->argb[0], 0xff000000u | colors[i]);
+    EXPECT_EQ(pics[i]->argb[pics[i]->argb_stride * 4 + 5],
+              0xff000000u | colors[i]);
+  }
+
+  // TIFF has no timing: the pages are spaced by the frame duration.
+  const std::string path = WriteTempFile("thumbnailer_test_pages.tiff", tiff);
+  std::vector<libwebp::Frame> frames;
+  EXPECT_EQ(libwebp::ReadAnimatedImage(
+                path.c_str(), /*frame_duration_ms=*/250,
+                [&frames](libwebp::Frame frame) {
+                  frames.push_back(std::move(frame));
+                  return true;
+                }),
+            libwebp::kOk);
+  ASSERT_EQ(frames.size(), 3u);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(frames[i].timestamp, (i + 1) * 250);
+    EXPECT_EQ(frames[i].pic->argb[0], 0xff000000u | colors[i]);
+  }
+
+  // A rejected page stops the decoding and fails the whole source.
+  int num_frames = 0;
+  EXPECT_EQ(libwebp::ReadAnimatedImage(path.c_str(), /*frame_duration_ms=*/250,
+                                       [&num_frames](libwebp::Frame) {
+                                         return ++num_frames < 2;
+                                       }),
+            libwebp::kGenericError);
+  EXPECT_EQ(num_frames, 2);
+  remove(path.c_str());
+
+  // Truncated pages are an error.
+  EXPECT_EQ(ReadTIFFPages(reinterpret_cast<const uint8_t*>(tiff.data()), 8,
+                          /*keep_alpha=*/1, add_page, &pics),
+            -1);
+}
+
+TEST(ThumbnailerTest, ReadAnimatedWebP) {
+  const int timestamps[] = {400, 700, 1500, 1600, 2600};
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(/*pic_count=*/5, 0xff, false).GeneratePics();
+  libwebp::Thumbnailer thumbnailer;
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], timestamps[i]),
+              libwebp::Thumbnailer::kOk);
+  }
+  ScopedWebPData webp_data;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  const std::vector<uint8_t> animation = webp_data.bytes();
+  const std::string path =
+      WriteTempFile("thumbnailer_test_animation.webp",
+                    std::string(animation.begin(), animation.end()));
+
+  // The frames keep the timestamps of the container, not the frame duration.
+  std::vector<libwebp::Frame> frames;
+  EXPECT_EQ(libwebp::ReadAnimatedImage(
+                path.c_str(), /*frame_duration_ms=*/100,
+                [&frames](libwebp::Frame frame) {
+                  frames.push_back(std::move(frame));
+                  return true;
+                }),
+            libwebp::kOk);
+  remove(path.c_str());
+  ASSERT_EQ(frames.size(), 5u);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(frames[i].timestamp, timestamps[i]);
+    EXPECT_EQ(frames[i].pic->width, kDefaultWidth);
+    EXPECT_EQ(frames[i].pic->height, kDefaultHeight);
+  }
+}
+
+TEST(ThumbnailerTest, BatchWithFailingJob) {
+  const std::string tiff = MultiPageTIFF(/*width=*/32, /*height=*/24,
+                                         {0x102030, 0x405060, 0x708090});
+  const std::string input = WriteTempFile("thumbnailer_test_batch.tiff", tiff);
+  const std::string output_prefix = ::testing::TempDir() +
+                                    "thumbnailer_test_batch_" +
+                                    std::to_string(getpid()) + "_";
+
+  // The second job reads a missing input.
+  std::string manifest_text;
+  for (int i = 0; i < 4; ++i) {
+    const std::string job_input = (i == 1) ? input + "_missing" : input;
+    manifest_text += "jobs { input: \"" + job_input + "\" output: \"" +
+                     output_prefix + std::to_string(i) +
+                     ".webp\" algorithm: \"equal_psnr\" }\n";
+  }
+  const std::string manifest_path =
+      WriteTempFile("thumbnailer_test_batch.textproto", manifest_text);
+  thumbnailer::BatchManifest manifest;
+  ASSERT_TRUE(libwebp::ReadBatchManifest(manifest_path, &manifest));
+  remove(manifest_path.c_str());
+  ASSERT_EQ(manifest.jobs_size(), 4);
+
+  libwebp::Thumbnailer thumbnailer;
+  std::string error;
+  EXPECT_FALSE(libwebp::RunBatchJob(manifest.jobs(1), &thumbnailer, &error));
+  EXPECT_FALSE(error.empty());
+
+  // The failure is counted and does not stop the other jobs.
+  EXPECT_EQ(libwebp::RunBatch(manifest, /*max_concurrent_jobs=*/2), 1);
+  remove(input.c_str());
+  for (int i = 0; i < 4; ++i) {
+    const std::string output = output_prefix + std::to_string(i) + ".webp";
+    std::ifstream file(output, std::ios::binary);
+    EXPECT_EQ(file.is_open(), i != 1) << output;
+    if (!file.is_open()) continue;
+    const std::string animation((std::istreambuf_iterator<char>(file)),
+                                std::istreambuf_iterator<char>());
+    WebPData webp_data = {reinterpret_cast<const uint8_t*>(animation.data()),
+                          animation.size()};
+    std::vector<libwebp::Frame> frames;
+    EXPECT_EQ(libwebp::AnimData2Frames(&webp_data, &frames), libwebp::kOk);
+    EXPECT_EQ(frames.size(), 3u);
+    remove(output.c_str());
+  }
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();